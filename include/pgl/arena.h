@@ -0,0 +1,229 @@
+/** \file arena.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the arena allocator for scene graph nodes.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PGL_ARENA_H_
+#define PGL_ARENA_H_
+
+#include <stdlib.h>
+#include <cstddef>
+#include <iostream>
+#include <new>
+#include <vector>
+
+namespace pgl {
+
+/**
+ * \brief Arena allocator for scene graph nodes.
+ *
+ * Nodes created with new while an Arena::Scope is active are allocated
+ * from large blocks owned by the arena, instead of individually from the
+ * heap. Nodes created one after the other, such as siblings, are
+ * therefore stored contiguously. Deleting a node returns its memory to
+ * the arena for reuse by nodes of the same size, and reset() recycles
+ * all blocks at once. For example, to regenerate a scene every episode,
+ * \code
+ * pgl::Arena arena;
+ *
+ * while (running)
+ * {
+ *   pgl::Scene *scene;
+ *   {
+ *     pgl::Arena::Scope scope(&arena);
+ *     scene = build();
+ *   }
+ *
+ *   run(scene);
+ *
+ *   delete scene;
+ *   arena.reset();
+ * }
+ * \endcode
+ *
+ * Ownership is unchanged: nodes are still deleted by their parent, and
+ * nodes from different arenas and the heap can be mixed in one graph.
+ *
+ * \note
+ * An arena is not thread-safe, and must outlive all nodes allocated
+ * from it.
+ */
+class Arena
+{
+  public:
+    /// Makes an arena current for node allocations on this thread, until destruction.
+    class Scope
+    {
+      protected:
+        Arena *previous_;
+
+      public:
+        Scope(Arena *arena) : previous_(current())
+        {
+          current() = arena;
+        }
+
+        ~Scope()
+        {
+          current() = previous_;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope &operator=(const Scope&) = delete;
+    };
+
+    /// Header before every node, identifying the arena it was allocated from.
+    struct alignas(alignof(std::max_align_t)) Header
+    {
+      Arena *arena;
+    };
+
+  protected:
+    static const size_t granularity_ = sizeof(Header); ///< Allocation granularity.
+
+    size_t block_;                ///< Size of new blocks.
+    std::vector<char*> blocks_;   ///< Allocated blocks.
+    size_t current_;              ///< Index of the block being filled.
+    size_t used_;                 ///< Bytes used in the block being filled.
+    std::vector<void*> free_;     ///< Free lists, by size in units of the granularity.
+    size_t live_;                 ///< Number of live allocations.
+
+  public:
+    /// Specifies the size of the blocks in bytes.
+    Arena(size_t block=1 << 20) : block_(block), current_(0), used_(0), live_(0) { }
+
+    Arena(const Arena&) = delete;
+    Arena &operator=(const Arena&) = delete;
+
+    /// Frees all blocks.
+    ~Arena()
+    {
+      if (live_)
+        std::cerr << "Arena destroyed while " << live_ << " nodes are alive" << std::endl;
+
+      for (size_t ii=0; ii != blocks_.size(); ++ii)
+        free(blocks_[ii]);
+    }
+
+    /// Returns number of live allocations.
+    size_t size() const
+    {
+      return live_;
+    }
+
+    /// Returns number of bytes reserved in blocks.
+    size_t capacity() const
+    {
+      return blocks_.size()*block_;
+    }
+
+    /// Reuses all blocks, without freeing them. Requires all nodes to have been deleted.
+    void reset()
+    {
+      if (live_)
+      {
+        std::cerr << "Cannot reset arena while " << live_ << " nodes are alive" << std::endl;
+        return;
+      }
+
+      free_.clear();
+      current_ = used_ = 0;
+    }
+
+    /// Allocates size bytes, aligned to the granularity.
+    void *allocate(size_t size)
+    {
+      size = (size + granularity_ - 1)/granularity_*granularity_;
+      if (size > block_)
+        throw std::bad_alloc();
+
+      live_++;
+
+      size_t idx = size/granularity_;
+      if (idx < free_.size() && free_[idx])
+      {
+        void *ptr = free_[idx];
+        free_[idx] = *(void**)ptr;
+        return ptr;
+      }
+
+      if (blocks_.empty() || used_ + size > block_)
+      {
+        if (!blocks_.empty())
+          current_++;
+        if (current_ == blocks_.size())
+        {
+          char *block = (char*)malloc(block_);
+          if (!block)
+            throw std::bad_alloc();
+          blocks_.push_back(block);
+        }
+        used_ = 0;
+      }
+
+      void *ptr = blocks_[current_] + used_;
+      used_ += size;
+      return ptr;
+    }
+
+    /// Returns memory to the arena, for reuse by allocations of the same size.
+    void deallocate(void *ptr, size_t size)
+    {
+      size_t idx = (size + granularity_ - 1)/granularity_;
+      if (idx >= free_.size())
+        free_.resize(idx+1, NULL);
+
+      *(void**)ptr = free_[idx];
+      free_[idx] = ptr;
+      live_--;
+    }
+
+    /// Returns arena used for node allocations on this thread, or NULL for the heap.
+    static Arena *&current()
+    {
+      static thread_local Arena *arena = NULL;
+      return arena;
+    }
+
+    /// Allocates node from the current arena or the heap, preceded by a Header.
+    static void *allocateNode(size_t size)
+    {
+      Arena *arena = current();
+      Header *header = (Header*)(arena?arena->allocate(sizeof(Header) + size) : ::operator new(sizeof(Header) + size));
+      header->arena = arena;
+      return header+1;
+    }
+
+    /// Frees node allocated by allocateNode().
+    static void deallocateNode(void *ptr, size_t size)
+    {
+      if (!ptr)
+        return;
+
+      Header *header = (Header*)ptr - 1;
+      if (header->arena)
+        header->arena->deallocate(header, sizeof(Header) + size);
+      else
+        ::operator delete(header);
+    }
+};
+
+}
+
+#endif // PGL_ARENA_H_
@@ -0,0 +1,320 @@
+/** \file backend.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the rendering backend selection and state.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PGL_BACKEND_H_
+#define PGL_BACKEND_H_
+
+#include "math.h"
+
+// PGL_VBO selects the vertex buffer backend by default, which requires
+// the OpenGL 3.3 functions enabled by PGL_MODERN.
+#if defined(PGL_VBO) && !defined(PGL_MODERN)
+#define PGL_MODERN
+#endif
+
+#ifdef PGL_MODERN
+#ifndef GL_GLEXT_PROTOTYPES
+// Without an extension loader, glext.h only declares the functions if
+// the define precedes its first inclusion, e.g. through GLFW.
+#if (defined(__gl_h_) || defined(__gl_glext_h_)) && !defined(PGL_EXTENSION_LOADER) && !defined(__glew_h__) && !defined(__glad_h_)
+#error "PGL_MODERN requires GL_GLEXT_PROTOTYPES to be defined before GL/gl.h is included. Include pgl.h before GLFW, or define GL_GLEXT_PROTOTYPES (or PGL_EXTENSION_LOADER when using one) first."
+#endif
+#define GL_GLEXT_PROTOTYPES
+#endif
+#endif
+
+#include <GL/gl.h>
+
+#ifdef PGL_MODERN
+#include <GL/glext.h>
+#endif
+
+#include <iostream>
+#include <vector>
+
+namespace pgl {
+
+class RenderQueue;
+class Profiler;
+
+/// Rendering backend.
+enum Backend
+{
+  backendDisplayList, ///< Legacy display lists and OpenGL matrix stack.
+  backendVBO          ///< Vertex buffer objects and built-in shader. Requires PGL_MODERN.
+};
+
+/**
+ * \brief Rendering state.
+ *
+ * Selects the rendering backend, and keeps track of the transforms
+ * for backends that cannot use the OpenGL matrix stack. Set up by
+ * Camera::draw().
+ *
+ * \note
+ * The backend can be changed at any time. Meshes are uploaded again
+ * when they are drawn using a different backend.
+ */
+class Context
+{
+  public:
+    Backend backend;      ///< Rendering backend.
+    Transform projection; ///< Projection matrix. Not used by backendDisplayList.
+    Transform view;       ///< Camera view transform. Only used by backendDisplayList when sorting.
+    Vector3 light;        ///< Light direction in eye coordinates. Not used by backendDisplayList.
+    bool culling;         ///< Whether to skip nodes outside the frustum.
+    bool bounded;         ///< Whether node bounds are up to date, as after Scene::update(). Set when culling.
+    Frustum frustum;      ///< World-space view frustum. Only valid when culling.
+    std::vector<Frustum> frusta; ///< Frusta of additional views drawn in the same traversal. Nodes are culled only if outside all.
+    double lod;           ///< Tolerated tessellation error in pixels, or 0 to disable automatic level of detail.
+    Vector3 eye;          ///< Camera position in world coordinates. Only valid when lod > 0.
+    double focal;         ///< Viewport pixels per unit at unit distance. Only valid when lod > 0.
+    RenderQueue *queue;   ///< Queue that primitives add themselves to instead of drawing, or NULL.
+    Profiler *profiler;   ///< Profiler that records statistics, or NULL.
+
+  public:
+    Context() : projection({0, 0, 0}, {0, 0, 0}), view({0, 0, 0}, {0, 0, 0}), light(0, 0, 1), culling(false), bounded(false), lod(0), eye(0, 0, 0), focal(0), queue(NULL), profiler(NULL)
+    {
+#ifdef PGL_VBO
+      backend = backendVBO;
+#else
+      backend = backendDisplayList;
+#endif
+    }
+
+    /// Returns the global rendering state.
+    static Context &current()
+    {
+      static Context *context = new Context();
+      return *context;
+    }
+
+    /** \brief Returns the OpenGL version of the current context, e.g. 43 for 4.3.
+     *
+     * Queried once a context is current. Always 0 without PGL_MODERN.
+     */
+    static int glversion()
+    {
+#ifdef PGL_MODERN
+      static int version = 0;
+      if (!version)
+      {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        version = major*10 + minor;
+      }
+
+      return version;
+#else
+      return 0;
+#endif
+    }
+};
+
+#ifdef PGL_MODERN
+/**
+ * \brief Built-in shader of the VBO backend.
+ *
+ * Reproduces the fixed-function pipeline as set up in the example:
+ * GL_LIGHT0 with default parameters, GL_COLOR_MATERIAL for ambient and
+ * diffuse, and GL_MODULATE texturing. Lighting is calculated per vertex.
+ */
+class Shader
+{
+  protected:
+    GLuint program_;
+    GLint projection_, modelview_, normalmatrix_, color_, light_, lighting_, textured_, instanced_;
+
+  public:
+    /// Returns the built-in shader. Compiled on first use.
+    static Shader &builtin()
+    {
+      static Shader *shader = new Shader();
+      return *shader;
+    }
+
+    /// Use this shader for subsequent drawing.
+    void use() const
+    {
+      glUseProgram(program_);
+    }
+
+    /// Camera projection matrix.
+    void projection(const Transform &t) const
+    {
+      glUniformMatrix4fv(projection_, 1, GL_FALSE, Transform4f(t).data);
+    }
+
+    /// Modelview matrix. Also sets the corresponding normal matrix.
+    void modelview(const Transform &t) const
+    {
+      glUniformMatrix4fv(modelview_, 1, GL_FALSE, Transform4f(t).data);
+
+      // Inverse transpose of upper 3x3 part. The transpose of the
+      // inverse equals the cofactor matrix divided by the determinant.
+      const double *m = t.data;
+      double c[9] = {m[5]*m[10]-m[6]*m[9], m[6]*m[8]-m[4]*m[10], m[4]*m[9]-m[5]*m[8],
+                     m[9]*m[2]-m[10]*m[1], m[10]*m[0]-m[8]*m[2], m[8]*m[1]-m[9]*m[0],
+                     m[1]*m[6]-m[2]*m[5],  m[2]*m[4]-m[0]*m[6],  m[0]*m[5]-m[1]*m[4]};
+      double det = m[0]*c[0] + m[1]*c[1] + m[2]*c[2];
+
+      float normal[9];
+      for (size_t ii=0; ii != 9; ++ii)
+        normal[ii] = c[ii]/det;
+      glUniformMatrix3fv(normalmatrix_, 1, GL_FALSE, normal);
+    }
+
+    /// Primitive color.
+    void color(const Vector3 &c) const
+    {
+      glUniform3f(color_, c.x, c.y, c.z);
+    }
+
+    /// Light direction in eye coordinates.
+    void light(const Vector3 &l) const
+    {
+      glUniform3f(light_, l.x, l.y, l.z);
+    }
+
+    /// Whether to apply lighting.
+    void lighting(bool enabled) const
+    {
+      glUniform1i(lighting_, enabled);
+    }
+
+    /// Whether to modulate color with the texture bound to unit 0.
+    void textured(bool enabled) const
+    {
+      glUniform1i(textured_, enabled);
+    }
+
+    /** \brief Whether to apply per-instance attributes.
+     *
+     * When enabled, vertices are transformed by the per-instance matrix
+     * in attributes 3-6 before the modelview, and colored according to
+     * attribute 7 instead of the uniform color.
+     *
+     * \note
+     * Per-instance matrices may only rotate, translate and uniformly scale.
+     */
+    void instanced(bool enabled) const
+    {
+      glUniform1i(instanced_, enabled);
+    }
+
+  protected:
+    Shader()
+    {
+      const char *vs =
+        "#version 330 core\n"
+        "layout(location = 0) in vec3 position;\n"
+        "layout(location = 1) in vec3 normal;\n"
+        "layout(location = 2) in vec2 texcoord;\n"
+        "layout(location = 3) in mat4 itransform;\n"
+        "layout(location = 7) in vec3 icolor;\n"
+        "uniform mat4 projection, modelview;\n"
+        "uniform mat3 normalmatrix;\n"
+        "uniform vec3 color, light;\n"
+        "uniform bool lighting, instanced;\n"
+        "out vec4 fcolor;\n"
+        "out vec2 ftexcoord;\n"
+        "void main()\n"
+        "{\n"
+        "  vec4 p = vec4(position, 1);\n"
+        "  vec3 n = normal, c = color;\n"
+        "  if (instanced)\n"
+        "  {\n"
+        "    p = itransform*p;\n"
+        "    n = mat3(itransform)*n/dot(itransform[0].xyz, itransform[0].xyz);\n"
+        "    c = icolor;\n"
+        "  }\n"
+        "  gl_Position = projection*(modelview*p);\n"
+        "  ftexcoord = texcoord;\n"
+        "  if (lighting)\n"
+        "    fcolor = vec4(clamp(c*(0.2 + max(dot(normalmatrix*n, light), 0)), 0, 1), 1);\n"
+        "  else\n"
+        "    fcolor = vec4(c, 1);\n"
+        "}\n";
+
+      const char *fs =
+        "#version 330 core\n"
+        "in vec4 fcolor;\n"
+        "in vec2 ftexcoord;\n"
+        "uniform bool textured;\n"
+        "uniform sampler2D sampler;\n"
+        "out vec4 fragcolor;\n"
+        "void main()\n"
+        "{\n"
+        "  if (textured)\n"
+        "    fragcolor = fcolor*texture(sampler, ftexcoord);\n"
+        "  else\n"
+        "    fragcolor = fcolor;\n"
+        "}\n";
+
+      program_ = glCreateProgram();
+      glAttachShader(program_, compile(GL_VERTEX_SHADER, vs));
+      glAttachShader(program_, compile(GL_FRAGMENT_SHADER, fs));
+      glLinkProgram(program_);
+
+      GLint status;
+      glGetProgramiv(program_, GL_LINK_STATUS, &status);
+      if (!status)
+      {
+        char log[1024];
+        glGetProgramInfoLog(program_, 1024, NULL, log);
+        std::cerr << "Cannot link built-in shader: " << log << std::endl;
+      }
+
+      projection_   = glGetUniformLocation(program_, "projection");
+      modelview_    = glGetUniformLocation(program_, "modelview");
+      normalmatrix_ = glGetUniformLocation(program_, "normalmatrix");
+      color_        = glGetUniformLocation(program_, "color");
+      light_        = glGetUniformLocation(program_, "light");
+      lighting_     = glGetUniformLocation(program_, "lighting");
+      textured_     = glGetUniformLocation(program_, "textured");
+      instanced_    = glGetUniformLocation(program_, "instanced");
+    }
+
+    /// Compile shader stage. Errors are reported on std::cerr.
+    GLuint compile(GLenum type, const char *source)
+    {
+      GLuint shader = glCreateShader(type);
+      glShaderSource(shader, 1, &source, NULL);
+      glCompileShader(shader);
+
+      GLint status;
+      glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+      if (!status)
+      {
+        char log[1024];
+        glGetShaderInfoLog(shader, 1024, NULL, log);
+        std::cerr << "Cannot compile built-in shader: " << log << std::endl;
+      }
+
+      return shader;
+    }
+};
+#endif // PGL_MODERN
+
+}
+
+#endif // PGL_BACKEND_H_
@@ -0,0 +1,136 @@
+/** \file channel.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the lock-free transform channel.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_CHANNEL_H_
+#define PGL_CHANNEL_H_
+
+#include <algorithm>
+#include <atomic>
+
+namespace pgl {
+
+/**
+ * \brief Lock-free channel for updating Object transforms from another thread.
+ *
+ * A producer thread, e.g. a physics simulation, sets the transforms of a
+ * fixed set of Objects and publishes them as a batch. The render thread
+ * applies the latest published batch before drawing. Neither side ever
+ * blocks, and the renderer always sees a consistent snapshot.
+ * For example,
+ * \code
+ * pgl::TransformChannel channel({link1, link2});
+ *
+ * // Producer thread
+ * channel.set(0, pgl::Translation(p1));
+ * channel.set(1, pgl::Translation(p2));
+ * channel.publish();
+ *
+ * // Render thread
+ * channel.apply();
+ * camera->draw();
+ * \endcode
+ *
+ * Internally, the batches are triple buffered: the producer fills one
+ * buffer, the renderer reads another, and the third holds the latest
+ * published batch. Publishing and applying atomically exchange their
+ * buffer with the third one.
+ *
+ * \note
+ * Only one thread may produce and one thread may apply. The Objects must
+ * outlive the channel, and the scene graph itself must still only be
+ * modified by the render thread.
+ */
+class TransformChannel
+{
+  protected:
+    static const unsigned char fresh_ = 4; ///< Flag marking an unapplied batch in middle_.
+
+    std::vector<Object*> objects_;        ///< Objects whose transforms are set.
+    std::vector<Transform> shadow_;       ///< Producer's current transforms.
+    std::vector<Transform> buffers_[3];   ///< Triple buffer of published batches.
+    unsigned char back_, front_;          ///< Buffers owned by the producer and renderer.
+    std::atomic<unsigned char> middle_;   ///< Latest published buffer, and fresh_ flag.
+
+  public:
+    /// Specifies Objects whose transforms are set. Initial transforms are taken from the Objects.
+    TransformChannel(const std::vector<Object*> &objects) : objects_(objects), back_(0), front_(1), middle_(2)
+    {
+      for (size_t ii=0; ii != objects_.size(); ++ii)
+        shadow_.push_back(objects_[ii]->transform);
+      for (size_t ii=0; ii != 3; ++ii)
+        buffers_[ii] = shadow_;
+    }
+
+    TransformChannel(const TransformChannel&) = delete;
+    TransformChannel &operator=(const TransformChannel&) = delete;
+
+    /// Returns number of Objects.
+    size_t size() const
+    {
+      return objects_.size();
+    }
+
+    /// Sets transform of an Object in the next batch. Called by the producer.
+    void set(size_t index, const Transform &transform)
+    {
+      shadow_[index] = transform;
+    }
+
+    /// Returns transform of an Object in the next batch. Called by the producer.
+    const Transform &get(size_t index) const
+    {
+      return shadow_[index];
+    }
+
+    /** \brief Publishes current transforms as a batch. Called by the producer.
+     *
+     * Replaces any batch that has not been applied yet.
+     */
+    void publish()
+    {
+      std::copy(shadow_.begin(), shadow_.end(), buffers_[back_].begin());
+      back_ = middle_.exchange(back_ | fresh_, std::memory_order_acq_rel) & 3;
+    }
+
+    /** \brief Applies the latest published batch to the Objects. Called by the renderer.
+     *
+     * \returns false if nothing was published since the last call.
+     */
+    bool apply()
+    {
+      if (!(middle_.load(std::memory_order_relaxed) & fresh_))
+        return false;
+
+      front_ = middle_.exchange(front_, std::memory_order_acq_rel) & 3;
+
+      const std::vector<Transform> &batch = buffers_[front_];
+      for (size_t ii=0; ii != objects_.size(); ++ii)
+        objects_[ii]->transform = batch[ii];
+
+      return true;
+    }
+};
+
+}
+
+#endif // PGL_CHANNEL_H_
@@ -19,39 +19,52 @@
  * limitations under the License.
  */
 
+#include "pgl.h"
+
 #ifndef PGL_CONTROLLER_H_
 #define PGL_CONTROLLER_H_
 
-#include "pgl.h"
-
 namespace pgl {
 
-/// Camera Controller which orbits around a center
+/** \brief Camera Controller which orbits around a center
+ *
+ * If damping is set, the camera follows changes of the view smoothly
+ * instead of jumping to them, approaching the center, azimuth,
+ * elevation and distance exponentially with time constant damping.
+ * The motion is advanced by update(), which a RenderLoop calls every
+ * frame with the elapsed time, such that its speed does not depend on
+ * the frame rate or the rate of input events.
+ */
 class OrbitController : public Controller
 {
   public:
     Vector3 center;
     double azimuth, elevation, distance;
+    double damping; ///< Time constant of camera motion in seconds, or 0 to move immediately.
     
   protected:
     Vector3 old_center_;
     double old_azimuth_, old_elevation_, old_distance_, old_xpos_, old_ypos_;
     
+    Vector3 center_;                         ///< Current center, following center.
+    double azimuth_, elevation_, distance_;  ///< Current view, following azimuth, elevation and distance.
+    
     enum {modeNone, modeAngle, modeDistance, modeCenter} mode_;
     
   public:
-    OrbitController(Camera *_camera) : Controller(_camera), center{0, 0, 0}, azimuth(60*M_PI/180), elevation(35*M_PI/180), distance(2), mode_(modeNone)
+    OrbitController(Camera *_camera) : Controller(_camera), center{0, 0, 0}, azimuth(60*M_PI/180), elevation(35*M_PI/180), distance(2), damping(0), mode_(modeNone)
     {
-      apply();
+      jump();
     }
     
+    /// Sets view immediately, regardless of damping.
     void view(double _azimuth, double _elevation, double _distance)
     {
       azimuth = _azimuth;
       elevation = _elevation;
       distance = _distance;
       
-      apply();
+      jump();
     }
     
     void click(int button, int action, int /*mods*/, double xpos, double ypos)
@@ -100,9 +113,59 @@ class OrbitController : public Controller
       apply();
     }
     
+    /// Moves current view towards the requested one.
+    void update(double dt)
+    {
+      if (!damping || settled())
+        return;
+      
+      double alpha = 1-exp(-dt/damping);
+      center_    = center_ + (center-center_)*alpha;
+      azimuth_   += (azimuth-azimuth_)*alpha;
+      elevation_ += (elevation-elevation_)*alpha;
+      distance_  += (distance-distance_)*alpha;
+      
+      // Come to rest once the remaining motion is invisible.
+      double eps = 1e-4*distance_;
+      if ((center-center_).norm() < eps && fabs(azimuth-azimuth_) < 1e-4 &&
+          fabs(elevation-elevation_) < 1e-4 && fabs(distance-distance_) < eps)
+      {
+        jump();
+        return;
+      }
+      
+      transform();
+    }
+    
+    bool settled() const
+    {
+      return center_.x == center.x && center_.y == center.y && center_.z == center.z &&
+             azimuth_ == azimuth && elevation_ == elevation && distance_ == distance;
+    }
+    
+    /// Applies requested view, or starts moving towards it if damping is set.
     void apply()
     {
-      camera->transform = Transform({-0.5*M_PI+elevation, 0, 0}, {0, 0, -distance})*Rotation({0, 0, -azimuth})*Translation(-center);
+      if (!damping)
+        jump();
+    }
+    
+  protected:
+    /// Sets current view to requested one.
+    void jump()
+    {
+      center_    = center;
+      azimuth_   = azimuth;
+      elevation_ = elevation;
+      distance_  = distance;
+      
+      transform();
+    }
+    
+    /// Sets camera transform from current view.
+    void transform()
+    {
+      camera->transform = Transform({-0.5*M_PI+elevation_, 0, 0}, {0, 0, -distance_})*Rotation({0, 0, -azimuth_})*Translation(-center_);
     }
 };
 
@@ -0,0 +1,482 @@
+/** \file decimate.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains mesh simplification.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_DECIMATE_H_
+#define PGL_DECIMATE_H_
+
+#include "mesh.h"
+
+#include <unordered_map>
+#include <array>
+#include <string.h>
+#include <stdint.h>
+
+namespace pgl {
+
+/**
+ * \brief Mesh simplification.
+ *
+ * Reduces the number of triangles of a Mesh by collapsing edges in
+ * order of increasing quadric error (Garland & Heckbert, "Surface
+ * Simplification Using Quadric Error Metrics"). Instead of a priority
+ * queue, all edges below a gradually increasing error threshold are
+ * collapsed in each pass, which is much faster for large meshes.
+ *
+ * Used by Model to create simplified levels of detail, each having
+ * ratio times the triangles of the previous one.
+ *
+ * \note
+ * Only positions are considered. The simplified mesh has face normals
+ * and no texture coordinates, and is usually welded afterwards to
+ * obtain smooth normals.
+ */
+class Decimator
+{
+  public:
+    size_t levels; ///< Number of simplified levels.
+    double ratio;  ///< Fraction of triangles kept in each successive level.
+
+  public:
+    Decimator(size_t _levels=3, double _ratio=0.25) : levels(_levels), ratio(_ratio) { }
+
+    /// Returns parameters, for use as geometry cache key.
+    std::vector<double> key() const
+    {
+      return {(double)levels, ratio};
+    }
+
+    /** \brief Simplifies triangle mesh to a target number of triangles.
+     *
+     * Writes non-indexed triangles with face normals to out. Disconnected
+     * vertices at identical positions are treated as one.
+     *
+     * \returns approximate maximum deviation of the simplified surface
+     * from the input.
+     */
+    double apply(const Mesh &in, size_t target, Mesh &out) const
+    {
+      out.vertices.clear();
+      out.indices.clear();
+      out.bounds = Bounds();
+
+      if (in.mode != GL_TRIANGLES || in.bounds.empty())
+        return 0;
+
+      // Work in normalized coordinates, such that thresholds do not depend on scale.
+      Vector3 center = in.bounds.center();
+      double size = std::max(in.bounds.size().norm(), 1e-30);
+
+      Simplifier s(in, center, size);
+      double error = s.simplify(target);
+
+      for (size_t ii=0; ii != s.triangles.size(); ++ii)
+      {
+        const Simplifier::Triangle &t = s.triangles[ii];
+        if (t.deleted)
+          continue;
+
+        Vector3 p[3];
+        for (size_t jj=0; jj != 3; ++jj)
+          p[jj] = s.points[t.v[jj]].p*size + center;
+
+        Vector3 n = (p[1]-p[0]).cross(p[2]-p[0]);
+        double norm = n.norm();
+        if (norm == 0)
+          continue;
+        n = n/norm;
+
+        out.normal(n);
+        for (size_t jj=0; jj != 3; ++jj)
+          out.vertex(p[jj]);
+      }
+
+      return sqrt(error)*size;
+    }
+
+  protected:
+    /// Simplification state of a single mesh.
+    class Simplifier
+    {
+      public:
+        /// Symmetric 4x4 quadric, storing the upper triangle.
+        struct Quadric
+        {
+          double m[10];
+
+          Quadric() : m{0, 0, 0, 0, 0, 0, 0, 0, 0, 0} { }
+
+          /// Quadric of the plane ax + by + cz + d = 0.
+          Quadric(double a, double b, double c, double d) : m{a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d} { }
+
+          Quadric operator+(const Quadric &rhs) const
+          {
+            Quadric q;
+            for (size_t ii=0; ii != 10; ++ii)
+              q.m[ii] = m[ii] + rhs.m[ii];
+            return q;
+          }
+
+          /// Determinant of 3x3 submatrix, given by indices into m.
+          double det(int a11, int a12, int a13, int a21, int a22, int a23, int a31, int a32, int a33) const
+          {
+            return m[a11]*m[a22]*m[a33] + m[a13]*m[a21]*m[a32] + m[a12]*m[a23]*m[a31] -
+                   m[a13]*m[a22]*m[a31] - m[a11]*m[a23]*m[a32] - m[a12]*m[a21]*m[a33];
+          }
+
+          /// Sum of squared distances of point to the planes.
+          double error(const Vector3 &p) const
+          {
+            double x = p.x, y = p.y, z = p.z;
+            return m[0]*x*x + 2*m[1]*x*y + 2*m[2]*x*z + 2*m[3]*x + m[4]*y*y +
+                   2*m[5]*y*z + 2*m[6]*y + m[7]*z*z + 2*m[8]*z + m[9];
+          }
+        };
+
+        struct Triangle
+        {
+          uint32_t v[3];
+          double error[4]; ///< Error of each edge, and their minimum.
+          bool deleted, dirty;
+          Vector3 n;
+        };
+
+        struct Point
+        {
+          Vector3 p;
+          Quadric q;
+          uint32_t start, count; ///< Range of triangle references.
+          bool border;
+        };
+
+        /// Reference from a vertex to a corner of a triangle.
+        struct Ref
+        {
+          uint32_t triangle, corner;
+        };
+
+        /// Hashes exact vertex positions.
+        struct PositionHash
+        {
+          size_t operator()(const std::array<float, 3> &p) const
+          {
+            uint32_t bits[3];
+            memcpy(bits, p.data(), sizeof(bits));
+            return ((size_t)bits[0]*73856093u) ^ ((size_t)bits[1]*19349663u) ^ ((size_t)bits[2]*83492791u);
+          }
+        };
+
+        std::vector<Triangle> triangles;
+        std::vector<Point> points;
+        std::vector<Ref> refs;
+
+        /// Sets up connectivity from identical positions.
+        Simplifier(const Mesh &in, const Vector3 &center, double size)
+        {
+          std::unordered_map<std::array<float, 3>, uint32_t, PositionHash> unique;
+          unique.reserve(in.vertices.size()/4);
+
+          size_t corners = in.count() - in.count()%3;
+          triangles.resize(corners/3);
+
+          for (size_t ii=0; ii != corners; ++ii)
+          {
+            const pgl::Vertex &v = in.vertices[in.indices.empty()?ii:in.indices[ii]];
+            std::array<float, 3> key = {{v.position[0], v.position[1], v.position[2]}};
+
+            auto it = unique.find(key);
+            if (it == unique.end())
+            {
+              Point vtx;
+              vtx.p = (Vector3(v.position[0], v.position[1], v.position[2])-center)/size;
+              vtx.start = vtx.count = 0;
+              vtx.border = false;
+              it = unique.insert(std::make_pair(key, (uint32_t)points.size())).first;
+              points.push_back(vtx);
+            }
+
+            Triangle &t = triangles[ii/3];
+            t.v[ii%3] = it->second;
+            t.deleted = t.dirty = false;
+          }
+        }
+
+        /// Collapses edges until at most target triangles remain. \returns maximum quadric error.
+        double simplify(size_t target)
+        {
+          size_t deleted = 0, count = triangles.size();
+          double maxerror = 0;
+          std::vector<bool> deleted0, deleted1;
+
+          for (size_t iteration=0; iteration != 100; ++iteration)
+          {
+            if (count - deleted <= target)
+              break;
+
+            // Remove deleted triangles and rebuild references every few passes.
+            if (iteration % 5 == 0)
+              update(iteration);
+
+            for (size_t ii=0; ii != triangles.size(); ++ii)
+              triangles[ii].dirty = false;
+
+            // Error threshold increases with every pass.
+            double threshold = 1e-9*pow(iteration+3., 7);
+
+            for (size_t ii=0; ii != triangles.size() && count - deleted > target; ++ii)
+            {
+              Triangle &t = triangles[ii];
+              if (t.error[3] > threshold || t.deleted || t.dirty)
+                continue;
+
+              for (size_t jj=0; jj != 3; ++jj)
+              {
+                if (t.error[jj] > threshold)
+                  continue;
+
+                uint32_t i0 = t.v[jj], i1 = t.v[(jj+1)%3];
+                Point &v0 = points[i0], &v1 = points[i1];
+                if (v0.border != v1.border)
+                  continue;
+
+                Vector3 p;
+                double e = error(i0, i1, p);
+
+                deleted0.assign(v0.count, false);
+                deleted1.assign(v1.count, false);
+                if (flipped(p, i1, v0, deleted0) || flipped(p, i0, v1, deleted1))
+                  continue;
+
+                v0.p = p;
+                v0.q = v0.q + v1.q;
+                maxerror = std::max(maxerror, e);
+
+                size_t start = refs.size();
+                collapse(i0, v0, deleted0, deleted);
+                collapse(i0, v1, deleted1, deleted);
+
+                size_t used = refs.size() - start;
+                if (used <= v0.count)
+                {
+                  // Reuse old reference range.
+                  if (used)
+                    memmove(&refs[v0.start], &refs[start], used*sizeof(Ref));
+                  refs.resize(start);
+                }
+                else
+                  v0.start = start;
+                v0.count = used;
+                break;
+              }
+            }
+          }
+
+          return maxerror;
+        }
+
+        /// Compacts triangles and rebuilds vertex references. Initializes quadrics on the first pass.
+        void update(size_t iteration)
+        {
+          if (iteration > 0)
+          {
+            size_t dst = 0;
+            for (size_t ii=0; ii != triangles.size(); ++ii)
+              if (!triangles[ii].deleted)
+                triangles[dst++] = triangles[ii];
+            triangles.resize(dst);
+          }
+
+          for (size_t ii=0; ii != points.size(); ++ii)
+            points[ii].start = points[ii].count = 0;
+          for (size_t ii=0; ii != triangles.size(); ++ii)
+            for (size_t jj=0; jj != 3; ++jj)
+              points[triangles[ii].v[jj]].count++;
+
+          size_t start = 0;
+          for (size_t ii=0; ii != points.size(); ++ii)
+          {
+            points[ii].start = start;
+            start += points[ii].count;
+            points[ii].count = 0;
+          }
+
+          refs.resize(3*triangles.size());
+          for (size_t ii=0; ii != triangles.size(); ++ii)
+            for (size_t jj=0; jj != 3; ++jj)
+            {
+              Point &v = points[triangles[ii].v[jj]];
+              refs[v.start + v.count++] = {(uint32_t)ii, (uint32_t)jj};
+            }
+
+          if (iteration > 0)
+            return;
+
+          // Border vertices have an edge that is used by only one triangle.
+          std::vector<uint32_t> neighbors, counts;
+          for (size_t ii=0; ii != points.size(); ++ii)
+          {
+            Point &v = points[ii];
+            neighbors.clear();
+            counts.clear();
+
+            for (size_t jj=0; jj != v.count; ++jj)
+            {
+              const Triangle &t = triangles[refs[v.start+jj].triangle];
+              for (size_t kk=0; kk != 3; ++kk)
+              {
+                size_t ll=0;
+                while (ll != neighbors.size() && neighbors[ll] != t.v[kk])
+                  ll++;
+                if (ll == neighbors.size())
+                {
+                  neighbors.push_back(t.v[kk]);
+                  counts.push_back(1);
+                }
+                else
+                  counts[ll]++;
+              }
+            }
+
+            for (size_t jj=0; jj != neighbors.size(); ++jj)
+              if (counts[jj] == 1)
+                points[neighbors[jj]].border = true;
+          }
+
+          for (size_t ii=0; ii != triangles.size(); ++ii)
+          {
+            Triangle &t = triangles[ii];
+            const Vector3 &p0 = points[t.v[0]].p;
+            Vector3 n = (points[t.v[1]].p-p0).cross(points[t.v[2]].p-p0);
+            double norm = n.norm();
+            t.n = norm>0?n/norm:n;
+
+            Quadric q(t.n.x, t.n.y, t.n.z, -(t.n.x*p0.x + t.n.y*p0.y + t.n.z*p0.z));
+            for (size_t jj=0; jj != 3; ++jj)
+              points[t.v[jj]].q = points[t.v[jj]].q + q;
+          }
+
+          for (size_t ii=0; ii != triangles.size(); ++ii)
+            errors(triangles[ii]);
+        }
+
+        /// Updates edge errors of triangle.
+        void errors(Triangle &t) const
+        {
+          Vector3 p;
+          for (size_t jj=0; jj != 3; ++jj)
+            t.error[jj] = error(t.v[jj], t.v[(jj+1)%3], p);
+          t.error[3] = std::min(t.error[0], std::min(t.error[1], t.error[2]));
+        }
+
+        /// Error of collapsing edge, with the optimal position in p.
+        double error(uint32_t i0, uint32_t i1, Vector3 &p) const
+        {
+          const Point &v0 = points[i0], &v1 = points[i1];
+          Quadric q = v0.q + v1.q;
+          bool border = v0.border && v1.border;
+
+          double det = q.det(0, 1, 2, 1, 4, 5, 2, 5, 7);
+          if (det != 0 && !border)
+          {
+            p = Vector3(-q.det(1, 2, 3, 4, 5, 6, 5, 7, 8)/det,
+                         q.det(0, 2, 3, 1, 5, 6, 2, 7, 8)/det,
+                        -q.det(0, 1, 3, 1, 4, 6, 2, 5, 8)/det);
+            return q.error(p);
+          }
+
+          // Choose best of endpoints and midpoint.
+          Vector3 mid = (v0.p+v1.p)/2;
+          double e0 = q.error(v0.p), e1 = q.error(v1.p), em = q.error(mid);
+          double e = std::min(e0, std::min(e1, em));
+          p = e == e0?v0.p:(e == e1?v1.p:mid);
+
+          return e;
+        }
+
+        /** \brief Returns whether moving v to p flips or degenerates one of its triangles.
+         *
+         * Triangles shared with other, which will be removed by the collapse,
+         * are marked in deleted.
+         */
+        bool flipped(const Vector3 &p, uint32_t other, const Point &v, std::vector<bool> &deleted) const
+        {
+          for (size_t ii=0; ii != v.count; ++ii)
+          {
+            const Ref &r = refs[v.start+ii];
+            const Triangle &t = triangles[r.triangle];
+            if (t.deleted)
+              continue;
+
+            uint32_t id1 = t.v[(r.corner+1)%3], id2 = t.v[(r.corner+2)%3];
+            if (id1 == other || id2 == other)
+            {
+              deleted[ii] = true;
+              continue;
+            }
+
+            Vector3 d1 = points[id1].p-p, d2 = points[id2].p-p;
+            double n1 = d1.norm(), n2 = d2.norm();
+            if (n1 == 0 || n2 == 0)
+              return true;
+            d1 = d1/n1;
+            d2 = d2/n2;
+            if (fabs(d1.x*d2.x + d1.y*d2.y + d1.z*d2.z) > 0.999)
+              return true;
+
+            Vector3 n = d1.cross(d2);
+            n = n/n.norm();
+            if (n.x*t.n.x + n.y*t.n.y + n.z*t.n.z < 0.2)
+              return true;
+          }
+
+          return false;
+        }
+
+        /// Moves triangles of v to vertex i0, removing the ones marked as deleted.
+        void collapse(uint32_t i0, const Point &v, const std::vector<bool> &deleted, size_t &count)
+        {
+          for (size_t ii=0; ii != v.count; ++ii)
+          {
+            Ref r = refs[v.start+ii];
+            Triangle &t = triangles[r.triangle];
+            if (t.deleted)
+              continue;
+
+            if (deleted[ii])
+            {
+              t.deleted = true;
+              count++;
+              continue;
+            }
+
+            t.v[r.corner] = i0;
+            t.dirty = true;
+            errors(t);
+            refs.push_back(r);
+          }
+        }
+    };
+};
+
+}
+
+#endif // PGL_DECIMATE_H_
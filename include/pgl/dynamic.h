@@ -0,0 +1,464 @@
+/** \file dynamic.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains primitives with geometry that changes every frame.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_DYNAMIC_H_
+#define PGL_DYNAMIC_H_
+
+#include "mesh.h"
+#include "primitive.h"
+
+#include <string.h>
+
+namespace pgl {
+
+/**
+ * \brief Primitive whose vertices are streamed to the GPU.
+ *
+ * Holds up to a fixed number of vertices, which can be appended or
+ * replaced at any time without reallocating memory. When more vertices
+ * are appended than fit, the oldest are dropped, whole lines or
+ * triangles at a time. For example, to show the last 1000 positions of
+ * an end effector,
+ * \code
+ * auto trail = scene->attach(new pgl::LineStrip(1000));
+ *
+ * while (running)
+ * {
+ *   trail->append(robot->position());
+ *   camera->draw();
+ * }
+ * \endcode
+ *
+ * With the VBO backend, the vertex buffer is divided into three
+ * regions that are written in turn, so that new vertices never overwrite
+ * ones the GPU may still be drawing. Each region is guarded by a fence,
+ * which has normally been passed by the time the region is reused. With
+ * OpenGL 4.4 the buffer is mapped persistently, and otherwise regions
+ * are mapped unsynchronized when written. The display list backend
+ * draws the vertices from client memory.
+ *
+ * \note
+ * Normals are only used with lighting, which is only enabled by default
+ * for triangles. Triangle vertices appended without a normal get the
+ * one calculated from the winding order, as with STLLoader. Bounds only
+ * grow until the vertices are cleared or replaced.
+ */
+class DynamicMesh : public Primitive
+{
+  public:
+    GLenum mode;   ///< Drawing mode, e.g. GL_POINTS, GL_LINE_STRIP or GL_TRIANGLES.
+    bool lighting; ///< Whether to apply lighting.
+
+  protected:
+    static const size_t regions_ = 3; ///< Number of buffer regions.
+
+    size_t capacity_;              ///< Maximum number of vertices.
+    std::vector<Vertex> vertices_; ///< Storage for twice the capacity, so that dropping vertices rarely moves the others.
+    size_t first_, size_;          ///< Range of current vertices in vertices_.
+    Bounds box_;                   ///< Bounds of all vertices since the last clear().
+    bool dirty_;                   ///< Whether the vertices changed since the last upload.
+    size_t region_;                ///< Buffer region holding the uploaded vertices.
+    GLuint vao_, vbo_;             ///< OpenGL vertex array and buffer identifiers.
+    Vertex *mapped_;               ///< Persistently mapped buffer, or NULL.
+#ifdef PGL_MODERN
+    GLsync fences_[regions_];      ///< Fences after the last draw from every region.
+#endif
+
+  public:
+    /// Specifies drawing mode and maximum number of vertices.
+    DynamicMesh(GLenum _mode, size_t capacity) : mode(_mode), lighting(_mode == GL_TRIANGLES), capacity_(std::max(capacity, (size_t)3)), vertices_(2*capacity_), first_(0), size_(0), dirty_(true), region_(0), vao_(0), vbo_(0), mapped_(NULL)
+    {
+#ifdef PGL_MODERN
+      for (size_t ii=0; ii != regions_; ++ii)
+        fences_[ii] = 0;
+#endif
+    }
+
+    ~DynamicMesh()
+    {
+#ifdef PGL_MODERN
+      for (size_t ii=0; ii != regions_; ++ii)
+        if (fences_[ii])
+          glDeleteSync(fences_[ii]);
+      if (vao_)
+      {
+        glDeleteBuffers(1, &vbo_);
+        glDeleteVertexArrays(1, &vao_);
+      }
+#endif
+    }
+
+    /// Returns number of vertices.
+    size_t size() const
+    {
+      return size_;
+    }
+
+    /// Returns maximum number of vertices.
+    size_t capacity() const
+    {
+      return capacity_;
+    }
+
+    /// Returns current vertices, oldest first.
+    const Vertex *data() const
+    {
+      return &vertices_[first_];
+    }
+
+    /// Removes all vertices.
+    void clear()
+    {
+      first_ = size_ = 0;
+      box_ = Bounds();
+      dirty_ = bounds_dirty_ = true;
+    }
+
+    /// Appends vertex, dropping the oldest if full.
+    void append(const Vector3 &position, const Vector3 &n = {0, 0, 0})
+    {
+      if (size_ + 1 > capacity_)
+        drop(size_ + 1 - capacity_);
+      push(position, n);
+      shade(size_-1);
+    }
+
+    /// Appends n vertices given as consecutive x, y, z coordinates, dropping the oldest if full.
+    void append(const float *positions, size_t n)
+    {
+      // Skip vertices that would be dropped immediately.
+      if (n > capacity_)
+      {
+        size_t skip = (n-capacity_+stride()-1)/stride()*stride();
+        positions += 3*skip;
+        n -= skip;
+      }
+      if (size_ + n > capacity_)
+        drop(size_ + n - capacity_);
+
+      size_t from = size_;
+      for (size_t ii=0; ii != n; ++ii)
+        push(Vector3(positions[ii*3], positions[ii*3+1], positions[ii*3+2]), {0, 0, 0});
+      shade(from);
+    }
+
+    /// Appends vertices, dropping the oldest if full.
+    void append(const std::vector<Vector3> &positions)
+    {
+      size_t n = positions.size(), skip = 0;
+      if (n > capacity_)
+        skip = (n-capacity_+stride()-1)/stride()*stride();
+      if (size_ + n-skip > capacity_)
+        drop(size_ + n-skip - capacity_);
+
+      size_t from = size_;
+      for (size_t ii=skip; ii != n; ++ii)
+        push(positions[ii], {0, 0, 0});
+      shade(from);
+    }
+
+    /// Replaces all vertices by n vertices given as consecutive x, y, z coordinates.
+    void replace(const float *positions, size_t n)
+    {
+      clear();
+      append(positions, n);
+    }
+
+    /// Replaces all vertices.
+    void replace(const std::vector<Vector3> &positions)
+    {
+      clear();
+      append(positions);
+    }
+
+    /// Draw vertices and children.
+    virtual void draw()
+    {
+      Context &context = Context::current();
+
+      refresh();
+      if (!visible())
+        return;
+
+      // Streamed vertices have no Mesh to sort by, so draw after the queue.
+      if (context.queue)
+      {
+        context.queue->defer(this);
+        return;
+      }
+
+      if (context.backend == backendDisplayList)
+      {
+        glPushMatrix();
+        glMultMatrixd(transform.data);
+        if (size_)
+          submit();
+        for (size_t ii=0; ii != children.size(); ++ii)
+          children[ii]->draw();
+        glPopMatrix();
+      }
+#ifdef PGL_MODERN
+      else
+      {
+        if (size_)
+          stream();
+        for (size_t ii=0; ii != children.size(); ++ii)
+          children[ii]->draw();
+      }
+#endif
+    }
+
+    virtual bool flattenable() const
+    {
+      return false;
+    }
+
+    /// Returns whether the OpenGL context supports persistently mapped buffers.
+    static bool persistent()
+    {
+      return Context::glversion() >= 44;
+    }
+
+  protected:
+    virtual Bounds localBounds() const
+    {
+      return box_;
+    }
+
+    /// Returns number of vertices per line or triangle, which are dropped together.
+    size_t stride() const
+    {
+      return mode == GL_TRIANGLES?3:mode == GL_LINES?2:1;
+    }
+
+    /// Drops at least n of the oldest vertices.
+    void drop(size_t n)
+    {
+      n = std::min((n+stride()-1)/stride()*stride(), size_);
+      first_ += n;
+      size_ -= n;
+      dirty_ = true;
+    }
+
+    /// Adds vertex at the end, which must not be full.
+    void push(const Vector3 &position, const Vector3 &n)
+    {
+      // Move current vertices to the front once the end of the storage is reached.
+      if (first_ + size_ == vertices_.size())
+      {
+        memmove(&vertices_[0], &vertices_[first_], size_*sizeof(Vertex));
+        first_ = 0;
+      }
+
+      Vertex &v = vertices_[first_ + size_++];
+      for (size_t ii=0; ii != 3; ++ii)
+      {
+        v.position[ii] = position[ii];
+        v.normal[ii] = n[ii];
+      }
+      v.texcoord[0] = v.texcoord[1] = 0;
+
+      box_.extend(position);
+      dirty_ = bounds_dirty_ = true;
+    }
+
+    /// Calculates normals of triangles completed since vertex from, for vertices without one.
+    void shade(size_t from)
+    {
+      if (mode != GL_TRIANGLES)
+        return;
+
+      // Dropping whole triangles keeps them aligned to the oldest vertex.
+      Vertex *v = &vertices_[first_];
+      for (size_t ii=from/3*3; ii+3 <= size_; ii += 3)
+      {
+        Vector3 p[3];
+        for (size_t jj=0; jj != 3; ++jj)
+          p[jj] = Vector3(v[ii+jj].position[0], v[ii+jj].position[1], v[ii+jj].position[2]);
+
+        // As with Primitive::normal(), divide by the squared norm.
+        Vector3 n = (p[1]-p[0]).cross(p[2]-p[0]);
+        if (n.normsq() == 0)
+          continue;
+        n = n/n.normsq();
+
+        for (size_t jj=0; jj != 3; ++jj)
+        {
+          float *normal = v[ii+jj].normal;
+          if (!normal[0] && !normal[1] && !normal[2])
+            for (size_t kk=0; kk != 3; ++kk)
+              normal[kk] = n[kk];
+        }
+      }
+    }
+
+    /// Draws vertices from client memory, for backendDisplayList.
+    void submit()
+    {
+      Profiler *profiler = Context::current().profiler;
+      if (profiler)
+        profiler->draw(mode, size_);
+
+      const Vertex *v = data();
+      glColor3d(color.x, color.y, color.z);
+      if (!lighting)
+        glDisable(GL_LIGHTING);
+      glEnableClientState(GL_VERTEX_ARRAY);
+      glVertexPointer(3, GL_FLOAT, sizeof(Vertex), v->position);
+      if (lighting)
+      {
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(GL_FLOAT, sizeof(Vertex), v->normal);
+      }
+      glDrawArrays(mode, 0, size_);
+      if (lighting)
+        glDisableClientState(GL_NORMAL_ARRAY);
+      glDisableClientState(GL_VERTEX_ARRAY);
+      if (!lighting)
+        glEnable(GL_LIGHTING);
+    }
+
+#ifdef PGL_MODERN
+    /// Uploads changed vertices into the next buffer region and draws them, for backendVBO.
+    void stream()
+    {
+      Context &context = Context::current();
+      size_t bytes = capacity_*sizeof(Vertex);
+
+      if (!vao_)
+      {
+        glGenVertexArrays(1, &vao_);
+        glBindVertexArray(vao_);
+        glGenBuffers(1, &vbo_);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+        if (persistent())
+        {
+          GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+          glBufferStorage(GL_ARRAY_BUFFER, regions_*bytes, NULL, flags);
+          mapped_ = (Vertex*)glMapBufferRange(GL_ARRAY_BUFFER, 0, regions_*bytes, flags);
+        }
+        else
+          glBufferData(GL_ARRAY_BUFFER, regions_*bytes, NULL, GL_STREAM_DRAW);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texcoord));
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        dirty_ = true;
+      }
+      else
+        glBindVertexArray(vao_);
+
+      if (dirty_)
+      {
+        region_ = (region_+1)%regions_;
+
+        // Normally passed long ago, as the region was last drawn two uploads back.
+        GLsync &fence = fences_[region_];
+        if (fence)
+        {
+          glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+          glDeleteSync(fence);
+          fence = 0;
+        }
+
+        if (mapped_)
+          memcpy(mapped_ + region_*capacity_, data(), size_*sizeof(Vertex));
+        else
+        {
+          glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+          void *ptr = glMapBufferRange(GL_ARRAY_BUFFER, region_*bytes, size_*sizeof(Vertex),
+                                       GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+          if (ptr)
+          {
+            memcpy(ptr, data(), size_*sizeof(Vertex));
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+          }
+          glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        dirty_ = false;
+      }
+
+      if (context.profiler)
+        context.profiler->draw(mode, size_);
+
+      Shader &shader = Shader::builtin();
+      shader.modelview(context.view*world_);
+      shader.color(color);
+      shader.lighting(lighting);
+      shader.textured(false);
+      glDrawArrays(mode, region_*capacity_, size_);
+      glBindVertexArray(0);
+
+      if (fences_[region_])
+        glDeleteSync(fences_[region_]);
+      fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+#endif
+};
+
+/**
+ * \brief Streamed points, e.g. a lidar scan.
+ *
+ * See DynamicMesh. For example,
+ * \code
+ * auto scan = scene->attach(new pgl::PointCloud(500000, 2));
+ * scan->replace(points, n);
+ * \endcode
+ */
+class PointCloud : public DynamicMesh
+{
+  public:
+    double pointsize; ///< Point diameter in pixels.
+
+  public:
+    /// Specifies maximum number of points and their diameter in pixels.
+    PointCloud(size_t capacity, double _pointsize=1) : DynamicMesh(GL_POINTS, capacity), pointsize(_pointsize) { }
+
+    virtual void draw()
+    {
+      glPointSize(pointsize);
+      DynamicMesh::draw();
+      glPointSize(1);
+    }
+};
+
+/**
+ * \brief Streamed connected line segments, e.g. a trajectory.
+ *
+ * See DynamicMesh. Once full, appending a point drops the oldest one, so
+ * the strip shows the most recent capacity points.
+ */
+class LineStrip : public DynamicMesh
+{
+  public:
+    /// Specifies maximum number of points.
+    LineStrip(size_t capacity) : DynamicMesh(GL_LINE_STRIP, capacity) { }
+};
+
+}
+
+#endif // PGL_DYNAMIC_H_
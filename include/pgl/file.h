@@ -0,0 +1,160 @@
+/** \file file.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains file access shared by the loaders.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PGL_FILE_H_
+#define PGL_FILE_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace pgl {
+
+/// Result of loading a file.
+enum Status
+{
+  statusOK,        ///< Loaded successfully.
+  statusNotFound,  ///< File could not be opened.
+  statusInvalid,   ///< File is not in a supported format.
+  statusTruncated, ///< File ends prematurely. Data up to that point was loaded.
+  statusPending    ///< File is still being loaded asynchronously.
+};
+
+/// Returns description of status.
+inline const char *describe(Status status)
+{
+  switch (status)
+  {
+    case statusOK:        return "ok";
+    case statusNotFound:  return "file not found";
+    case statusInvalid:   return "invalid file format";
+    case statusTruncated: return "file is truncated";
+    case statusPending:   return "loading";
+  }
+
+  return "unknown status";
+}
+
+/**
+ * \brief Read-only view of a file's contents.
+ *
+ * Memory-maps the file where supported, such that it is paged in
+ * on demand without being copied. Otherwise, reads the whole file
+ * into memory.
+ */
+class MappedFile
+{
+  protected:
+    const unsigned char *data_; ///< File contents.
+    size_t size_;               ///< File size in bytes.
+    bool valid_;                ///< Whether the file could be opened.
+#ifdef _WIN32
+    std::vector<unsigned char> buffer_;
+#endif
+
+  public:
+    /// Opens file for reading.
+    MappedFile(const std::string &file) : data_(NULL), size_(0), valid_(false)
+    {
+#ifndef _WIN32
+      int fd = open(file.c_str(), O_RDONLY);
+      if (fd < 0)
+        return;
+
+      struct stat st;
+      if (fstat(fd, &st) == 0)
+      {
+        valid_ = true;
+        size_ = st.st_size;
+
+        if (size_)
+        {
+          void *ptr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (ptr != MAP_FAILED)
+          {
+            madvise(ptr, size_, MADV_SEQUENTIAL);
+            data_ = (const unsigned char*)ptr;
+          }
+          else
+          {
+            valid_ = false;
+            size_ = 0;
+          }
+        }
+      }
+
+      // The mapping stays valid after closing the descriptor.
+      close(fd);
+#else
+      std::ifstream ifs(file, std::ios::binary | std::ios::ate);
+      if (!ifs.good())
+        return;
+
+      valid_ = true;
+      buffer_.resize(ifs.tellg());
+      ifs.seekg(0);
+      ifs.read((char*)buffer_.data(), buffer_.size());
+      data_ = buffer_.data();
+      size_ = ifs.gcount();
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+      if (data_)
+        munmap((void*)data_, size_);
+#endif
+    }
+
+    /// Returns whether the file could be opened.
+    operator bool() const
+    {
+      return valid_;
+    }
+
+    /// Returns file contents.
+    const unsigned char *data() const
+    {
+      return data_;
+    }
+
+    /// Returns file size in bytes.
+    size_t size() const
+    {
+      return size_;
+    }
+};
+
+}
+
+#endif // PGL_FILE_H_
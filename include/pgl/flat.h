@@ -0,0 +1,324 @@
+/** \file flat.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the flat, array-based representation of a scene.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_FLAT_H_
+#define PGL_FLAT_H_
+
+#include "mesh.h"
+#include "primitive.h"
+#include "pool.h"
+
+namespace pgl {
+
+/**
+ * \brief Scene compiled into contiguous arrays.
+ *
+ * Stores the local and world transforms and parent indices of all nodes,
+ * and the meshes and colors of all primitives, as separate arrays.
+ * Nodes are stored in breadth-first order, such that every parent
+ * precedes its children, and world transforms are computed by a single
+ * linear sweep instead of a recursive traversal. Primitives are then
+ * culled and added to a RenderQueue in another sweep. For example,
+ * \code
+ * pgl::FlatScene flat(scene);
+ *
+ * while (running)
+ * {
+ *   flat.transforms[flat.index(arm)] = pgl::Rotation({0, 0, angle});
+ *   flat.draw(camera);
+ * }
+ * \endcode
+ *
+ * The arrays are filled by compile(), which must be called again after
+ * attaching or removing nodes. Afterwards, transforms and colors can be
+ * changed directly in the arrays, which is fastest, or in the scene
+ * graph followed by sync().
+ *
+ * If pool is set, the sweeps are split into chunks of grain elements
+ * and run on its threads: world transforms one level of the tree at a
+ * time, and culling with every chunk producing its own list of draws.
+ * The lists are merged in order and drawn by the calling OpenGL
+ * thread, so the result is the same as without the pool. Callers can
+ * also parallelize update(first, last) themselves, within each level
+ * delimited by levels.
+ *
+ * Nodes that draw more than their children and Mesh, such as
+ * InstanceGroups, are not compiled. They draw themselves and their
+ * subtree after the primitives, as in a RenderQueue, relative to the
+ * world transform of their parent in the arrays. Changes in transforms
+ * therefore move them along with the compiled nodes.
+ *
+ * \note
+ * Scene::draw() is not called, so derived scenes should not override it.
+ * Levels of detail are not selected; primitives use their current
+ * tessellation.
+ */
+class FlatScene
+{
+  public:
+    Scene *scene;                     ///< Scene to draw.
+    std::vector<Node*> nodes;         ///< Compiled nodes, in breadth-first order. The first is the scene.
+    std::vector<size_t> levels;       ///< Index of the first node of every depth, followed by the number of nodes.
+    std::vector<int> parents;         ///< Index of the parent of every node, or -1 for the scene.
+    std::vector<Transform> transforms; ///< Local transform of every node. Identity for nodes without one.
+    std::vector<Transform> worlds;    ///< World transform of every node, computed by update().
+    std::vector<size_t> items;        ///< Node index of every primitive.
+    std::vector<Mesh*> meshes;        ///< Mesh of every primitive.
+    std::vector<Vector3> colors;      ///< Color of every primitive.
+    std::vector<Bounds> bounds;       ///< World-space bounds of every primitive, computed by bound().
+    RenderQueue queue;                ///< Queue the primitives are drawn from. Holds the statistics of the last draw().
+    ThreadPool *pool;                 ///< Pool to run the sweeps on, or NULL to run them on the calling thread.
+    size_t grain;                     ///< Number of nodes or primitives per chunk when using the pool.
+
+  protected:
+    std::vector<const Transform*> locals_; ///< Local transform in the scene graph of every node, or NULL.
+    std::vector<Primitive*> primitives_;   ///< Compiled primitives.
+    std::vector<Node*> opaque_;            ///< Nodes that draw their own subtree.
+    std::vector<size_t> anchors_;          ///< Index of the parent of every node in opaque_.
+    std::vector<std::vector<RenderQueue::Item> > lists_; ///< Draws per chunk of primitives.
+
+  public:
+    /// Compiles scene.
+    FlatScene(Scene *_scene, ThreadPool *_pool=NULL) : scene(_scene), pool(_pool), grain(4096)
+    {
+      compile();
+    }
+
+    /// Fills the arrays from the scene graph.
+    void compile()
+    {
+      nodes.clear();
+      levels.clear();
+      parents.clear();
+      locals_.clear();
+      primitives_.clear();
+      items.clear();
+      opaque_.clear();
+      anchors_.clear();
+
+      nodes.push_back(scene);
+      parents.push_back(-1);
+      locals_.push_back(NULL);
+
+      // Breadth-first, one level at a time.
+      for (size_t first=0; first != nodes.size();)
+      {
+        size_t last = nodes.size();
+        levels.push_back(first);
+
+        for (size_t ii=first; ii != last; ++ii)
+          for (size_t jj=0; jj != nodes[ii]->children.size(); ++jj)
+          {
+            Node *child = nodes[ii]->children[jj];
+            if (!child->flattenable())
+            {
+              opaque_.push_back(child);
+              anchors_.push_back(ii);
+              continue;
+            }
+
+            Object *object = dynamic_cast<Object*>(child);
+            Primitive *primitive = dynamic_cast<Primitive*>(child);
+
+            if (primitive && !primitive->frozen)
+            {
+              primitives_.push_back(primitive);
+              items.push_back(nodes.size());
+            }
+
+            nodes.push_back(child);
+            parents.push_back(ii);
+            locals_.push_back(object?&object->transform:NULL);
+          }
+
+        first = last;
+      }
+      levels.push_back(nodes.size());
+
+      transforms.assign(nodes.size(), Transform({0, 0, 0}, {0, 0, 0}));
+      worlds.assign(nodes.size(), Transform({0, 0, 0}, {0, 0, 0}));
+      meshes.resize(items.size());
+      colors.resize(items.size());
+      bounds.resize(items.size());
+
+      sync();
+    }
+
+    /// Copies local transforms, meshes and colors from the scene graph.
+    void sync()
+    {
+      for (size_t ii=0; ii != nodes.size(); ++ii)
+        if (locals_[ii])
+          transforms[ii] = *locals_[ii];
+
+      for (size_t ii=0; ii != items.size(); ++ii)
+      {
+        meshes[ii] = primitives_[ii]->mesh().get();
+        colors[ii] = primitives_[ii]->color;
+      }
+    }
+
+    /// Returns index of a compiled node, or -1 if it was not compiled. Searches linearly.
+    int index(const Node *node) const
+    {
+      for (size_t ii=0; ii != nodes.size(); ++ii)
+        if (nodes[ii] == node)
+          return ii;
+
+      return -1;
+    }
+
+    /// Computes world transforms of all nodes, using the pool if set.
+    void update()
+    {
+      for (size_t ii=1; ii+1 < levels.size(); ++ii)
+      {
+        size_t first = levels[ii];
+        parallel(levels[ii+1]-first, [this, first](size_t begin, size_t end, size_t)
+        {
+          update(first+begin, first+end);
+        });
+      }
+    }
+
+    /** \brief Computes world transforms of nodes first to last (exclusive).
+     *
+     * The world transforms of their parents must be up to date.
+     */
+    void update(size_t first, size_t last)
+    {
+      for (size_t ii=first; ii != last; ++ii)
+        worlds[ii] = worlds[parents[ii]]*transforms[ii];
+    }
+
+    /** \brief Computes world-space bounds of primitives first to last (exclusive).
+     *
+     * The world transforms must be up to date.
+     */
+    void bound(size_t first, size_t last)
+    {
+      for (size_t ii=first; ii != last; ++ii)
+        bounds[ii] = meshes[ii]?meshes[ii]->bounds.transformed(worlds[items[ii]]):Bounds();
+    }
+
+    /// Draws the scene from the camera's perspective, using its viewport, culling and sorting settings.
+    void draw(Camera *camera)
+    {
+      Camera::Viewport vp = camera->viewport;
+      if (vp.width)
+      {
+        glViewport(vp.x, vp.y, vp.width, vp.height);
+        glScissor(vp.x, vp.y, vp.width, vp.height);
+        glEnable(GL_SCISSOR_TEST);
+      }
+      else
+      {
+        GLint dims[4];
+        glGetIntegerv(GL_VIEWPORT, dims);
+        vp = {dims[0], dims[1], dims[2], dims[3]};
+      }
+
+      glClearColor(scene->color.x, scene->color.y, scene->color.z, 1);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+      Context &context = Context::current();
+      camera->begin(vp);
+      context.lod = 0;
+
+      Frustum frustum(camera->projection(vp)*camera->transform);
+      bool culling = camera->culling;
+
+      {
+        Profiler::Timer timer(context.profiler, Profiler::phaseUpdate);
+        update();
+        if (context.profiler)
+          context.profiler->stats.nodes += nodes.size();
+      }
+
+      {
+        Profiler::Timer timer(context.profiler, Profiler::phaseTraversal);
+        lists_.resize((items.size()+grain-1)/grain);
+        for (size_t ii=0; ii != lists_.size(); ++ii)
+          lists_[ii].clear();
+
+        parallel(items.size(), [this, culling, &frustum](size_t first, size_t last, size_t)
+        {
+          // Serial runs have a single chunk.
+          std::vector<RenderQueue::Item> &list = lists_[first/grain];
+          if (culling)
+            bound(first, last);
+          for (size_t ii=first; ii != last; ++ii)
+            if (meshes[ii] && (!culling || frustum.intersects(bounds[ii])))
+              list.push_back({meshes[ii], &worlds[items[ii]], colors[ii], NULL});
+        });
+
+        for (size_t ii=0; ii != lists_.size(); ++ii)
+          queue.append(lists_[ii]);
+
+        // Uncompiled subtrees follow the arrays, and cull themselves.
+        for (size_t ii=0; ii != opaque_.size(); ++ii)
+        {
+          opaque_[ii]->place(worlds[anchors_[ii]]);
+          if (culling)
+            opaque_[ii]->update();
+        }
+      }
+
+      {
+        Profiler::Timer timer(context.profiler, Profiler::phaseSubmit);
+        context.culling = context.bounded = culling;
+        context.frustum = frustum;
+        if (camera->sorting)
+          queue.sort();
+        queue.draw();
+        queue.clear();
+
+        for (size_t ii=0; ii != opaque_.size(); ++ii)
+        {
+          if (context.backend == backendDisplayList)
+            glLoadMatrixd((context.view*worlds[anchors_[ii]]).data);
+          opaque_[ii]->draw();
+        }
+        if (context.backend == backendDisplayList && !opaque_.empty())
+          glLoadMatrixd(context.view.data);
+      }
+
+      Camera::end();
+      if (camera->viewport.width)
+        glDisable(GL_SCISSOR_TEST);
+    }
+
+  protected:
+    /// Runs task on [0, n) using the pool, or as a single chunk on the calling thread.
+    void parallel(size_t n, const ThreadPool::Task &task)
+    {
+      if (pool)
+        pool->parallel(n, grain, task);
+      else if (n)
+        task(0, n, 0);
+    }
+};
+
+}
+
+#endif // PGL_FLAT_H_
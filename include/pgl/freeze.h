@@ -0,0 +1,240 @@
+/** \file freeze.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains merging of static geometry.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_FREEZE_H_
+#define PGL_FREEZE_H_
+
+#include "primitive.h"
+
+#include <map>
+#include <tuple>
+
+namespace pgl {
+
+/**
+ * \brief Merged geometry of the primitives in a subtree.
+ *
+ * Bakes the transformed meshes of all primitives below a Node into one
+ * Mesh per combination of color, lighting, texture and drawing mode,
+ * such that thousands of static primitives are drawn in a handful of
+ * calls. Created by freeze(), which attaches it to the frozen Node.
+ * The original primitives remain in the scene graph, but do not draw
+ * their own Mesh until unfreeze() is called. For example,
+ * \code
+ * for (size_t ii=0; ii != walls.size(); ++ii)
+ *   building->attach(new pgl::Box(walls[ii].size, walls[ii].center));
+ * pgl::freeze(building);
+ * \endcode
+ *
+ * \note
+ * Changes to the frozen primitives, such as their transforms or colors,
+ * only take effect after unfreezing. Their current tessellation is used.
+ * This includes detaching them: they stay frozen until unfreeze(), and
+ * deleted primitives remain visible in the batches until then. Other
+ * nodes in the subtree, such as InstanceGroups, are drawn as usual.
+ */
+class Frozen : public Node
+{
+  protected:
+    std::vector<Primitive*> members_; ///< Primitives whose geometry is merged. They remove themselves when deleted.
+    std::vector<Primitive*> batches_; ///< Merged geometry, one per state combination.
+
+  public:
+    /// Merges the primitives below node, relative to its coordinate frame.
+    Frozen(Node *node)
+    {
+      typedef std::tuple<double, double, double, bool, GLuint, GLenum> Key;
+      std::map<Key, Primitive*> batches;
+
+      std::vector<std::pair<Node*, Transform> > stack;
+      for (size_t ii=0; ii != node->children.size(); ++ii)
+        stack.push_back(std::make_pair(node->children[ii], Transform({0, 0, 0}, {0, 0, 0})));
+
+      while (!stack.empty())
+      {
+        Node *n = stack.back().first;
+        Transform t = stack.back().second;
+        stack.pop_back();
+
+        // Do not merge previously frozen geometry.
+        if (dynamic_cast<Frozen*>(n))
+          continue;
+
+        Object *object = dynamic_cast<Object*>(n);
+        if (object)
+          t = t*object->transform;
+
+        // Composite primitives only color their parts while drawing.
+        Primitive *primitive = dynamic_cast<Primitive*>(n);
+        if (primitive)
+          primitive->propagate();
+
+        if (primitive && !primitive->frozen && primitive->mesh() && primitive->mesh()->count())
+        {
+          const Mesh &mesh = *primitive->mesh();
+          Key key(primitive->color.x, primitive->color.y, primitive->color.z, mesh.lighting, mesh.texture.id(), mesh.mode);
+
+          Primitive *&batch = batches[key];
+          if (!batch)
+          {
+            batch = new Primitive(MeshPtr(new Mesh()));
+            batch->color = primitive->color;
+            batch->mesh()->lighting = mesh.lighting;
+            batch->mesh()->texture = mesh.texture;
+            batch->mesh()->mode = mesh.mode;
+            batches_.push_back(batch);
+          }
+
+          merge(mesh, t, *batch->mesh());
+          primitive->frozen = true;
+          primitive->freezer_ = this;
+          primitive->member_ = members_.size();
+          members_.push_back(primitive);
+        }
+
+        for (size_t ii=0; ii != n->children.size(); ++ii)
+          stack.push_back(std::make_pair(n->children[ii], t));
+      }
+
+      for (size_t ii=0; ii != batches_.size(); ++ii)
+        attach(batches_[ii]);
+    }
+
+    /** \brief Lets the merged primitives draw their own Mesh again.
+     *
+     * Called by unfreeze() before deleting this Node.
+     */
+    void thaw()
+    {
+      for (size_t ii=0; ii != members_.size(); ++ii)
+      {
+        members_[ii]->frozen = false;
+        members_[ii]->freezer_ = NULL;
+      }
+      members_.clear();
+    }
+
+    /// Thaws members that are still frozen, such that none refers to this node.
+    ~Frozen()
+    {
+      thaw();
+    }
+
+    /// Removes a primitive that is being deleted.
+    void forget(Primitive *primitive)
+    {
+      // Move the last member into its place.
+      size_t idx = primitive->member_;
+      members_[idx] = members_.back();
+      members_[idx]->member_ = idx;
+      members_.pop_back();
+
+      primitive->frozen = false;
+      primitive->freezer_ = NULL;
+    }
+
+    /// Returns number of merged primitives.
+    size_t size() const
+    {
+      return members_.size();
+    }
+
+    virtual bool flattenable() const
+    {
+      return typeid(*this) == typeid(Frozen);
+    }
+
+  protected:
+    /// Appends mesh, transformed by t, to an indexed batch.
+    static void merge(const Mesh &mesh, const Transform &t, Mesh &batch)
+    {
+      // Normals transform with the inverse transpose, i.e. the cofactor
+      // matrix divided by the determinant, as in Shader::modelview.
+      const double *m = t.data;
+      double c[9] = {m[5]*m[10]-m[6]*m[9], m[6]*m[8]-m[4]*m[10], m[4]*m[9]-m[5]*m[8],
+                     m[9]*m[2]-m[10]*m[1], m[10]*m[0]-m[8]*m[2], m[8]*m[1]-m[9]*m[0],
+                     m[1]*m[6]-m[2]*m[5],  m[2]*m[4]-m[0]*m[6],  m[0]*m[5]-m[1]*m[4]};
+      double det = m[0]*c[0] + m[1]*c[1] + m[2]*c[2];
+
+      uint32_t offset = batch.vertices.size();
+      for (size_t ii=0; ii != mesh.vertices.size(); ++ii)
+      {
+        const Vertex &v = mesh.vertices[ii];
+        Vertex w = v;
+
+        for (size_t jj=0; jj != 3; ++jj)
+        {
+          w.position[jj] = m[jj]*v.position[0] + m[jj+4]*v.position[1] + m[jj+8]*v.position[2] + m[jj+12];
+          w.normal[jj] = (c[jj]*v.normal[0] + c[jj+3]*v.normal[1] + c[jj+6]*v.normal[2])/det;
+        }
+
+        batch.vertices.push_back(w);
+        batch.bounds.extend(Vector3(w.position[0], w.position[1], w.position[2]));
+      }
+
+      for (size_t ii=0; ii != mesh.count(); ++ii)
+        batch.indices.push_back(offset + (mesh.indices.empty()?ii:mesh.indices[ii]));
+    }
+};
+
+inline Primitive::~Primitive()
+{
+  if (freezer_)
+    freezer_->forget(this);
+}
+
+/** \brief Restores the primitives merged by freeze(), such that they can be edited.
+ *
+ * \returns false if the node was not frozen.
+ */
+inline bool unfreeze(Node *node)
+{
+  for (size_t ii=0; ii != node->children.size(); ++ii)
+  {
+    Frozen *frozen = dynamic_cast<Frozen*>(node->children[ii]);
+    if (frozen)
+    {
+      frozen->thaw();
+      delete node->detach(frozen);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/** \brief Merges the static primitives below node into few large meshes.
+ *
+ * Refreezes the node if it was already frozen.
+ *
+ * \returns the Frozen node holding the merged geometry, which is attached to node.
+ */
+inline Frozen *freeze(Node *node)
+{
+  unfreeze(node);
+  return node->attach(new Frozen(node));
+}
+
+}
+
+#endif // PGL_FREEZE_H_
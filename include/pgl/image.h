@@ -0,0 +1,382 @@
+/** \file image.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains image file reading and mipmap generation.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PGL_IMAGE_H_
+#define PGL_IMAGE_H_
+
+#include "backend.h"
+#include "file.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <memory>
+
+// Texture parameters and compressed formats, in case the system headers predate them.
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT     0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT    0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT3_EXT    0x83F2
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT    0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM       0x8E8C
+#define GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM 0x8E8D
+#endif
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL                0x813D
+#endif
+#ifndef GL_COMPRESSED_RGB8_ETC2
+#define GL_COMPRESSED_RGB8_ETC2             0x9274
+#endif
+
+namespace pgl {
+
+/**
+ * \brief Image with optional mipmap levels, as read from a file.
+ *
+ * Reads binary PPM files with any maximum value, and KTX (version 1) and
+ * DDS files. The latter may contain mipmaps, and may be compressed in
+ * any format supported by the OpenGL implementation, such as BC1, BC7 or
+ * ETC2. Where possible, levels point directly into the memory-mapped
+ * file, so pixel data is not copied before uploading.
+ *
+ * \note
+ * Images cannot be copied, because levels may point into their own
+ * buffers.
+ */
+class Image
+{
+  public:
+    /// Mipmap level.
+    struct Level
+    {
+      int width, height;
+      const unsigned char *data;
+      size_t size;
+    };
+
+    GLenum format;             ///< Pixel format of uncompressed levels, GL_RGB or GL_RGBA.
+    GLenum compressed;         ///< Compressed internal format, or 0 if uncompressed.
+    std::vector<Level> levels; ///< Levels, starting with the full resolution.
+
+  protected:
+    std::shared_ptr<MappedFile> file_;                ///< File that levels may point into.
+    std::vector<std::vector<unsigned char> > buffers_; ///< Decoded or generated level data.
+
+  public:
+    Image() : format(GL_RGB), compressed(0) { }
+    Image(Image&&) = default;
+    Image &operator=(Image&&) = default;
+    Image(const Image&) = delete;
+    Image &operator=(const Image&) = delete;
+
+    /// Wraps existing RGB data, without copying it.
+    Image(int width, int height, const unsigned char *data) : format(GL_RGB), compressed(0)
+    {
+      levels.push_back({width, height, data, (size_t)width*height*3});
+    }
+
+    /// Returns width of the full resolution level.
+    int width() const
+    {
+      return levels.empty()?0:levels[0].width;
+    }
+
+    /// Returns height of the full resolution level.
+    int height() const
+    {
+      return levels.empty()?0:levels[0].height;
+    }
+
+    /** \brief Reads image from a PPM, KTX or DDS file, depending on its contents.
+     *
+     * Errors are reported on std::cerr.
+     */
+    Status read(const std::string &file)
+    {
+      *this = Image();
+
+      std::shared_ptr<MappedFile> f(new MappedFile(file));
+      if (!*f)
+      {
+        std::cerr << "Cannot open image " << file << std::endl;
+        return statusNotFound;
+      }
+      file_ = f;
+
+      Status status = statusInvalid;
+      if (f->size() >= 2 && !memcmp(f->data(), "P6", 2))
+        status = readPPM();
+      else if (f->size() >= 12 && !memcmp(f->data(), "\xABKTX 11\xBB\r\n\x1A\n", 12))
+        status = readKTX();
+      else if (f->size() >= 4 && !memcmp(f->data(), "DDS ", 4))
+        status = readDDS();
+
+      if (status == statusInvalid)
+        std::cerr << file << " is not a supported image" << std::endl;
+      else if (status == statusTruncated)
+        std::cerr << file << " is truncated" << std::endl;
+
+      if (status != statusOK)
+        *this = Image();
+
+      return status;
+    }
+
+    /** \brief Generates missing mipmap levels by averaging 2x2 pixels.
+     *
+     * Only applies to uncompressed images that have a single level.
+     */
+    void mipmap()
+    {
+      if (compressed || levels.size() != 1)
+        return;
+
+      size_t channels = format == GL_RGBA?4:3;
+      while (levels.back().width > 1 || levels.back().height > 1)
+      {
+        Level src = levels.back(), dst;
+        dst.width = std::max(src.width/2, 1);
+        dst.height = std::max(src.height/2, 1);
+        dst.size = (size_t)dst.width*dst.height*channels;
+
+        buffers_.push_back(std::vector<unsigned char>(dst.size));
+        unsigned char *out = buffers_.back().data();
+
+        // Odd sizes fold the last row or column into the previous one.
+        for (int yy=0; yy != dst.height; ++yy)
+          for (int xx=0; xx != dst.width; ++xx)
+          {
+            int x0 = std::min(2*xx, src.width-1), x1 = std::min(2*xx+1, src.width-1),
+                y0 = std::min(2*yy, src.height-1), y1 = std::min(2*yy+1, src.height-1);
+
+            for (size_t cc=0; cc != channels; ++cc)
+            {
+              unsigned sum = src.data[(y0*src.width+x0)*channels+cc] + src.data[(y0*src.width+x1)*channels+cc] +
+                             src.data[(y1*src.width+x0)*channels+cc] + src.data[(y1*src.width+x1)*channels+cc];
+              out[(yy*dst.width+xx)*channels+cc] = (sum+2)/4;
+            }
+          }
+
+        dst.data = out;
+        levels.push_back(dst);
+      }
+    }
+
+  protected:
+    /// Reads binary PPM. Pixels with maximum value 255 are not copied.
+    Status readPPM()
+    {
+      const unsigned char *ptr = file_->data()+2, *end = file_->data()+file_->size();
+
+      int header[3];
+      for (size_t ii=0; ii != 3; ++ii)
+        if (!readint(ptr, end, header[ii]))
+          return statusInvalid;
+
+      // A single whitespace character separates the header from the pixels.
+      if (ptr == end || !isspace(*ptr) || header[0] <= 0 || header[1] <= 0 || header[2] <= 0 || header[2] > 65535)
+        return statusInvalid;
+      ptr++;
+
+      int width = header[0], height = header[1], maxval = header[2];
+      size_t samples = (size_t)width*height*3, bytes = samples*(maxval > 255?2:1);
+      if ((size_t)(end-ptr) < bytes)
+        return statusTruncated;
+
+      format = GL_RGB;
+      if (maxval == 255)
+      {
+        levels.push_back({width, height, ptr, samples});
+        return statusOK;
+      }
+
+      buffers_.push_back(std::vector<unsigned char>(samples));
+      unsigned char *out = buffers_.back().data();
+      for (size_t ii=0; ii != samples; ++ii)
+      {
+        unsigned value = maxval > 255?(ptr[2*ii] << 8 | ptr[2*ii+1]):ptr[ii];
+        out[ii] = (std::min(value, (unsigned)maxval)*255 + maxval/2)/maxval;
+      }
+      levels.push_back({width, height, out, samples});
+
+      return statusOK;
+    }
+
+    /// Reads KTX version 1. Compressed images use their glInternalFormat.
+    Status readKTX()
+    {
+      const unsigned char *ptr = file_->data()+12, *end = file_->data()+file_->size();
+
+      uint32_t header[13];
+      if ((size_t)(end-ptr) < sizeof(header))
+        return statusTruncated;
+      memcpy(header, ptr, sizeof(header));
+      ptr += sizeof(header);
+
+      // endianness, glType, glTypeSize, glFormat, glInternalFormat, glBaseInternalFormat,
+      // pixelWidth, pixelHeight, pixelDepth, numberOfArrayElements, numberOfFaces,
+      // numberOfMipmapLevels, bytesOfKeyValueData
+      if (header[0] != 0x04030201 || header[8] > 1 || header[9] > 1 || header[10] != 1 || !header[6] || !header[7])
+        return statusInvalid;
+
+      if (header[1])
+      {
+        if (header[1] != GL_UNSIGNED_BYTE || (header[3] != GL_RGB && header[3] != GL_RGBA))
+          return statusInvalid;
+        format = header[3];
+      }
+      else if (header[4])
+        compressed = header[4];
+      else
+        return statusInvalid;
+
+      if ((size_t)(end-ptr) < header[12])
+        return statusTruncated;
+      ptr += header[12];
+
+      int width = header[6], height = header[7];
+      size_t channels = format == GL_RGBA?4:3;
+      for (size_t ii=0; ii != std::max(header[11], 1u); ++ii)
+      {
+        uint32_t size;
+        if ((size_t)(end-ptr) < 4)
+          return statusTruncated;
+        memcpy(&size, ptr, 4);
+        ptr += 4;
+
+        // Uncompressed rows are padded to 4 bytes.
+        size_t row = width*channels, padded = (row+3)/4*4;
+        if ((size_t)(end-ptr) < size || (!compressed && size != padded*height))
+          return (size_t)(end-ptr) < size?statusTruncated:statusInvalid;
+
+        if (compressed || row == padded)
+          levels.push_back({width, height, ptr, size});
+        else
+        {
+          buffers_.push_back(std::vector<unsigned char>(row*height));
+          for (int yy=0; yy != height; ++yy)
+            memcpy(buffers_.back().data() + yy*row, ptr + yy*padded, row);
+          levels.push_back({width, height, buffers_.back().data(), row*height});
+        }
+
+        // The padding of the last level may be missing.
+        ptr += std::min(((size_t)size+3)/4*4, (size_t)(end-ptr));
+        width = std::max(width/2, 1);
+        height = std::max(height/2, 1);
+      }
+
+      return statusOK;
+    }
+
+    /// Reads block-compressed DDS, in BC1, BC2, BC3 or BC7 format.
+    Status readDDS()
+    {
+      const unsigned char *ptr = file_->data()+4, *end = file_->data()+file_->size();
+
+      uint32_t header[31];
+      if ((size_t)(end-ptr) < sizeof(header))
+        return statusTruncated;
+      memcpy(header, ptr, sizeof(header));
+      ptr += sizeof(header);
+
+      // size, flags, height, width, pitch, depth, mipMapCount, reserved[11],
+      // pixel format (size, flags, fourCC, ...), caps[4], reserved
+      const uint32_t fourcc = 0x4, dx10 = 0x30315844;
+      if (header[0] != 124 || !(header[19] & fourcc))
+        return statusInvalid;
+
+      size_t block = 16;
+      switch (header[20])
+      {
+        case 0x31545844: compressed = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; block = 8; break; // DXT1
+        case 0x33545844: compressed = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; break;            // DXT3
+        case 0x35545844: compressed = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;            // DXT5
+        case dx10:
+        {
+          uint32_t extended[5];
+          if ((size_t)(end-ptr) < sizeof(extended))
+            return statusTruncated;
+          memcpy(extended, ptr, sizeof(extended));
+          ptr += sizeof(extended);
+
+          switch (extended[0])
+          {
+            case 71: compressed = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; block = 8; break;
+            case 74: compressed = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; break;
+            case 77: compressed = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+            case 98: compressed = GL_COMPRESSED_RGBA_BPTC_UNORM; break;
+            case 99: compressed = GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM; break;
+            default: return statusInvalid;
+          }
+          break;
+        }
+        default:
+          return statusInvalid;
+      }
+
+      int width = header[3], height = header[2];
+      if (width <= 0 || height <= 0)
+        return statusInvalid;
+
+      for (size_t ii=0; ii != std::max(header[6], 1u); ++ii)
+      {
+        size_t size = (size_t)((width+3)/4)*((height+3)/4)*block;
+        if ((size_t)(end-ptr) < size)
+          return statusTruncated;
+
+        levels.push_back({width, height, ptr, size});
+        ptr += size;
+        width = std::max(width/2, 1);
+        height = std::max(height/2, 1);
+      }
+
+      return statusOK;
+    }
+
+    /// Reads decimal integer from PPM header, skipping whitespace and comments.
+    static bool readint(const unsigned char *&ptr, const unsigned char *end, int &value)
+    {
+      while (ptr != end && (isspace(*ptr) || *ptr == '#'))
+      {
+        if (*ptr == '#')
+          while (ptr != end && *ptr != '\n')
+            ptr++;
+        else
+          ptr++;
+      }
+
+      if (ptr == end || !isdigit(*ptr))
+        return false;
+
+      value = 0;
+      while (ptr != end && isdigit(*ptr) && value < 1000000)
+        value = 10*value + (*ptr++ - '0');
+
+      return true;
+    }
+};
+
+}
+
+#endif // PGL_IMAGE_H_
@@ -0,0 +1,577 @@
+/** \file indirect.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains GPU-culled instancing with indirect draws.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_INDIRECT_H_
+#define PGL_INDIRECT_H_
+
+#include "mesh.h"
+#include "primitive.h"
+
+#include <math.h>
+#include <stdint.h>
+
+namespace pgl {
+
+/**
+ * \brief Instances of several Primitives, culled on the GPU.
+ *
+ * Like an InstanceGroup, but with several prototypes, and with the
+ * instance transforms and colors kept on the GPU. Every frame, a compute
+ * shader tests the bounding sphere of every instance against the view
+ * frustum, and compacts the visible ones into a buffer. It also counts
+ * them per prototype in a command buffer. All prototypes are then drawn
+ * with a single glMultiDrawElementsIndirect call, without reading
+ * anything back to the CPU. For example,
+ * \code
+ * auto forest = scene->attach(new pgl::IndirectGroup());
+ * size_t trunk = forest->prototype(new pgl::Cylinder(1, 0.1));
+ * size_t crown = forest->prototype(new pgl::Sphere(0.5));
+ * for (size_t ii=0; ii != trees.size(); ++ii)
+ * {
+ *   forest->add(trunk, pgl::Translation(trees[ii]), {0.5, 0.3, 0});
+ *   forest->add(crown, pgl::Translation(trees[ii] + pgl::Vector3(0, 0, 1)), {0, 0.6, 0});
+ * }
+ * \endcode
+ *
+ * The GPU path requires the VBO backend and OpenGL 4.3. Otherwise, the
+ * instances are culled and drawn one by one on the CPU. Instances are
+ * culled only if Context::culling is set, as by Camera::culling.
+ *
+ * \note
+ * The geometry of the prototypes is copied when the group is first
+ * drawn on the GPU. All prototypes must have a Mesh and share its
+ * drawing mode and lighting. Textures are not supported. As with
+ * InstanceGroup, instance transforms may only rotate, translate and
+ * uniformly scale.
+ */
+class IndirectGroup : public Object
+{
+  protected:
+    /// Buffers on the GPU.
+    enum Buffer
+    {
+      bufferVertices,   ///< Merged prototype vertices.
+      bufferIndices,    ///< Merged prototype indices.
+      bufferTransforms, ///< Instance transforms.
+      bufferColors,     ///< Instance colors.
+      bufferTypes,      ///< Instance prototypes.
+      bufferPrototypes, ///< Prototype bounding spheres and offsets into bufferVisible.
+      bufferCommands,   ///< Indirect draw commands, one per prototype.
+      bufferVisible,    ///< Transforms and colors of visible instances, grouped by prototype.
+      buffers
+    };
+
+    /// Prototype as seen by the compute shader.
+    struct Prototype
+    {
+      float sphere[4];
+      uint32_t base, padding[3];
+    };
+
+    /// Arguments of glMultiDrawElementsIndirect.
+    struct Command
+    {
+      uint32_t count, instances, first, vertex, base;
+    };
+
+    std::vector<Primitive*> prototypes_;  ///< Primitives to draw.
+    std::vector<Transform4f> transforms_; ///< Packed instance transforms.
+    std::vector<Vector3f> colors_;        ///< Packed instance colors.
+    std::vector<uint32_t> types_;         ///< Prototype of every instance.
+    std::vector<Command> commands_;       ///< Commands with zero instances, uploaded before culling.
+    bool dirty_;                          ///< Whether instance data has changed since last upload.
+    bool merged_;                         ///< Whether the prototype geometry has been uploaded.
+    GLuint vao_, buffers_[buffers];       ///< OpenGL vertex array and buffer identifiers.
+    size_t capacity_;                     ///< Number of instances allocated on the GPU.
+
+  public:
+    IndirectGroup() : dirty_(true), merged_(false), vao_(0), buffers_(), capacity_(0) { }
+
+    ~IndirectGroup()
+    {
+#ifdef PGL_MODERN
+      if (vao_)
+      {
+        glDeleteBuffers(buffers, buffers_);
+        glDeleteVertexArrays(1, &vao_);
+      }
+#endif
+      for (size_t ii=0; ii != prototypes_.size(); ++ii)
+        delete prototypes_[ii];
+    }
+
+    /** \brief Adds prototype Primitive.
+     *
+     * \returns prototype index.
+     *
+     * \note
+     * Transfers ownership. Prototypes cannot be added after the group
+     * has been drawn. Prototypes without a Mesh, such as Arrows, or
+     * whose drawing mode or lighting differs from the first prototype
+     * are rejected, as they cannot be drawn by the same commands.
+     */
+    size_t prototype(Primitive *primitive)
+    {
+      if (merged_)
+      {
+        std::cerr << "Cannot add prototypes to an IndirectGroup after drawing it" << std::endl;
+        delete primitive;
+        return 0;
+      }
+
+      const MeshPtr &mesh = primitive->mesh();
+      if (!mesh)
+      {
+        std::cerr << "Cannot add prototypes without a Mesh to an IndirectGroup" << std::endl;
+        delete primitive;
+        return 0;
+      }
+
+      if (!prototypes_.empty())
+      {
+        const Mesh &first = *prototypes_[0]->mesh();
+        if (mesh->mode != first.mode || mesh->lighting != first.lighting)
+        {
+          std::cerr << "IndirectGroup prototypes must share their drawing mode and lighting" << std::endl;
+          delete primitive;
+          return 0;
+        }
+      }
+
+      prototypes_.push_back(primitive);
+      return prototypes_.size()-1;
+    }
+
+    /// Returns number of instances.
+    size_t size() const
+    {
+      return types_.size();
+    }
+
+    /// Removes all instances.
+    void clear()
+    {
+      transforms_.clear();
+      colors_.clear();
+      types_.clear();
+      dirty_ = bounds_dirty_ = true;
+    }
+
+    /// Adds instance of a prototype. \returns instance index.
+    size_t add(size_t prototype, const Transform &transform, const Vector3 &color = {1, 1, 1})
+    {
+      transforms_.push_back(Transform4f(transform)*Transform4f(prototypes_[prototype]->transform));
+      colors_.push_back(Vector3f(color));
+      types_.push_back(prototype);
+      dirty_ = bounds_dirty_ = true;
+
+      return size()-1;
+    }
+
+    /// Sets instance transform.
+    void set(size_t idx, const Transform &transform)
+    {
+      transforms_[idx] = Transform4f(transform)*Transform4f(prototypes_[types_[idx]]->transform);
+      dirty_ = bounds_dirty_ = true;
+    }
+
+    /// Sets instance transform and color.
+    void set(size_t idx, const Transform &transform, const Vector3 &color)
+    {
+      set(idx, transform);
+      colors_[idx] = Vector3f(color);
+    }
+
+    /** \brief Returns number of instances drawn by the last GPU draw().
+     *
+     * Reads back the command buffer, which stalls the pipeline. Meant
+     * for debugging.
+     */
+    size_t drawn() const
+    {
+      size_t drawn = 0;
+#ifdef PGL_MODERN
+      if (!vao_)
+        return 0;
+
+      std::vector<Command> commands(commands_.size());
+      glBindBuffer(GL_COPY_READ_BUFFER, buffers_[bufferCommands]);
+      glGetBufferSubData(GL_COPY_READ_BUFFER, 0, commands.size()*sizeof(Command), commands.data());
+      glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+      for (size_t ii=0; ii != commands.size(); ++ii)
+        drawn += commands[ii].instances;
+#endif
+      return drawn;
+    }
+
+    /// Culls and draws all instances relative to this object.
+    virtual void draw()
+    {
+      if (prototypes_.empty() || !size())
+        return;
+
+      Context &context = Context::current();
+
+      refresh();
+      if (!visible())
+        return;
+
+      // Instances cannot be sorted, so draw after the queue.
+      if (context.queue)
+      {
+        context.queue->defer(this);
+        return;
+      }
+
+#ifdef PGL_MODERN
+      if (context.backend == backendVBO && supported())
+      {
+        dispatch();
+        return;
+      }
+#endif
+
+      each();
+    }
+
+    /// Returns whether the OpenGL context supports culling on the GPU.
+    static bool supported()
+    {
+      return Context::glversion() >= 43;
+    }
+
+  protected:
+    /// Union of the bounds of all instances.
+    virtual Bounds localBounds() const
+    {
+      Bounds b;
+      for (size_t ii=0; ii != size(); ++ii)
+      {
+        const MeshPtr &mesh = prototypes_[types_[ii]]->mesh();
+        if (mesh)
+          b.extend(mesh->bounds.transformed(Transform(transforms_[ii])));
+      }
+
+      return b;
+    }
+
+    /// Culls and draws instances one by one, on the CPU.
+    void each()
+    {
+      Context &context = Context::current();
+
+      if (context.backend == backendDisplayList)
+      {
+        glPushMatrix();
+        glMultMatrixd(transform.data);
+      }
+
+      for (size_t ii=0; ii != size(); ++ii)
+      {
+        const MeshPtr &mesh = prototypes_[types_[ii]]->mesh();
+        if (!mesh)
+          continue;
+
+        Transform t(transforms_[ii]);
+        if (context.culling && !context.frustum.intersects(mesh->bounds.transformed(world_*t)))
+          continue;
+
+        if (context.backend == backendDisplayList)
+        {
+          glColor3fv(colors_[ii].data);
+          glPushMatrix();
+          glMultMatrixf(transforms_[ii].data);
+          mesh->draw();
+          glPopMatrix();
+        }
+#ifdef PGL_MODERN
+        else
+        {
+          Shader &shader = Shader::builtin();
+          shader.modelview(context.view*world_*t);
+          shader.color(Vector3(colors_[ii]));
+          mesh->draw();
+        }
+#endif
+      }
+
+      if (context.backend == backendDisplayList)
+        glPopMatrix();
+    }
+
+#ifdef PGL_MODERN
+    /// Culls instances with the compute shader, and draws the visible ones.
+    void dispatch()
+    {
+      Context &context = Context::current();
+      upload();
+
+      static GLuint program = 0;
+      static GLint world, planes, culling, instances;
+      if (!program)
+      {
+        program = compile();
+        world = glGetUniformLocation(program, "world");
+        planes = glGetUniformLocation(program, "planes");
+        culling = glGetUniformLocation(program, "culling");
+        instances = glGetUniformLocation(program, "instances");
+      }
+
+      // Normalized planes, such that their distance can be compared to sphere radii.
+      float p[6][4];
+      for (size_t ii=0; ii != 6; ++ii)
+      {
+        const double *plane = context.frustum.planes[ii];
+        double norm = sqrt(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+        for (size_t jj=0; jj != 4; ++jj)
+          p[ii][jj] = norm > 0?plane[jj]/norm:0;
+      }
+
+      glUseProgram(program);
+      glUniformMatrix4fv(world, 1, GL_FALSE, Transform4f(world_).data);
+      glUniform4fv(planes, 6, &p[0][0]);
+      glUniform1i(culling, context.culling);
+      glUniform1ui(instances, size());
+      for (size_t ii=bufferTransforms; ii != buffers; ++ii)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ii-bufferTransforms, buffers_[ii]);
+
+      glDispatchCompute((size()+63)/64, 1, 1);
+      glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+      for (size_t ii=bufferTransforms; ii != buffers; ++ii)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ii-bufferTransforms, 0);
+
+      const Mesh &mesh = *prototypes_[0]->mesh();
+      Shader &shader = Shader::builtin();
+      shader.use();
+      shader.modelview(context.view*world_);
+      shader.lighting(mesh.lighting);
+      shader.textured(false);
+      shader.instanced(true);
+
+      if (context.profiler)
+        context.profiler->stats.draws++;
+
+      glBindVertexArray(vao_);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffers_[bufferCommands]);
+      glMultiDrawElementsIndirect(mesh.mode, GL_UNSIGNED_INT, (void*)0, commands_.size(), 0);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      glBindVertexArray(0);
+
+      shader.instanced(false);
+    }
+
+    /// Uploads prototype geometry on first use, changed instance data, and resets the commands.
+    void upload()
+    {
+      if (!vao_)
+      {
+        glGenVertexArrays(1, &vao_);
+        glGenBuffers(buffers, buffers_);
+      }
+
+      glBindVertexArray(vao_);
+
+      if (!merged_)
+      {
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+
+        commands_.resize(prototypes_.size());
+        for (size_t ii=0; ii != prototypes_.size(); ++ii)
+        {
+          Command &command = commands_[ii];
+          command.first = indices.size();
+          command.vertex = vertices.size();
+          command.instances = 0;
+
+          const MeshPtr &mesh = prototypes_[ii]->mesh();
+          if (mesh)
+          {
+            vertices.insert(vertices.end(), mesh->vertices.begin(), mesh->vertices.end());
+            if (mesh->indices.empty())
+              for (size_t jj=0; jj != mesh->vertices.size(); ++jj)
+                indices.push_back(jj);
+            else
+              indices.insert(indices.end(), mesh->indices.begin(), mesh->indices.end());
+          }
+          command.count = indices.size()-command.first;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferVertices]);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texcoord));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers_[bufferIndices]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+
+        merged_ = true;
+        dirty_ = true;
+      }
+
+      if (capacity_ < size())
+      {
+        // Grow geometrically to avoid reallocation when adding instances.
+        capacity_ = std::max(size(), 2*capacity_);
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferTransforms]);
+        glBufferData(GL_ARRAY_BUFFER, capacity_*sizeof(Transform4f), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferColors]);
+        glBufferData(GL_ARRAY_BUFFER, capacity_*sizeof(Vector3f), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferTypes]);
+        glBufferData(GL_ARRAY_BUFFER, capacity_*sizeof(uint32_t), NULL, GL_DYNAMIC_DRAW);
+
+        // Visible instances are read as per-instance attributes of the built-in Shader.
+        const size_t stride = sizeof(Transform4f) + sizeof(Vector3f);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferVisible]);
+        glBufferData(GL_ARRAY_BUFFER, capacity_*stride, NULL, GL_DYNAMIC_COPY);
+        for (size_t ii=0; ii != 4; ++ii)
+        {
+          glEnableVertexAttribArray(3+ii);
+          glVertexAttribPointer(3+ii, 4, GL_FLOAT, GL_FALSE, stride, (void*)(ii*4*sizeof(float)));
+          glVertexAttribDivisor(3+ii, 1);
+        }
+        glEnableVertexAttribArray(7);
+        glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, stride, (void*)sizeof(Transform4f));
+        glVertexAttribDivisor(7, 1);
+
+        dirty_ = true;
+      }
+
+      if (dirty_)
+      {
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferTransforms]);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, transforms_.size()*sizeof(Transform4f), transforms_.data());
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferColors]);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, colors_.size()*sizeof(Vector3f), colors_.data());
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferTypes]);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, types_.size()*sizeof(uint32_t), types_.data());
+
+        // Every prototype gets room for all of its instances in the visible buffer.
+        std::vector<uint32_t> counts(prototypes_.size(), 0);
+        for (size_t ii=0; ii != size(); ++ii)
+          counts[types_[ii]]++;
+
+        std::vector<Prototype> prototypes(prototypes_.size());
+        uint32_t base = 0;
+        for (size_t ii=0; ii != prototypes_.size(); ++ii)
+        {
+          const MeshPtr &mesh = prototypes_[ii]->mesh();
+          Vector3 center = mesh?mesh->bounds.center():Vector3(0, 0, 0);
+          prototypes[ii] = {{(float)center.x, (float)center.y, (float)center.z, mesh?(float)mesh->bounds.radius():0.f}, base, {0, 0, 0}};
+          commands_[ii].base = base;
+          base += counts[ii];
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferPrototypes]);
+        glBufferData(GL_ARRAY_BUFFER, prototypes.size()*sizeof(Prototype), prototypes.data(), GL_DYNAMIC_DRAW);
+
+        dirty_ = false;
+      }
+
+      // Instance counts are accumulated by the compute shader.
+      glBindBuffer(GL_ARRAY_BUFFER, buffers_[bufferCommands]);
+      glBufferData(GL_ARRAY_BUFFER, commands_.size()*sizeof(Command), commands_.data(), GL_STREAM_DRAW);
+
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      glBindVertexArray(0);
+    }
+
+    /// Compiles the culling shader. Errors are reported on std::cerr.
+    static GLuint compile()
+    {
+      const char *cs =
+        "#version 430 core\n"
+        "layout(local_size_x = 64) in;\n"
+        "struct Prototype { vec4 sphere; uint base, padding0, padding1, padding2; };\n"
+        "struct Command { uint count, instances, first, vertex, base; };\n"
+        "struct Visible { mat4 transform; vec4 color; };\n"
+        "layout(std430, binding = 0) readonly buffer Transforms { mat4 transforms[]; };\n"
+        "layout(std430, binding = 1) readonly buffer Colors { vec4 colors[]; };\n"
+        "layout(std430, binding = 2) readonly buffer Types { uint types[]; };\n"
+        "layout(std430, binding = 3) readonly buffer Prototypes { Prototype prototypes[]; };\n"
+        "layout(std430, binding = 4) buffer Commands { Command commands[]; };\n"
+        "layout(std430, binding = 5) writeonly buffer Visibles { Visible visible[]; };\n"
+        "uniform mat4 world;\n"
+        "uniform vec4 planes[6];\n"
+        "uniform bool culling;\n"
+        "uniform uint instances;\n"
+        "void main()\n"
+        "{\n"
+        "  uint ii = gl_GlobalInvocationID.x;\n"
+        "  if (ii >= instances)\n"
+        "    return;\n"
+        "  uint type = types[ii];\n"
+        "  Prototype p = prototypes[type];\n"
+        "  if (culling)\n"
+        "  {\n"
+        "    mat4 m = world*transforms[ii];\n"
+        "    vec3 c = (m*vec4(p.sphere.xyz, 1)).xyz;\n"
+        "    float r = p.sphere.w*max(length(m[0].xyz), max(length(m[1].xyz), length(m[2].xyz)));\n"
+        "    for (int jj=0; jj != 6; ++jj)\n"
+        "      if (dot(planes[jj].xyz, c) + planes[jj].w < -r)\n"
+        "        return;\n"
+        "  }\n"
+        "  uint slot = atomicAdd(commands[type].instances, 1u);\n"
+        "  visible[p.base + slot] = Visible(transforms[ii], colors[ii]);\n"
+        "}\n";
+
+      GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+      glShaderSource(shader, 1, &cs, NULL);
+      glCompileShader(shader);
+
+      GLint status;
+      glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+      if (!status)
+      {
+        char log[1024];
+        glGetShaderInfoLog(shader, 1024, NULL, log);
+        std::cerr << "Cannot compile culling shader: " << log << std::endl;
+      }
+
+      GLuint program = glCreateProgram();
+      glAttachShader(program, shader);
+      glLinkProgram(program);
+      glDeleteShader(shader);
+
+      glGetProgramiv(program, GL_LINK_STATUS, &status);
+      if (!status)
+      {
+        char log[1024];
+        glGetProgramInfoLog(program, 1024, NULL, log);
+        std::cerr << "Cannot link culling shader: " << log << std::endl;
+      }
+
+      return program;
+    }
+#endif
+};
+
+}
+
+#endif // PGL_INDIRECT_H_
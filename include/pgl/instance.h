@@ -0,0 +1,253 @@
+/** \file instance.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains instanced drawing of repeated primitives.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_INSTANCE_H_
+#define PGL_INSTANCE_H_
+
+#include "primitive.h"
+
+#include <algorithm>
+
+namespace pgl {
+
+/**
+ * \brief Group of instances of a single Primitive.
+ *
+ * Draws many copies of a prototype Primitive, each with its own transform
+ * and color, without creating a Node for each of them. For example,
+ * \code
+ * auto cloud = scene->attach(new pgl::InstanceGroup(new pgl::Sphere(0.01)));
+ * for (size_t ii=0; ii != points.size(); ++ii)
+ *   cloud->add(pgl::Translation(points[ii]), {1, 0, 0});
+ * \endcode
+ *
+ * Using the VBO backend, all instances are drawn in a single call.
+ * Per-instance data is kept in packed arrays, and only uploaded when
+ * it has changed.
+ *
+ * \note
+ * Only the prototype's Mesh and transform are used, such that composite
+ * primitives without a Mesh, like Arrow, are not supported. The
+ * prototype's transform is applied before the instance transform, which
+ * may only rotate, translate and uniformly scale.
+ */
+class InstanceGroup : public Object
+{
+  protected:
+    Primitive *prototype_;           ///< Primitive to draw.
+    std::vector<Transform4f> transforms_; ///< Packed instance transforms.
+    std::vector<Vector3f> colors_;        ///< Packed instance colors.
+    bool dirty_;                     ///< Whether instance data has changed since last upload.
+    GLuint vao_, vbo_[2];            ///< OpenGL vertex array and instance buffer identifiers.
+    size_t capacity_;                ///< Number of instances allocated on the GPU.
+    size_t generation_;              ///< Mesh generation the vertex array refers to.
+
+  public:
+    /** \brief Specifies prototype Primitive to draw.
+     *
+     * \note
+     * Transfers ownership.
+     */
+    InstanceGroup(Primitive *prototype) : prototype_(prototype), dirty_(true), vao_(0), vbo_{0, 0}, capacity_(0), generation_(0) { }
+
+    ~InstanceGroup()
+    {
+#ifdef PGL_MODERN
+      if (vao_)
+      {
+        glDeleteBuffers(2, vbo_);
+        glDeleteVertexArrays(1, &vao_);
+      }
+#endif
+      delete prototype_;
+    }
+
+    /// Returns number of instances.
+    size_t size() const
+    {
+      return colors_.size();
+    }
+
+    /// Reserve space for a number of instances.
+    void reserve(size_t instances)
+    {
+      transforms_.reserve(instances);
+      colors_.reserve(instances);
+    }
+
+    /// Remove all instances.
+    void clear()
+    {
+      transforms_.clear();
+      colors_.clear();
+      dirty_ = bounds_dirty_ = true;
+    }
+
+    /// Adds instance. \returns instance index.
+    size_t add(const Transform &transform, const Vector3 &color = {1, 1, 1})
+    {
+      transforms_.push_back(Transform4f(transform)*Transform4f(prototype_->transform));
+      colors_.push_back(Vector3f(color));
+      dirty_ = bounds_dirty_ = true;
+
+      return size()-1;
+    }
+
+    /// Sets instance transform.
+    void set(size_t idx, const Transform &transform)
+    {
+      transforms_[idx] = Transform4f(transform)*Transform4f(prototype_->transform);
+      dirty_ = bounds_dirty_ = true;
+    }
+
+    /// Sets instance transform and color.
+    void set(size_t idx, const Transform &transform, const Vector3 &color)
+    {
+      set(idx, transform);
+      colors_[idx] = Vector3f(color);
+    }
+
+    /// Draw all instances relative to this object.
+    virtual void draw()
+    {
+      const MeshPtr &mesh = prototype_->mesh();
+      if (!mesh || !size())
+        return;
+
+      Context &context = Context::current();
+
+      refresh();
+      if (!visible())
+        return;
+
+      // Instances cannot be sorted, so draw after the queue.
+      if (context.queue)
+      {
+        context.queue->defer(this);
+        return;
+      }
+
+      if (context.backend == backendDisplayList)
+      {
+        glPushMatrix();
+        glMultMatrixd(transform.data);
+        for (size_t ii=0; ii != size(); ++ii)
+        {
+          glColor3fv(colors_[ii].data);
+          glPushMatrix();
+          glMultMatrixf(transforms_[ii].data);
+          mesh->draw();
+          glPopMatrix();
+        }
+        glPopMatrix();
+      }
+#ifdef PGL_MODERN
+      else
+      {
+        if (!mesh->uploaded())
+          mesh->upload();
+        upload(*mesh);
+
+        Shader &shader = Shader::builtin();
+        shader.modelview(context.view*world_);
+        shader.instanced(true);
+        mesh->draw(vao_, size());
+        shader.instanced(false);
+      }
+#endif
+    }
+
+  protected:
+    /// Union of the bounds of all instances.
+    virtual Bounds localBounds() const
+    {
+      Bounds b;
+      const MeshPtr &mesh = prototype_->mesh();
+      if (!mesh)
+        return b;
+
+      for (size_t ii=0; ii != size(); ++ii)
+        b.extend(mesh->bounds.transformed(Transform(transforms_[ii])));
+
+      return b;
+    }
+
+#ifdef PGL_MODERN
+    /// Sets up vertex array and uploads changed instance data.
+    void upload(const Mesh &mesh)
+    {
+      if (!vao_)
+      {
+        glGenVertexArrays(1, &vao_);
+        glGenBuffers(2, vbo_);
+      }
+
+      glBindVertexArray(vao_);
+
+      if (generation_ != mesh.generation())
+      {
+        // Source per-vertex attributes from the (new) mesh buffer.
+        mesh.attributes();
+        generation_ = mesh.generation();
+      }
+
+      if (capacity_ < size())
+      {
+        // Grow geometrically to avoid reallocation when adding instances.
+        capacity_ = std::max(size(), 2*capacity_);
+
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_[0]);
+        glBufferData(GL_ARRAY_BUFFER, capacity_*sizeof(Transform4f), NULL, GL_DYNAMIC_DRAW);
+        for (size_t ii=0; ii != 4; ++ii)
+        {
+          glEnableVertexAttribArray(3+ii);
+          glVertexAttribPointer(3+ii, 4, GL_FLOAT, GL_FALSE, sizeof(Transform4f), (void*)(ii*4*sizeof(float)));
+          glVertexAttribDivisor(3+ii, 1);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_[1]);
+        glBufferData(GL_ARRAY_BUFFER, capacity_*sizeof(Vector3f), NULL, GL_DYNAMIC_DRAW);
+        glEnableVertexAttribArray(7);
+        glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, sizeof(Vector3f), (void*)0);
+        glVertexAttribDivisor(7, 1);
+
+        dirty_ = true;
+      }
+
+      if (dirty_)
+      {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, transforms_.size()*sizeof(Transform4f), transforms_.data());
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_[1]);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, colors_.size()*sizeof(Vector3f), colors_.data());
+        dirty_ = false;
+      }
+
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+#endif
+};
+
+}
+
+#endif // PGL_INSTANCE_H_
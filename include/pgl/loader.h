@@ -0,0 +1,208 @@
+/** \file loader.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the asynchronous asset loader.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PGL_LOADER_H_
+#define PGL_LOADER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pgl {
+
+/**
+ * \brief Asynchronous asset loader.
+ *
+ * Runs file I/O and mesh processing on a pool of worker threads, and
+ * queues the resulting OpenGL uploads until poll() is called from the
+ * thread of the OpenGL context. Each poll() uploads for at most budget
+ * seconds, such that loading does not stall drawing. For example,
+ * \code
+ * pgl::Loader loader;
+ * scene->attach(new pgl::Model(loader, "teapot.stl", {0, 0, -1}, 0.1));
+ *
+ * while (running)
+ * {
+ *   loader.poll();
+ *   camera->draw();
+ * }
+ * \endcode
+ *
+ * \note
+ * The Loader must outlive the assets it loads, and may only be
+ * used from the thread of the OpenGL context.
+ */
+class Loader
+{
+  public:
+    typedef std::function<void()> Work;   ///< Work to run on a worker thread.
+    typedef std::function<bool()> Upload; ///< Upload step to run on the context thread. Returns true when done.
+
+    double budget; ///< Time in seconds that poll() may spend uploading.
+    size_t chunk;  ///< Bytes transferred per upload step, for uploads that can be split.
+
+  protected:
+    struct Job
+    {
+      Work work;
+      Upload upload;
+    };
+
+    std::vector<std::thread> workers_;
+    std::deque<Job> queued_, ready_;  ///< Jobs waiting for a worker, and waiting for upload.
+    size_t pending_;                  ///< Number of jobs not yet uploaded.
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable work_, done_;
+
+  public:
+    /** \brief Starts worker threads.
+     *
+     * threads specifies the number of workers, or 0 for the number of
+     * cores.
+     */
+    Loader(size_t threads=0, double _budget=0.002) : budget(_budget), chunk(1 << 22), pending_(0), stop_(false)
+    {
+      if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+      for (size_t ii=0; ii != threads; ++ii)
+        workers_.push_back(std::thread(&Loader::run, this));
+    }
+
+    Loader(const Loader&) = delete;
+    Loader &operator=(const Loader&) = delete;
+
+    /// Stops worker threads. Jobs that have not been uploaded are discarded.
+    ~Loader()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      work_.notify_all();
+
+      for (size_t ii=0; ii != workers_.size(); ++ii)
+        workers_[ii].join();
+    }
+
+    /** \brief Queues a job.
+     *
+     * Runs work on a worker thread, and afterwards calls upload from
+     * poll() until it returns true. Both are destroyed on the context
+     * thread, so they may hold OpenGL resources.
+     */
+    void enqueue(const Work &work, const Upload &upload)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_.push_back({work, upload});
+        pending_++;
+      }
+      work_.notify_one();
+    }
+
+    /** \brief Performs queued uploads.
+     *
+     * Stops when the budget is exhausted, but always makes progress if
+     * an upload is ready. Must be called from the thread of the OpenGL
+     * context, e.g. once per frame.
+     *
+     * \returns number of jobs that have not been uploaded yet.
+     */
+    size_t poll()
+    {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      do
+      {
+        Job job;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (ready_.empty())
+            break;
+          job = std::move(ready_.front());
+          ready_.pop_front();
+        }
+
+        bool done = job.upload();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done)
+          pending_--;
+        else
+          ready_.push_front(std::move(job));
+      } while (std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count() < budget);
+
+      return pending();
+    }
+
+    /// Blocks until all jobs have been uploaded. Must be called from the thread of the OpenGL context.
+    void wait()
+    {
+      while (poll())
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this]{ return !ready_.empty() || !pending_; });
+      }
+    }
+
+    /// Returns number of jobs that have not been uploaded yet.
+    size_t pending()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return pending_;
+    }
+
+  protected:
+    /// Worker thread.
+    void run()
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+
+      while (true)
+      {
+        work_.wait(lock, [this]{ return stop_ || !queued_.empty(); });
+        if (stop_)
+          return;
+
+        Job job = std::move(queued_.front());
+        queued_.pop_front();
+
+        lock.unlock();
+        job.work();
+        lock.lock();
+
+        // Hand the job back, such that it is destroyed on the context thread.
+        ready_.push_back(std::move(job));
+        done_.notify_all();
+      }
+    }
+};
+
+}
+
+#endif // PGL_LOADER_H_
@@ -0,0 +1,270 @@
+/** \file loop.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the render loop.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_LOOP_H_
+#define PGL_LOOP_H_
+
+#include "loader.h"
+#include "profiler.h"
+
+#include <atomic>
+#include <thread>
+
+namespace pgl {
+
+/**
+ * \brief Event-driven render loop.
+ *
+ * Only draws a frame when the view is dirty: after invalidate(), when the
+ * Camera of the controller moved, while the controller's time-based
+ * motion has not settled, or when the loader uploaded an asset. In
+ * between, it blocks in the window system's event wait, so static
+ * scenes use no CPU or GPU, and input is handled as soon as it arrives.
+ * For example, with GLFW,
+ * \code
+ * pgl::RenderLoop loop(controller, &loader);
+ * loop.frame = [&](double dt)
+ * {
+ *   camera->draw();
+ *   glfwSwapBuffers(window);
+ * };
+ * loop.wait = [](double timeout)
+ * {
+ *   if (timeout == 0)
+ *     glfwPollEvents();
+ *   else if (std::isinf(timeout))
+ *     glfwWaitEvents();
+ *   else
+ *     glfwWaitEventsTimeout(timeout);
+ * };
+ * loop.wake = glfwPostEmptyEvent;
+ *
+ * glfwSwapInterval(1);
+ * loop.run();
+ * \endcode
+ *
+ * Frames are paced by the swap interval, and additionally limited to one
+ * per target seconds. Deadlines advance by a whole target from the
+ * previous one, so frames keep their cadence when the target is a
+ * multiple of the refresh period. Animations should invalidate() the
+ * view every frame, and advance by the elapsed time passed to frame.
+ *
+ * The duration of the last frames, including the swap, is kept for
+ * statistics. If Context::profiler is set, frames are also delimited by
+ * Profiler::begin() and Profiler::end().
+ *
+ * \note
+ * Changes to the scene graph are not detected; call invalidate()
+ * after making them. It may be called from any thread, provided wake is
+ * thread-safe, as glfwPostEmptyEvent() is.
+ */
+class RenderLoop
+{
+  public:
+    typedef std::function<void(double dt)> Frame;     ///< Draws and presents a frame, dt seconds after the previous one.
+    typedef std::function<void(double timeout)> Wait; ///< Waits at most timeout seconds (INFINITY for indefinitely) for events, and handles them.
+    typedef std::function<void()> Wake;               ///< Interrupts Wait from any thread.
+
+    /// Frame time statistics.
+    struct Stats
+    {
+      size_t frames;     ///< Number of frames drawn.
+      size_t waits;      ///< Number of times the loop blocked without a frame to draw.
+      double last;       ///< Duration of the last frame in seconds.
+      double mean, max;  ///< Mean and maximum duration over the history.
+    };
+
+    Frame frame;         ///< Frame function. Required.
+    Wait wait;           ///< Event wait function. If not set, the loop sleeps instead.
+    Wake wake;           ///< Wake function, called by invalidate(). Optional.
+    Controller *controller; ///< Controller whose camera and motion to follow, or NULL.
+    Loader *loader;      ///< Loader to poll, or NULL.
+    double target;       ///< Minimum time between frames in seconds, or 0 to only pace by the swap interval.
+    double interval;     ///< Time between polls of the loader while it loads in the background.
+    size_t frames;       ///< Number of frame durations to keep in the history.
+    bool running;        ///< Whether run() continues. Cleared by stop().
+
+  protected:
+    typedef std::chrono::steady_clock Clock;
+
+    std::atomic<bool> dirty_;  ///< Whether a frame was requested by invalidate().
+    bool idle_;                ///< Whether the loop blocked since the last frame.
+    Transform view_;           ///< Camera transform of the last frame.
+    size_t pending_;           ///< Number of loader jobs after the last poll.
+    Clock::time_point last_;   ///< Start of the last frame.
+    Clock::time_point deadline_; ///< Earliest start of the next frame.
+    std::deque<double> history_; ///< Duration of the last frames.
+    Stats stats_;
+
+  public:
+    RenderLoop(Controller *_controller=NULL, Loader *_loader=NULL) :
+      controller(_controller), loader(_loader), target(0), interval(0.01), frames(120), running(false),
+      dirty_(true), idle_(true), view_({0, 0, 0}, {0, 0, 0}), pending_(0), stats_{0, 0, 0, 0, 0}
+    {
+      last_ = deadline_ = Clock::now();
+    }
+
+    /// Requests a frame. May be called from any thread.
+    void invalidate()
+    {
+      dirty_ = true;
+      if (wake)
+        wake();
+    }
+
+    /// Returns whether a frame will be drawn.
+    bool dirty() const
+    {
+      return dirty_ || (controller && (memcmp(controller->camera->transform.data, view_.data, sizeof(view_.data)) || !controller->settled()));
+    }
+
+    /// Runs until stop() is called, e.g. from the window close callback.
+    void run()
+    {
+      running = true;
+      while (running)
+        step();
+    }
+
+    /// Stops run() after the current step.
+    void stop()
+    {
+      running = false;
+      if (wake)
+        wake();
+    }
+
+    /** \brief Waits for events or the next deadline, and draws a frame if the view is dirty.
+     *
+     * \returns whether a frame was drawn.
+     */
+    bool step()
+    {
+      if (loader)
+      {
+        // Uploads change the scene.
+        size_t pending = loader->poll();
+        if (pending < pending_)
+          dirty_ = true;
+        pending_ = pending;
+      }
+
+      Clock::time_point now = Clock::now();
+      if (!dirty())
+      {
+        stats_.waits++;
+        idle_ = true;
+        block(loader && pending_?interval:INFINITY);
+        return false;
+      }
+
+      if (now < deadline_)
+      {
+        block(std::chrono::duration<double>(deadline_-now).count());
+        return false;
+      }
+
+      // Handle events that arrived in the meantime, without blocking.
+      block(0);
+      draw();
+      return true;
+    }
+
+    /// Returns frame time statistics.
+    const Stats &stats() const
+    {
+      return stats_;
+    }
+
+    /// Returns duration of the last frames in seconds, oldest first.
+    const std::deque<double> &history() const
+    {
+      return history_;
+    }
+
+  protected:
+    /// Draws a frame.
+    void draw()
+    {
+      Clock::time_point start = Clock::now();
+
+      // After blocking, the time since the last frame says nothing about the frame rate.
+      double dt = std::chrono::duration<double>(start-last_).count();
+      if (idle_)
+        dt = std::max(target, stats_.mean);
+      idle_ = false;
+      last_ = start;
+
+      if (target > 0)
+      {
+        // Keep the cadence, unless more than a whole frame late.
+        Clock::duration period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(target));
+        deadline_ += period;
+        if (deadline_ < start)
+          deadline_ = start + period;
+      }
+
+      // Cleared first, so invalidations while drawing request another frame.
+      dirty_ = false;
+
+      if (controller)
+      {
+        controller->update(dt);
+        view_ = controller->camera->transform;
+      }
+
+      Profiler *profiler = Context::current().profiler;
+      if (profiler)
+        profiler->begin();
+      frame(dt);
+      if (profiler)
+        profiler->end();
+
+      double duration = Profiler::seconds(start);
+      history_.push_back(duration);
+      while (history_.size() > frames)
+        history_.pop_front();
+
+      stats_.frames++;
+      stats_.last = duration;
+      stats_.mean = stats_.max = 0;
+      for (size_t ii=0; ii != history_.size(); ++ii)
+      {
+        stats_.mean += history_[ii]/history_.size();
+        stats_.max = std::max(stats_.max, history_[ii]);
+      }
+    }
+
+    /// Waits for events for at most timeout seconds.
+    void block(double timeout)
+    {
+      if (wait)
+        wait(timeout);
+      else if (timeout > 0)
+        std::this_thread::sleep_for(std::chrono::duration<double>(std::min(timeout, interval)));
+    }
+};
+
+}
+
+#endif // PGL_LOOP_H_
@@ -22,11 +22,21 @@
 #ifndef PGL_MATH_H_
 #define PGL_MATH_H_
 
+#include <algorithm>
 #include <ostream>
 
 #include <string.h>
 #include <math.h>
 
+// SIMD support for single-precision types
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PGL_SSE
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define PGL_NEON
+#include <arm_neon.h>
+#endif
+
 namespace pgl {
 
 /** \brief 3-component vector.
@@ -249,14 +259,43 @@ class Transform
     {
       Transform result;
     
-      for (unsigned char ii = 0; ii < 4; ++ii)
-        for (unsigned char jj = 0; jj < 4; ++jj)
-        {
-          double sum = 0;
-          for (unsigned char kk = 0; kk < 4; ++kk)
-            sum += data[ii+kk*4]*rhs.data[jj*4+kk];
-          result[ii+jj*4] = sum;
-        }
+      // Column-wise, such that the inner loop can be vectorized
+      for (unsigned char jj = 0; jj < 4; ++jj)
+      {
+        const double *b = &rhs.data[jj*4];
+        for (unsigned char ii = 0; ii < 4; ++ii)
+          result[ii+jj*4] = data[ii]*b[0] + data[ii+4]*b[1] + data[ii+8]*b[2] + data[ii+12]*b[3];
+      }
+      
+      return result;
+    }
+    
+    /** \brief Inverse of an affine transform.
+     *
+     * The last row is assumed to be (0, 0, 0, 1).
+     */
+    Transform inverse() const
+    {
+      // The inverse of the upper 3x3 part is its transposed cofactor matrix divided by the determinant.
+      const double *m = data;
+      double c[9] = {m[5]*m[10]-m[6]*m[9], m[6]*m[8]-m[4]*m[10], m[4]*m[9]-m[5]*m[8],
+                     m[9]*m[2]-m[10]*m[1], m[10]*m[0]-m[8]*m[2], m[8]*m[1]-m[9]*m[0],
+                     m[1]*m[6]-m[2]*m[5],  m[2]*m[4]-m[0]*m[6],  m[0]*m[5]-m[1]*m[4]};
+      double det = m[0]*c[0] + m[1]*c[1] + m[2]*c[2];
+
+      Transform result;
+      for (unsigned char ii = 0; ii < 3; ++ii)
+      {
+        for (unsigned char jj = 0; jj < 3; ++jj)
+          result[ii+jj*4] = c[jj+ii*3]/det;
+        result[ii+12] = 0;
+        result[ii*4+3] = 0;
+      }
+      result[15] = 1;
+      
+      // Negated translation, transformed by the inverse.
+      for (unsigned char ii = 0; ii < 3; ++ii)
+        result[ii+12] = -(result[ii]*m[12] + result[ii+4]*m[13] + result[ii+8]*m[14]);
       
       return result;
     }
@@ -279,6 +318,415 @@ class Transform
 
 };
 
+/** \brief Axis-aligned bounding box.
+ *
+ * Default-constructed bounds are empty, and can be grown by extending
+ * them with points or other bounds. The bounding sphere is centered on
+ * the box and has a radius of half its diagonal.
+ */
+class Bounds
+{
+  public:
+    Vector3 lower, upper; ///< Minimum and maximum coordinates.
+    
+  public:
+    Bounds() : lower(INFINITY, INFINITY, INFINITY), upper(-INFINITY, -INFINITY, -INFINITY) { }
+    Bounds(const Vector3 &_lower, const Vector3 &_upper) : lower(_lower), upper(_upper) { }
+    
+    /// Returns whether the bounds contain nothing.
+    bool empty() const
+    {
+      return lower.x > upper.x || lower.y > upper.y || lower.z > upper.z;
+    }
+    
+    /// Grow bounds to contain point.
+    void extend(const Vector3 &p)
+    {
+      for (size_t ii=0; ii != 3; ++ii)
+      {
+        if (p[ii] < lower[ii]) lower[ii] = p[ii];
+        if (p[ii] > upper[ii]) upper[ii] = p[ii];
+      }
+    }
+    
+    /// Grow bounds to contain other bounds.
+    void extend(const Bounds &b)
+    {
+      if (b.empty())
+        return;
+        
+      extend(b.lower);
+      extend(b.upper);
+    }
+    
+    Vector3 center() const
+    {
+      return (lower+upper)/2;
+    }
+    
+    Vector3 size() const
+    {
+      return upper-lower;
+    }
+    
+    /// Radius of bounding sphere.
+    double radius() const
+    {
+      return empty()?0:size().norm()/2;
+    }
+    
+    /** \brief Transformed bounds.
+     *
+     * Returns the axis-aligned bounds of these bounds after applying
+     * homogeneous transform t to them.
+     */
+    Bounds transformed(const Transform &t) const
+    {
+      if (empty())
+        return *this;
+        
+      Vector3 c = center(), e = size()/2, tc, te;
+      for (size_t ii=0; ii != 3; ++ii)
+      {
+        tc[ii] = t[ii]*c.x + t[ii+4]*c.y + t[ii+8]*c.z + t[ii+12];
+        te[ii] = fabs(t[ii])*e.x + fabs(t[ii+4])*e.y + fabs(t[ii+8])*e.z;
+      }
+      
+      return Bounds(tc-te, tc+te);
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Bounds &obj)
+    {
+      os << "[" << obj.lower << ", " << obj.upper << "]";
+      return os;
+    }
+};
+
+/** \brief View frustum.
+ *
+ * Six clipping planes extracted from a combined projection and view
+ * transform, with normals pointing inwards.
+ */
+class Frustum
+{
+  public:
+    double planes[6][4]; ///< Plane (a, b, c, d) such that ax+by+cz+d >= 0 inside.
+    
+  public:
+    Frustum() { }
+    
+    /// Extracts planes from clip = projection*view.
+    Frustum(const Transform &clip)
+    {
+      for (size_t ii=0; ii != 6; ++ii)
+      {
+        // left, right, bottom, top, near, far
+        size_t row = ii/2;
+        double sign = (ii%2)?-1:1;
+        
+        for (size_t jj=0; jj != 4; ++jj)
+          planes[ii][jj] = clip[3+jj*4] + sign*clip[row+jj*4];
+      }
+    }
+    
+    /** \brief Returns whether bounds are (partially) inside the frustum.
+     *
+     * Conservative: bounds near the frustum corners may be reported
+     * as inside while they are not.
+     */
+    bool intersects(const Bounds &b) const
+    {
+      if (b.empty())
+        return false;
+    
+      for (size_t ii=0; ii != 6; ++ii)
+      {
+        const double *p = planes[ii];
+        
+        // Test corner furthest along plane normal
+        double d = p[3];
+        for (size_t jj=0; jj != 3; ++jj)
+          d += p[jj]*(p[jj] > 0?b.upper[jj]:b.lower[jj]);
+          
+        if (d < 0)
+          return false;
+      }
+      
+      return true;
+    }
+};
+
+/// Half-line from an origin along a direction.
+class Ray
+{
+  public:
+    Vector3 origin, direction;
+    
+  public:
+    Ray() : origin(0, 0, 0), direction(0, 0, -1) { }
+    Ray(const Vector3 &_origin, const Vector3 &_direction) : origin(_origin), direction(_direction) { }
+    
+    /// Returns point at distance t, in units of the direction.
+    Vector3 at(double t) const
+    {
+      return origin + direction*t;
+    }
+    
+    /// Returns ray transformed by homogeneous transform t.
+    Ray transformed(const Transform &t) const
+    {
+      Vector3 o, d;
+      for (size_t ii=0; ii != 3; ++ii)
+      {
+        o[ii] = t[ii]*origin.x + t[ii+4]*origin.y + t[ii+8]*origin.z + t[ii+12];
+        d[ii] = t[ii]*direction.x + t[ii+4]*direction.y + t[ii+8]*direction.z;
+      }
+      
+      return Ray(o, d);
+    }
+    
+    /** \brief Returns distance along the ray at which it enters bounds, or INFINITY if it misses them.
+     *
+     * Returns 0 if the origin lies inside the bounds.
+     */
+    double intersect(const Bounds &b) const
+    {
+      double tmin = 0, tmax = INFINITY;
+      for (size_t ii=0; ii != 3; ++ii)
+      {
+        double inv = 1/direction[ii];
+        double t1 = (b.lower[ii]-origin[ii])*inv, t2 = (b.upper[ii]-origin[ii])*inv;
+        if (inv < 0)
+          std::swap(t1, t2);
+        
+        // Also rejects NaN from rays parallel to a face.
+        if (!(t1 <= tmax && t2 >= tmin))
+          return INFINITY;
+          
+        tmin = std::max(tmin, t1);
+        tmax = std::min(tmax, t2);
+      }
+      
+      return tmin;
+    }
+};
+
+/** \brief Single-precision 3-component vector.
+ *
+ * Padded to four lanes and 16-byte aligned for use with SIMD instructions
+ * and vertex buffers. The padding component is kept at zero. Converts
+ * explicitly from and to Vector3.
+ */
+class alignas(16) Vector3f
+{
+  public:
+    union
+    {
+      float data[4];
+      struct
+      {
+        float x, y, z, w;
+      };
+    };
+    
+  public:
+    Vector3f() : data{0, 0, 0, 0} { }
+    Vector3f(float _x, float _y, float _z) : data{_x, _y, _z, 0} { }
+    explicit Vector3f(const Vector3 &v) : data{(float)v.x, (float)v.y, (float)v.z, 0} { }
+    
+    explicit operator Vector3() const
+    {
+      return Vector3(x, y, z);
+    }
+    
+    float &operator[](const unsigned int idx)
+    {
+      return data[idx];
+    }
+  
+    float operator[](const unsigned int idx) const
+    {
+      return data[idx];
+    }
+    
+    Vector3f operator-() const
+    {
+      return Vector3f(-x, -y, -z);
+    }
+
+    Vector3f operator+(const Vector3f &rhs) const
+    {
+      return Vector3f(x+rhs.x, y+rhs.y, z+rhs.z);
+    }
+
+    Vector3f operator-(const Vector3f &rhs) const
+    {
+      return Vector3f(x-rhs.x, y-rhs.y, z-rhs.z);
+    }
+
+    Vector3f operator*(const float &rhs) const
+    {
+      return Vector3f(x*rhs, y*rhs, z*rhs);
+    }
+
+    /// Elementwise product.
+    Vector3f operator*(const Vector3f &rhs) const
+    {
+      return Vector3f(x*rhs.x, y*rhs.y, z*rhs.z);
+    }
+
+    Vector3f operator/(const float &rhs) const
+    {
+      return Vector3f(x/rhs, y/rhs, z/rhs);
+    }
+    
+    Vector3f cross(const Vector3f &rhs) const
+    {
+      return Vector3f(y*rhs.z - z*rhs.y, z*rhs.x-x*rhs.z, x*rhs.y - y*rhs.x);
+    }
+    
+    float dot(const Vector3f &rhs) const
+    {
+      return x*rhs.x+y*rhs.y+z*rhs.z;
+    }
+    
+    float norm() const
+    {
+      return sqrtf(normsq());
+    }
+
+    float normsq() const
+    {
+      return dot(*this);
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Vector3f &obj)
+    {
+      os << "[" << obj.x << ", " << obj.y << ", " << obj.z << "]";
+      return os;
+    }
+};
+
+/** \brief Single-precision homogeneous coordinate transform.
+ *
+ * Column-major storage order, 16-byte aligned, such that it can be passed
+ * to OpenGL directly. Products use SSE or NEON instructions when
+ * available. Converts explicitly from and to Transform, and otherwise
+ * behaves the same.
+ */
+class alignas(16) Transform4f
+{
+  public:
+    union
+    {
+      float data[16];
+      struct
+      {
+        float __dummy[12];
+        float x, y, z;
+        float __dummy2;
+      };
+    };
+
+  public:
+    Transform4f() { }
+    
+    Transform4f(const float _data[16])
+    {
+      memcpy(data, _data, 16*sizeof(float));
+    }
+    
+    explicit Transform4f(const Transform &t)
+    {
+      for (size_t ii=0; ii != 16; ++ii)
+        data[ii] = t.data[ii];
+    }
+    
+    explicit operator Transform() const
+    {
+      Transform t;
+      for (size_t ii=0; ii != 16; ++ii)
+        t.data[ii] = data[ii];
+      return t;
+    }
+    
+    float &operator[](const unsigned int idx)
+    {
+      return data[idx];
+    }
+  
+    float operator[](const unsigned int idx) const
+    {
+      return data[idx];
+    }
+  
+    Transform4f operator*(const Transform4f &rhs) const
+    {
+      Transform4f result;
+      
+#if defined(PGL_SSE)
+      __m128 c0 = _mm_loadu_ps(data),   c1 = _mm_loadu_ps(data+4),
+             c2 = _mm_loadu_ps(data+8), c3 = _mm_loadu_ps(data+12);
+      
+      for (size_t jj=0; jj != 4; ++jj)
+      {
+        const float *b = &rhs.data[jj*4];
+        __m128 r = _mm_mul_ps(c0, _mm_set1_ps(b[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(b[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(b[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(b[3])));
+        _mm_storeu_ps(&result.data[jj*4], r);
+      }
+#elif defined(PGL_NEON)
+      float32x4_t c0 = vld1q_f32(data),   c1 = vld1q_f32(data+4),
+                  c2 = vld1q_f32(data+8), c3 = vld1q_f32(data+12);
+      
+      for (size_t jj=0; jj != 4; ++jj)
+      {
+        const float *b = &rhs.data[jj*4];
+        float32x4_t r = vmulq_n_f32(c0, b[0]);
+        r = vmlaq_n_f32(r, c1, b[1]);
+        r = vmlaq_n_f32(r, c2, b[2]);
+        r = vmlaq_n_f32(r, c3, b[3]);
+        vst1q_f32(&result.data[jj*4], r);
+      }
+#else
+      for (unsigned char jj = 0; jj < 4; ++jj)
+      {
+        const float *b = &rhs.data[jj*4];
+        for (unsigned char ii = 0; ii < 4; ++ii)
+          result[ii+jj*4] = data[ii]*b[0] + data[ii+4]*b[1] + data[ii+8]*b[2] + data[ii+12]*b[3];
+      }
+#endif
+
+      return result;
+    }
+    
+    /// Matrix-vector product. Same as Transform::operator*(const Vector3 &).
+    Vector3f operator*(const Vector3f &rhs) const
+    {
+#if defined(PGL_SSE)
+      __m128 v = _mm_set_ps(0, rhs.z, rhs.y, rhs.x);
+      __m128 p0 = _mm_mul_ps(_mm_loadu_ps(data), v),   p1 = _mm_mul_ps(_mm_loadu_ps(data+4), v),
+             p2 = _mm_mul_ps(_mm_loadu_ps(data+8), v), p3 = _mm_setzero_ps();
+      _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+      
+      Vector3f result;
+      _mm_storeu_ps(result.data, _mm_add_ps(_mm_add_ps(p0, p1), _mm_add_ps(p2, p3)));
+      return result;
+#elif defined(PGL_NEON)
+      float32x4_t v = {rhs.x, rhs.y, rhs.z, 0};
+      return Vector3f(vaddvq_f32(vmulq_f32(vld1q_f32(data), v)),
+                      vaddvq_f32(vmulq_f32(vld1q_f32(data+4), v)),
+                      vaddvq_f32(vmulq_f32(vld1q_f32(data+8), v)));
+#else
+      return Vector3f(data[0]*rhs.x + data[1]*rhs.y + data[ 2]*rhs.z,
+                      data[4]*rhs.x + data[5]*rhs.y + data[ 6]*rhs.z,
+                      data[8]*rhs.x + data[9]*rhs.y + data[10]*rhs.z);
+#endif
+    }
+};
+
 /// Transform with zero translation.
 class Rotation : public Transform
 {
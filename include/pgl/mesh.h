@@ -0,0 +1,552 @@
+/** \file mesh.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the geometry representation shared by primitives.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_MESH_H_
+#define PGL_MESH_H_
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace pgl {
+
+/// Interleaved vertex, as stored in a vertex buffer.
+struct Vertex
+{
+  float position[3], normal[3], texcoord[2];
+};
+
+/**
+ * \brief Shared primitive geometry.
+ *
+ * Holds the vertices of a Primitive, and their representation on the
+ * GPU for the current rendering Backend. Primitives with identical
+ * geometry share a single Mesh, which is deleted when the last Primitive
+ * using it goes out of scope.
+ *
+ * Vertices are entered by setting the normal and texture coordinate,
+ * followed by the position, as with glNormal, glTexCoord and glVertex.
+ *
+ * A Mesh may also be indexed, in which case each triangle or line is
+ * formed by consecutive indices into the vertex list. See Welder.
+ */
+class Mesh
+{
+  public:
+    GLenum mode;                  ///< Drawing mode, GL_TRIANGLES or GL_LINES.
+    bool lighting;                ///< Whether to apply lighting.
+    Texture texture;              ///< Texture, if any.
+    std::vector<Vertex> vertices; ///< Vertex data.
+    std::vector<uint32_t> indices; ///< Vertex indices. Empty if not indexed.
+    Bounds bounds;                ///< Bounds of vertex positions.
+    double error;                 ///< Approximate deviation from the source geometry, if simplified.
+
+  protected:
+    Vertex current_;              ///< Normal and texture coordinate of next vertex.
+    bool uploaded_;               ///< Whether the GPU representation is up to date.
+    Backend backend_;             ///< Backend of the GPU representation.
+    GLuint list_;                 ///< OpenGL display list identifier.
+    GLuint vao_, vbo_, ebo_;      ///< OpenGL vertex array, vertex buffer and index buffer identifiers.
+    size_t generation_;           ///< Number of uploads.
+    size_t staged_;               ///< Bytes transferred by an incomplete upload(size_t).
+
+  public:
+    Mesh() : mode(GL_TRIANGLES), lighting(true), error(0), current_(), uploaded_(false), backend_(backendDisplayList), list_(0), vao_(0), vbo_(0), ebo_(0), generation_(0), staged_(0) { }
+
+    ~Mesh()
+    {
+      release();
+    }
+
+    /// Sets normal for subsequent vertices.
+    void normal(const Vector3 &n)
+    {
+      current_.normal[0] = n.x;
+      current_.normal[1] = n.y;
+      current_.normal[2] = n.z;
+    }
+
+    /// Sets texture coordinate for subsequent vertices.
+    void texcoord(double u, double v)
+    {
+      current_.texcoord[0] = u;
+      current_.texcoord[1] = v;
+    }
+
+    /// Adds vertex. The Mesh must not be indexed.
+    void vertex(const Vector3 &v)
+    {
+      current_.position[0] = v.x;
+      current_.position[1] = v.y;
+      current_.position[2] = v.z;
+      vertices.push_back(current_);
+      bounds.extend(v);
+      uploaded_ = false;
+    }
+
+    /// Uploads vertices to the GPU, using the current rendering Backend.
+    void upload()
+    {
+      release();
+      backend_ = Context::current().backend;
+
+      if (backend_ == backendDisplayList)
+      {
+        // Lighting and texture state is set by draw(), such that a
+        // RenderQueue can share it between meshes.
+        list_ = glGenLists(1);
+        glNewList(list_, GL_COMPILE);
+        glBegin(mode);
+        for (size_t ii=0; ii != count(); ++ii)
+        {
+          const Vertex &v = vertices[indices.empty()?ii:indices[ii]];
+          glNormal3fv(v.normal);
+          if (texture)
+            glTexCoord2fv(v.texcoord);
+          glVertex3fv(v.position);
+        }
+        glEnd();
+        glEndList();
+      }
+#ifdef PGL_MODERN
+      else
+      {
+        glGenVertexArrays(1, &vao_);
+        glBindVertexArray(vao_);
+        glGenBuffers(1, &vbo_);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+        if (!indices.empty())
+        {
+          glGenBuffers(1, &ebo_);
+          glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_);
+          glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+        }
+        attributes();
+        glBindVertexArray(0);
+      }
+#endif
+
+      uploaded_ = true;
+      generation_++;
+    }
+    
+    /** \brief Uploads part of the vertices to the GPU.
+     *
+     * Allows large meshes to be uploaded over multiple frames. For
+     * backendVBO, transfers at most the given number of bytes per call,
+     * or everything if bytes is 0. The display list backend compiles the
+     * entire mesh at once.
+     *
+     * \returns true when the upload is complete.
+     *
+     * \note
+     * Drawing the mesh while the upload is incomplete uploads it again at
+     * once. See swap().
+     */
+    bool upload(size_t bytes)
+    {
+      if (Context::current().backend == backendDisplayList || !bytes)
+      {
+        upload();
+        return true;
+      }
+#ifdef PGL_MODERN
+      size_t vsize = vertices.size()*sizeof(Vertex), isize = indices.size()*sizeof(uint32_t);
+      
+      if (!staged_)
+      {
+        release();
+        backend_ = backendVBO;
+        
+        // Allocate storage without touching the element array binding of any vertex array.
+        glGenBuffers(1, &vbo_);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, vbo_);
+        glBufferData(GL_COPY_WRITE_BUFFER, vsize, NULL, GL_STATIC_DRAW);
+        if (isize)
+        {
+          glGenBuffers(1, &ebo_);
+          glBindBuffer(GL_COPY_WRITE_BUFFER, ebo_);
+          glBufferData(GL_COPY_WRITE_BUFFER, isize, NULL, GL_STATIC_DRAW);
+        }
+      }
+      
+      // Vertex data is followed by index data.
+      size_t end = std::min(staged_ + bytes, vsize + isize);
+      if (staged_ < vsize)
+      {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, vbo_);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, staged_, std::min(end, vsize)-staged_, (const char*)vertices.data() + staged_);
+      }
+      if (end > vsize)
+      {
+        size_t begin = std::max(staged_, vsize);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ebo_);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, begin-vsize, end-begin, (const char*)indices.data() + begin-vsize);
+      }
+      glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+      staged_ = end;
+      
+      if (staged_ != vsize + isize)
+        return false;
+        
+      glGenVertexArrays(1, &vao_);
+      glBindVertexArray(vao_);
+      attributes();
+      glBindVertexArray(0);
+      
+      staged_ = 0;
+      uploaded_ = true;
+      generation_++;
+#endif
+      return true;
+    }
+    
+    /** \brief Exchanges contents and GPU representation with another mesh.
+     *
+     * Allows a mesh to be prepared and uploaded in the background, and
+     * replace shared geometry at once. Counts as an upload of both meshes.
+     */
+    void swap(Mesh &other)
+    {
+      std::swap(mode, other.mode);
+      std::swap(lighting, other.lighting);
+      std::swap(texture, other.texture);
+      vertices.swap(other.vertices);
+      indices.swap(other.indices);
+      std::swap(bounds, other.bounds);
+      std::swap(error, other.error);
+      std::swap(current_, other.current_);
+      std::swap(uploaded_, other.uploaded_);
+      std::swap(backend_, other.backend_);
+      std::swap(list_, other.list_);
+      std::swap(vao_, other.vao_);
+      std::swap(vbo_, other.vbo_);
+      std::swap(ebo_, other.ebo_);
+      std::swap(staged_, other.staged_);
+      generation_++;
+      other.generation_++;
+    }
+    
+    /// Returns whether the GPU representation is up to date for the current Backend.
+    bool uploaded() const
+    {
+      return uploaded_ && backend_ == Context::current().backend;
+    }
+    
+    /// Returns number of vertices drawn, taking indices into account.
+    size_t count() const
+    {
+      return indices.empty()?vertices.size():indices.size();
+    }
+    
+    /** \brief Returns number of uploads.
+     *
+     * Changes whenever the GPU representation is recreated.
+     */
+    size_t generation() const
+    {
+      return generation_;
+    }
+    
+#ifdef PGL_MODERN
+    /** \brief Sets up vertex attributes 0-2 in the currently bound vertex array.
+     *
+     * Allows other vertex arrays to source the vertex buffer of this
+     * Mesh. Also binds the index buffer, if any. Only valid for
+     * backendVBO.
+     */
+    void attributes() const
+    {
+      glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+      glEnableVertexAttribArray(2);
+      glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texcoord));
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_);
+    }
+#endif
+
+    /** \brief Draw mesh.
+     *
+     * For backendVBO, the built-in Shader must be in use, and
+     * its transforms and color must be set.
+     */
+    void draw()
+    {
+      if (!uploaded())
+        upload();
+
+      if (backend_ == backendDisplayList)
+      {
+        if (!lighting)
+          glDisable(GL_LIGHTING);
+        if (texture)
+        {
+          glEnable(GL_TEXTURE_2D);
+          texture.bind();
+        }
+        submit();
+        if (texture)
+          glDisable(GL_TEXTURE_2D);
+        if (!lighting)
+          glEnable(GL_LIGHTING);
+      }
+#ifdef PGL_MODERN
+      else
+      {
+        state();
+        bind();
+        submit();
+      }
+#endif
+    }
+    
+    /** \brief Binds vertex array. Only needed for backendVBO.
+     *
+     * The Mesh must be uploaded.
+     */
+    void bind() const
+    {
+#ifdef PGL_MODERN
+      if (backend_ == backendVBO)
+        glBindVertexArray(vao_);
+#endif
+    }
+    
+    /** \brief Draw geometry only.
+     *
+     * Assumes that the lighting and texture state, and for backendVBO
+     * the vertex array, have been set up by the caller. The Mesh must be
+     * uploaded.
+     */
+    void submit() const
+    {
+      Profiler *profiler = Context::current().profiler;
+      if (profiler)
+        profiler->draw(mode, count());
+        
+      if (backend_ == backendDisplayList)
+        glCallList(list_);
+#ifdef PGL_MODERN
+      else if (ebo_)
+        glDrawElements(mode, indices.size(), GL_UNSIGNED_INT, (void*)0);
+      else
+        glDrawArrays(mode, 0, vertices.size());
+#endif
+    }
+
+#ifdef PGL_MODERN
+    /** \brief Draw multiple instances of the mesh.
+     *
+     * Uses the given vertex array, which must source this Mesh's
+     * attributes() as well as the per-instance attributes of the
+     * built-in Shader. Only valid for backendVBO.
+     */
+    void draw(GLuint vao, GLsizei instances)
+    {
+      Profiler *profiler = Context::current().profiler;
+      if (profiler)
+        profiler->draw(mode, count(), instances);
+        
+      state();
+      glBindVertexArray(vao);
+      if (ebo_)
+        glDrawElementsInstanced(mode, indices.size(), GL_UNSIGNED_INT, (void*)0, instances);
+      else
+        glDrawArraysInstanced(mode, 0, vertices.size(), instances);
+    }
+#endif
+
+  protected:
+#ifdef PGL_MODERN
+    /// Sets up Shader state for this mesh.
+    void state() const
+    {
+      Shader &shader = Shader::builtin();
+      shader.lighting(lighting);
+      shader.textured(texture);
+      if (texture)
+        texture.bind();
+    }
+#endif
+
+    /// Deletes GPU representation.
+    void release()
+    {
+      if (list_)
+        glDeleteLists(list_, 1);
+#ifdef PGL_MODERN
+      if (vbo_)
+        glDeleteBuffers(1, &vbo_);
+      if (ebo_)
+        glDeleteBuffers(1, &ebo_);
+      if (vao_)
+        glDeleteVertexArrays(1, &vao_);
+#endif
+      list_ = vao_ = vbo_ = ebo_ = 0;
+      uploaded_ = false;
+      staged_ = 0;
+    }
+};
+
+typedef std::shared_ptr<Mesh> MeshPtr;
+
+inline size_t RenderQueue::difference(const Item &a, const Item &b)
+{
+  return (a.mesh->lighting != b.mesh->lighting) + (a.mesh->texture.id() != b.mesh->texture.id()) +
+         (a.mesh != b.mesh) + recolored(a, b);
+}
+
+inline void RenderQueue::sort()
+{
+  auto before = [](const Item &a, const Item &b)
+  {
+    if (a.mesh->lighting != b.mesh->lighting) return a.mesh->lighting > b.mesh->lighting;
+    if (a.mesh->texture.id() != b.mesh->texture.id()) return a.mesh->texture.id() < b.mesh->texture.id();
+    if (a.mesh != b.mesh) return a.mesh < b.mesh;
+    if (a.color.x != b.color.x) return a.color.x < b.color.x;
+    if (a.color.y != b.color.y) return a.color.y < b.color.y;
+    return a.color.z < b.color.z;
+  };
+  
+  // Counts state changes between consecutive items.
+  auto count = [](const std::vector<Item> &items)
+  {
+    size_t total = 0;
+    for (size_t ii=1; ii < items.size(); ++ii)
+      total += difference(items[ii-1], items[ii]);
+    return total;
+  };
+  
+  unsorted_ = count(items_);
+  std::sort(items_.begin(), items_.end(), before);
+  changes_ = count(items_);
+}
+
+inline void RenderQueue::draw(const Frustum *frustum)
+{
+  Context &context = Context::current();
+  
+#ifdef PGL_MODERN
+  Shader &shader = Shader::builtin();
+#endif
+  
+  // Changes between the items actually drawn, which depend on culling.
+  size_t changes = 0;
+  const Item *last = NULL;
+  for (size_t ii=0; ii != items_.size(); ++ii)
+  {
+    const Item &item = items_[ii];
+    Mesh &mesh = *item.mesh;
+    
+    if (frustum && item.bounds && !frustum->intersects(*item.bounds))
+      continue;
+    
+    if (!mesh.uploaded())
+      mesh.upload();
+    
+    if (last)
+      changes += difference(*last, item);
+    
+    if (context.backend == backendDisplayList)
+    {
+      if (!last || mesh.lighting != last->mesh->lighting)
+      {
+        if (mesh.lighting)
+          glEnable(GL_LIGHTING);
+        else
+          glDisable(GL_LIGHTING);
+      }
+      if (!last || mesh.texture.id() != last->mesh->texture.id())
+      {
+        if (mesh.texture)
+        {
+          glEnable(GL_TEXTURE_2D);
+          mesh.texture.bind();
+        }
+        else
+          glDisable(GL_TEXTURE_2D);
+      }
+      if (!last || recolored(*last, item))
+        glColor3d(item.color.x, item.color.y, item.color.z);
+        
+      glLoadMatrixd((context.view*(*item.world)).data);
+    }
+#ifdef PGL_MODERN
+    else
+    {
+      if (!last || mesh.lighting != last->mesh->lighting)
+        shader.lighting(mesh.lighting);
+      if (!last || mesh.texture.id() != last->mesh->texture.id())
+      {
+        shader.textured(mesh.texture);
+        if (mesh.texture)
+          mesh.texture.bind();
+      }
+      if (!last || item.mesh != last->mesh)
+        mesh.bind();
+      if (!last || recolored(*last, item))
+        shader.color(item.color);
+        
+      shader.modelview(context.view*(*item.world));
+    }
+#endif
+
+    mesh.submit();
+    last = &item;
+  }
+  
+  if (context.profiler)
+    context.profiler->stats.changes += changes;
+  
+  if (context.backend == backendDisplayList)
+  {
+    // Restore state expected by Mesh::draw().
+    glEnable(GL_LIGHTING);
+    glDisable(GL_TEXTURE_2D);
+    glLoadMatrixd(context.view.data);
+  }
+  
+  // Deferred nodes draw themselves relative to their parent.
+  RenderQueue *queue = context.queue;
+  context.queue = NULL;
+  for (size_t ii=0; ii != nodes_.size(); ++ii)
+  {
+    Node *node = nodes_[ii];
+    if (context.backend == backendDisplayList && node->parent)
+      glLoadMatrixd((context.view*node->parent->worldTransform()).data);
+    node->draw();
+  }
+  context.queue = queue;
+  
+  if (context.backend == backendDisplayList && !nodes_.empty())
+    glLoadMatrixd(context.view.data);
+}
+
+}
+
+#endif // PGL_MESH_H_
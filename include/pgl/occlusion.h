@@ -0,0 +1,233 @@
+/** \file occlusion.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains hardware occlusion culling.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_OCCLUSION_H_
+#define PGL_OCCLUSION_H_
+
+#include "mesh.h"
+
+namespace pgl {
+
+/**
+ * \brief Node that skips its subtree when it is hidden behind other geometry.
+ *
+ * Every frame, the world-space bounds of the subtree are drawn without
+ * writing color or depth, inside a GL_ANY_SAMPLES_PASSED query. The
+ * children are only drawn if the query of a previous frame found the
+ * bounds to be visible. Results are read when they are available, so
+ * the pipeline never stalls; until then, the previous result is used.
+ * For example,
+ * \code
+ * scene->attach(new pgl::Box({10, 0.2, 3}, {0, 2, 1.5}));
+ * auto hidden = scene->attach(new pgl::OcclusionNode());
+ * hidden->attach(new pgl::Model("press.stl", {0, 5, 0}));
+ * \endcode
+ *
+ * Only the occluders drawn before the node count. When sorting, the node
+ * therefore draws itself after the queue, as InstanceGroups do, and
+ * otherwise it should be attached after its occluders. Occlusion pays
+ * off for expensive subtrees, such as large Models, which are hidden
+ * most of the time.
+ *
+ * \note
+ * Requires PGL_MODERN; otherwise the children are always drawn. Since
+ * results lag by a frame, a subtree that comes into view appears one
+ * frame late. The query is shared by all views, so a node should only be
+ * drawn by a single Camera per frame.
+ */
+class OcclusionNode : public Node
+{
+  public:
+    double margin; ///< Distance to the bounds within which the camera is inside them, and the subtree always drawn. Should exceed Camera::znear.
+
+  protected:
+    GLuint query_;   ///< OpenGL query identifier.
+    bool pending_;   ///< Whether a query has been issued whose result was not yet read.
+    bool occluded_;  ///< Whether the last read result found the bounds to be hidden.
+
+  public:
+    OcclusionNode() : margin(0.2), query_(0), pending_(false), occluded_(false) { }
+
+    ~OcclusionNode()
+    {
+#ifdef PGL_MODERN
+      if (query_)
+        glDeleteQueries(1, &query_);
+#endif
+    }
+
+    /// Returns whether the subtree was skipped by the last draw() because it was hidden.
+    bool occluded() const
+    {
+      return occluded_;
+    }
+
+    /// Tests bounds for visibility, and draws children if they were visible.
+    virtual void draw()
+    {
+#ifdef PGL_MODERN
+      Context &context = Context::current();
+
+      // Bounds are only maintained by Camera::draw() when culling.
+      if (!context.bounded)
+      {
+        worldTransform();
+        update();
+      }
+#endif
+
+      refresh();
+      if (!visible())
+        return;
+
+#ifdef PGL_MODERN
+      // Occluders must be in the depth buffer, so draw after the queue.
+      if (context.queue)
+      {
+        context.queue->defer(this);
+        return;
+      }
+
+      test();
+#endif
+
+      if (!occluded_)
+        for (size_t ii=0; ii != children.size(); ++ii)
+          children[ii]->draw();
+    }
+
+    virtual bool flattenable() const
+    {
+      return false;
+    }
+
+  protected:
+#ifdef PGL_MODERN
+    /// Reads the result of the previous query if available, and issues a new one.
+    void test()
+    {
+      Context &context = Context::current();
+
+      if (bounds_.empty())
+      {
+        occluded_ = false;
+        return;
+      }
+
+      if (!query_)
+        glGenQueries(1, &query_);
+
+      if (pending_)
+      {
+        GLuint available = 0, passed = 0;
+        glGetQueryObjectuiv(query_, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+          return;
+
+        glGetQueryObjectuiv(query_, GL_QUERY_RESULT, &passed);
+        occluded_ = !passed;
+        pending_ = false;
+      }
+
+      // Faces behind the near plane are clipped, so never hide the camera's own surroundings.
+      Vector3 eye;
+      for (size_t ii=0; ii != 3; ++ii)
+        eye[ii] = -(context.view[ii*4]*context.view.x + context.view[ii*4+1]*context.view.y + context.view[ii*4+2]*context.view.z);
+
+      bool inside = true;
+      for (size_t ii=0; ii != 3; ++ii)
+        if (eye[ii] < bounds_.lower[ii] - margin || eye[ii] > bounds_.upper[ii] + margin)
+          inside = false;
+
+      if (inside)
+      {
+        occluded_ = false;
+        return;
+      }
+
+      // Unit cube scaled to the bounds, slightly enlarged so flat bounds still cover pixels.
+      Vector3 size = bounds_.size(), pad = Vector3(1, 1, 1)*(std::max(std::max(size.x, size.y), size.z)*1e-3);
+      Transform t = Translation(bounds_.lower - pad);
+      size = size + pad*2;
+      t[0] = size.x;
+      t[5] = size.y;
+      t[10] = size.z;
+
+      GLboolean culled = glIsEnabled(GL_CULL_FACE);
+      glDisable(GL_CULL_FACE);
+      glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+      glDepthMask(GL_FALSE);
+
+      glBeginQuery(GL_ANY_SAMPLES_PASSED, query_);
+      if (context.backend == backendDisplayList)
+      {
+        glPushMatrix();
+        glLoadMatrixd((context.view*t).data);
+        cube().draw();
+        glPopMatrix();
+      }
+      else
+      {
+        Shader::builtin().modelview(context.view*t);
+        cube().draw();
+      }
+      glEndQuery(GL_ANY_SAMPLES_PASSED);
+      pending_ = true;
+
+      glDepthMask(GL_TRUE);
+      glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+      if (culled)
+        glEnable(GL_CULL_FACE);
+    }
+
+    /// Returns cube from (0, 0, 0) to (1, 1, 1), shared by all nodes.
+    static Mesh &cube()
+    {
+      static Mesh *mesh = NULL;
+      if (!mesh)
+      {
+        mesh = new Mesh();
+        mesh->lighting = false;
+
+        // Two triangles per face, spanned by axes ii+1 and ii+2.
+        for (size_t ii=0; ii != 3; ++ii)
+          for (size_t side=0; side != 2; ++side)
+          {
+            Vector3 o(0, 0, 0), u(0, 0, 0), v(0, 0, 0);
+            o[ii] = side;
+            u[(ii+1)%3] = 1;
+            v[(ii+2)%3] = 1;
+
+            mesh->vertex(o); mesh->vertex(o+u); mesh->vertex(o+u+v);
+            mesh->vertex(o); mesh->vertex(o+u+v); mesh->vertex(o+v);
+          }
+      }
+
+      return *mesh;
+    }
+#endif
+};
+
+}
+
+#endif // PGL_OCCLUSION_H_
@@ -23,14 +23,20 @@
 #define PGL_PGL_H_
 
 #include "math.h"
+#include "backend.h"
+#include "loader.h"
+#include "profiler.h"
+#include "image.h"
+#include "arena.h"
 
-#include <GL/gl.h>
-
+#include <algorithm>
+#include <map>
 #include <memory>
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <typeinfo>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -69,6 +75,8 @@ namespace pgl {
  *       - Capsule, a cylinder with rounded encaps.
  *       - Plane, a (possibly textured) plane.
  *       - Model, an STL model.
+ *       - DynamicMesh, streamed vertices, such as a PointCloud or LineStrip.
+ *     * InstanceGroup, many copies of a Primitive.
  *   * Scene, the root node of the scene graph.
  * * Camera, which defines the viewpoint for drawing a Scene.
  * * Controller, which adjusts the viewpoint of an associated Camera.
@@ -121,21 +129,129 @@ namespace pgl {
  * Note that it is not necessary to use the scene graph. You can draw the
  * primitives in your own code by directly calling their \link Primitive::draw()
  * draw \endlink function.
+ *
+ * By default, primitives are drawn using legacy OpenGL display lists. Defining
+ * PGL_VBO before including pgl.h selects a Backend based on vertex buffer
+ * objects and a built-in Shader instead, which works with OpenGL 3.3 core
+ * profile contexts. Defining only PGL_MODERN makes the VBO backend available,
+ * such that it can be selected at run time through Context::backend. When
+ * drawing primitives directly using the VBO backend, the Shader must be in
+ * use and its projection and light direction set, as in Camera::draw().
+ * Primitives are then drawn at their Node::worldTransform() relative to
+ * Context::view.
+ *
+ * Large scenes can enable Camera::culling to skip drawing subtrees that
+ * fall outside the view frustum, based on the bounds maintained by
+ * Node::update(). Similarly, Camera::lod lets tessellated primitives
+ * choose their number of facets based on their size on screen, and
+ * Camera::sorting draws primitives ordered by rendering state to reduce
+ * the number of state changes.
+ *
+ * Primitives only make their geometry on construction, so a scene can be
+ * built on any thread. Their meshes are uploaded when first drawn, or
+ * ahead of time by prewarm().
+ *
+ * Models and Textures can be loaded in the background by passing a Loader
+ * to their constructor. They are attached to the scene immediately, and
+ * appear once Loader::poll(), called every frame, has uploaded them.
+ * Similarly, other threads can move Objects without locking the scene
+ * graph through a TransformChannel.
+ *
+ * With OpenGL 4.3, an IndirectGroup culls many instances of several
+ * primitives on the GPU, and draws them with a single indirect call.
+ *
+ * Geometry that changes every frame, such as point clouds and
+ * trajectories, is best drawn with a DynamicMesh, which streams its
+ * vertices through a ring of buffer regions without stalling.
+ *
+ * Expensive subtrees that are often hidden behind other geometry can be
+ * placed under an OcclusionNode, which skips them based on occlusion
+ * queries of the previous frame.
+ *
+ * Subtrees of static primitives can be merged into a few large meshes
+ * with freeze(), and restored for editing with unfreeze().
+ *
+ * With PGL_MODERN, a Camera can draw into a RenderTarget instead of a
+ * window, e.g. on headless servers. Its pixels can be read back
+ * asynchronously, while the next frame is drawn.
+ *
+ * Several cameras can draw into their own Camera::viewport or
+ * RenderTarget with a single traversal of the scene through a MultiView.
+ *
+ * Textures are mipmapped, may be read from compressed KTX and DDS files,
+ * and are shared when the same file is loaded again.
+ *
+ * Scenes that are rebuilt often can allocate their nodes from an Arena,
+ * avoiding individual heap allocations.
+ *
+ * A FlatScene compiles a Scene into contiguous arrays, such that world
+ * transforms and draw lists are computed by linear sweeps instead of
+ * recursive traversal. Given a ThreadPool, it does so on several threads.
+ *
+ * A Picker finds the primitive under the cursor by casting a Camera::ray()
+ * through bounding volume hierarchies over the scene and the triangles
+ * of its meshes.
+ *
+ * Frame times, draw calls and other statistics are recorded by setting
+ * Context::profiler to a Profiler, and can be drawn with a
+ * ProfileOverlay.
+ *
+ * Instead of redrawing continuously, applications can run a RenderLoop,
+ * which only draws when the view changed, paces frames to a target frame
+ * time, and drives the damped motion of an OrbitController.
+ *
+ * \note
+ * PGL_MODERN and PGL_VBO require the OpenGL 3.3 functions to be exported by
+ * the system OpenGL library, as on Linux, and their prototypes to be
+ * declared. pgl.h therefore defines GL_GLEXT_PROTOTYPES, which only takes
+ * effect if no OpenGL header was included before; include pgl.h before
+ * GLFW (with GLFW_INCLUDE_NONE), or define GL_GLEXT_PROTOTYPES on the
+ * command line. Other platforms should include an extension loader
+ * before pgl.h, and define PGL_EXTENSION_LOADER.
  */
 
+class FlatScene;
+
 /**
  * \brief Node in the scene graph.
  *
  * Mainly a list of sub-objects to draw. Note that the sub-objects
  * are owned by the node and deleted when the node itself is
  * deleted.
+ *
+ * Nodes can be allocated from an Arena, which stores them contiguously
+ * and recycles their memory in bulk.
+ *
+ * Each node caches its world transform, which is only recomposed when
+ * its own transform or that of one of its ancestors has changed. The
+ * cache is refreshed top-down while drawing, and on demand by
+ * worldTransform().
+ *
+ * Similarly, each node keeps world-space bounds of itself and its
+ * descendants, which are recomputed by update() only along paths that
+ * changed. They allow Camera::draw() to skip entire subtrees outside the
+ * view frustum when Camera::culling is enabled.
  */
 class Node
 {
+  friend class FlatScene;
+
   public:
     std::vector<Node*> children; ///< Sub-objects.
+    Node *parent;                ///< Parent node. Set by attach(). Do not modify.
+    
+  protected:
+    Transform world_;            ///< Cached world transform.
+    Transform local_;            ///< Local transform the cached world transform derives from.
+    size_t version_;             ///< Incremented whenever the world transform changes.
+    size_t parent_version_;      ///< Version of the parent the world transform derives from.
+    size_t index_;               ///< Position in the parent's children. Only valid if parent is set.
+    Bounds bounds_;              ///< Cached world-space bounds of this node and its descendants.
+    bool bounds_dirty_;          ///< Whether the node's own geometry changed since the last update().
     
   public:
+    Node() : parent(NULL), world_({0, 0, 0}, {0, 0, 0}), local_(world_), version_(1), parent_version_(0), index_(0), bounds_dirty_(true) { }
+  
     virtual ~Node()
     {
       for (size_t ii=0; ii != children.size(); ++ii)
@@ -143,13 +259,88 @@ class Node
       children.clear();
     }
 
+    /// Allocates node from the current Arena, or the heap if there is none.
+    static void *operator new(size_t size)
+    {
+      return Arena::allocateNode(size);
+    }
+    
+    static void operator delete(void *ptr, size_t size)
+    {
+      Arena::deallocateNode(ptr, size);
+    }
+
     /// Draw children.
     virtual void draw()
     {
+      refresh();
+      if (!visible())
+        return;
+        
       for (size_t ii=0; ii != children.size(); ++ii)
         children[ii]->draw();
     }
     
+    /** \brief Returns world transform.
+     *
+     * That is, the product of the transforms of all ancestors and
+     * this node. Only changed transforms along the path to the root
+     * are recomposed.
+     */
+    const Transform &worldTransform()
+    {
+      if (parent)
+        parent->worldTransform();
+      refresh();
+      
+      return world_;
+    }
+    
+    /** \brief Returns number of changes of the cached world transform.
+     *
+     * Allows others to detect movement, e.g. after update().
+     */
+    size_t version() const
+    {
+      return version_;
+    }
+    
+    /** \brief Returns world-space bounds of this node and its descendants.
+     *
+     * As computed by the last update().
+     */
+    const Bounds &bounds() const
+    {
+      return bounds_;
+    }
+    
+    /** \brief Refresh world transforms and bounds of this subtree.
+     *
+     * Bounds are only recomputed for nodes whose own world transform or
+     * geometry, or that of one of their descendants, has changed. Assumes
+     * the parent's world transform is up to date.
+     *
+     * \returns whether the bounds may have changed.
+     */
+    bool update()
+    {
+      bool changed = refresh() || modified();
+      
+      for (size_t ii=0; ii != children.size(); ++ii)
+        if (children[ii]->update())
+          changed = true;
+          
+      if (changed)
+      {
+        bounds_ = localBounds().transformed(world_);
+        for (size_t ii=0; ii != children.size(); ++ii)
+          bounds_.extend(children[ii]->bounds_);
+        bounds_dirty_ = false;
+      }
+      
+      return changed;
+    }
+    
     /** \brief Add child to list of sub-objects.
      *
      * \returns attached child. This allows code like
@@ -158,14 +349,195 @@ class Node
      * \endcode
      *
      * \note
-     * Transfers ownership.
+     * Transfers ownership. A child that already has a parent is first
+     * detached from it, keeping its local transform.
      */
     template<class T>
     T* attach(T *child)
     {
+      if (child->parent)
+        child->parent->detach(child);
+        
+      child->index_ = children.size();
       children.push_back(child);
+      child->parent = this;
+      child->parent_version_ = 0;
+      return child;
+    }
+    
+    /** \brief Remove child from list of sub-objects.
+     *
+     * Keeps the order of the remaining children, which determines the
+     * drawing order. The child is found in constant time, but the
+     * children after it move up. The bounds of this node are recomputed
+     * by the next update().
+     *
+     * \returns detached child, or NULL if it is not a child of this node.
+     *
+     * \note
+     * Transfers ownership to the caller.
+     */
+    template<class T>
+    T* detach(T *child)
+    {
+      size_t idx;
+      if (!locate(child, idx))
+        return NULL;
+
+      children.erase(children.begin() + idx);
+      for (size_t ii=idx; ii != children.size(); ++ii)
+        children[ii]->index_ = ii;
+      unlink(child);
       return child;
     }
+    
+    /** \brief Remove child from list of sub-objects in constant time.
+     *
+     * Like detach(), but the last child takes the place of the detached
+     * one, so the order of the remaining children is not preserved.
+     * Meant for removing many children from a large node whose drawing
+     * order does not matter.
+     */
+    template<class T>
+    T* detachUnordered(T *child)
+    {
+      size_t idx;
+      if (!locate(child, idx))
+        return NULL;
+
+      children[idx] = children.back();
+      children[idx]->index_ = idx;
+      children.pop_back();
+      unlink(child);
+      return child;
+    }
+    
+    /** \brief Returns whether drawing this node only draws its children.
+     *
+     * Plus its Mesh, in case of a Primitive. Such nodes are compiled into
+     * the arrays of a FlatScene, while others draw their own subtree. Only
+     * true for Node itself, not for derived classes, unless they override
+     * it.
+     */
+    virtual bool flattenable() const
+    {
+      return typeid(*this) == typeid(Node);
+    }
+    
+  protected:
+    /// Finds position of child in children. \returns false if it is not a child of this node.
+    bool locate(const Node *child, size_t &idx) const
+    {
+      if (child->parent != this)
+        return false;
+
+      // Children may have been reordered directly, so verify the position.
+      idx = child->index_;
+      if (idx < children.size() && children[idx] == child)
+        return true;
+
+      std::vector<Node*>::const_iterator it = std::find(children.begin(), children.end(), child);
+      if (it == children.end())
+        return false;
+      idx = it - children.begin();
+      return true;
+    }
+    
+    /// Unlinks a child that was removed from children.
+    void unlink(Node *child)
+    {
+      child->parent = NULL;
+      child->parent_version_ = 0;
+      bounds_dirty_ = true;
+    }
+    
+    /// Returns local transform, or NULL if the node does not have one.
+    virtual const Transform *local() const
+    {
+      return NULL;
+    }
+    
+    /** \brief Returns bounds of the node's own geometry, in local coordinates.
+     *
+     * Derived classes that draw something must set bounds_dirty_ when
+     * these change, or override modified().
+     */
+    virtual Bounds localBounds() const
+    {
+      return Bounds();
+    }
+    
+    /// Returns whether the node's own geometry changed since the last update().
+    virtual bool modified()
+    {
+      return bounds_dirty_;
+    }
+    
+    /// Returns whether this subtree may be visible, given Context::frustum and Context::frusta.
+    bool visible() const
+    {
+      const Context &context = Context::current();
+      if (context.profiler)
+        context.profiler->stats.nodes++;
+        
+      if (!context.culling || context.frustum.intersects(bounds_))
+        return true;
+        
+      for (size_t ii=0; ii != context.frusta.size(); ++ii)
+        if (context.frusta[ii].intersects(bounds_))
+          return true;
+          
+      return false;
+    }
+  
+    /** \brief Recompose cached world transform if necessary.
+     *
+     * That is, if the local transform or the parent's world transform
+     * has changed. Assumes the parent's world transform is up to date.
+     *
+     * \returns whether the world transform changed.
+     */
+    bool refresh()
+    {
+      size_t pv = parent?parent->version_:0;
+      const Transform *t = local();
+      
+      if (pv == parent_version_ && (!t || !memcmp(local_.data, t->data, sizeof(t->data))))
+        return false;
+      
+      if (t)
+      {
+        local_ = *t;
+        world_ = parent?parent->world_*local_:local_;
+      }
+      else
+        world_ = parent?parent->world_:local_;
+      parent_version_ = pv;
+      version_++;
+      
+      return true;
+    }
+    
+    /** \brief Places node relative to the given world transform of its parent.
+     *
+     * Used by FlatScene, whose world transforms may differ from those in
+     * the scene graph. Lasts until the parent's world transform or the
+     * local transform changes.
+     */
+    void place(const Transform &parent_world)
+    {
+      const Transform *t = local();
+      Transform world = t?parent_world*(*t):parent_world;
+      
+      parent_version_ = parent?parent->version_:0;
+      if (t)
+        local_ = *t;
+      if (!memcmp(world_.data, world.data, sizeof(world.data)))
+        return;
+        
+      world_ = world;
+      version_++;
+    }
 };
 
 /**
@@ -191,10 +563,56 @@ class Object : public Node
     /// Draw children relative to this object.
     virtual void draw()
     {
-      glPushMatrix();
-      glMultMatrixd(transform.data);
-      Node::draw();
-      glPopMatrix();
+      refresh();
+      if (!visible())
+        return;
+      
+      if (Context::current().backend == backendDisplayList)
+      {
+        glPushMatrix();
+        glMultMatrixd(transform.data);
+        for (size_t ii=0; ii != children.size(); ++ii)
+          children[ii]->draw();
+        glPopMatrix();
+      }
+      else
+      {
+        for (size_t ii=0; ii != children.size(); ++ii)
+          children[ii]->draw();
+      }
+    }
+    
+    /** \brief Moves object to another parent, keeping its world transform.
+     *
+     * Moving an object into its own subtree would create a cycle, and is
+     * reported on std::cerr instead.
+     *
+     * \note
+     * Transfers ownership to the new parent.
+     */
+    void reparent(Node *node)
+    {
+      for (Node *ancestor = node; ancestor; ancestor = ancestor->parent)
+        if (ancestor == this)
+        {
+          std::cerr << "Cannot reparent node into its own subtree" << std::endl;
+          return;
+        }
+
+      Transform world = worldTransform();
+      node->attach(this);
+      transform = node->worldTransform().inverse()*world;
+    }
+    
+    virtual bool flattenable() const
+    {
+      return typeid(*this) == typeid(Object);
+    }
+    
+  protected:
+    virtual const Transform *local() const
+    {
+      return &transform;
     }
 };
 
@@ -222,6 +640,124 @@ class Scene : public Node
     }
 };
 
+class Mesh;
+
+/**
+ * \brief Draw items sorted by rendering state.
+ *
+ * Used by Camera::draw() when Camera::sorting is enabled, and by
+ * MultiView. Primitives add their Mesh, world transform and color instead
+ * of drawing, after which the items are sorted by lighting, texture, Mesh
+ * and color, and drawn with only the state changes between consecutive
+ * items. Nodes that cannot be sorted, such as InstanceGroups, defer
+ * themselves and are drawn afterwards.
+ *
+ * \note
+ * There is a single built-in Shader, so programs are not sorted.
+ */
+class RenderQueue
+{
+  public:
+    /// Mesh to draw, with its world transform, color and optional world-space bounds.
+    struct Item
+    {
+      Mesh *mesh;
+      const Transform *world;
+      Vector3 color;
+      const Bounds *bounds;
+    };
+    
+  protected:
+    std::vector<Item> items_; ///< Items to draw.
+    std::vector<Node*> nodes_; ///< Deferred nodes.
+    size_t changes_;          ///< State changes of the last sort().
+    size_t unsorted_;         ///< State changes the last sort() would have made without sorting.
+    
+  public:
+    RenderQueue() : changes_(0), unsorted_(0) { }
+    
+    /** \brief Adds item. The Mesh, transform and bounds must stay valid until clear().
+     *
+     * Items with bounds are skipped by draw() if they lie outside its frustum.
+     */
+    void add(Mesh *mesh, const Transform &world, const Vector3 &color, const Bounds *bounds=NULL)
+    {
+      items_.push_back({mesh, &world, color, bounds});
+    }
+    
+    /// Adds items, e.g. built by other threads. Their Meshes, transforms and bounds must stay valid until clear().
+    void append(const std::vector<Item> &items)
+    {
+      items_.insert(items_.end(), items.begin(), items.end());
+    }
+    
+    /// Adds node to draw after the items, with the queue disabled.
+    void defer(Node *node)
+    {
+      nodes_.push_back(node);
+    }
+    
+    /// Returns number of items to draw.
+    size_t size() const
+    {
+      return items_.size();
+    }
+    
+    /** \brief Returns number of state changes made by drawing the last sorted items.
+     *
+     * Counts all items, while draw() reports the changes between the
+     * items it actually draws to Context::profiler.
+     */
+    size_t changes() const
+    {
+      return changes_;
+    }
+    
+    /// Returns number of state changes saved by the last sort().
+    size_t saved() const
+    {
+      return unsorted_ - changes_;
+    }
+    
+    /// Sorts items by rendering state. Defined in mesh.h.
+    void sort();
+    
+    /** \brief Draws items and deferred nodes, relative to Context::view.
+     *
+     * If frustum is given, items whose bounds lie outside it are skipped.
+     * Can be called repeatedly, e.g. for several views. Defined in mesh.h.
+     */
+    void draw(const Frustum *frustum=NULL);
+    
+    /// Removes all items and deferred nodes.
+    void clear()
+    {
+      items_.clear();
+      nodes_.clear();
+    }
+    
+    /** \brief Sorts and draws items, relative to Context::view.
+     *
+     * Afterwards, the queue is empty.
+     */
+    void submit()
+    {
+      sort();
+      draw();
+      clear();
+    }
+    
+  protected:
+    /// Returns whether items differ in color.
+    static bool recolored(const Item &a, const Item &b)
+    {
+      return a.color.x != b.color.x || a.color.y != b.color.y || a.color.z != b.color.z;
+    }
+    
+    /// Returns number of lighting, texture, mesh and color changes between items. Defined in mesh.h.
+    static size_t difference(const Item &a, const Item &b);
+};
+
 /**
  * \brief Defines camera position and frustum.
  */
@@ -231,6 +767,17 @@ class Camera
     Transform transform; ///< Camera position.
     Scene *scene;        ///< Scene to draw.
     double fovy;         ///< Vertical field of view.
+    double znear, zfar;  ///< Distance of near and far clipping planes.
+    bool culling;        ///< Whether to skip nodes outside the view frustum.
+    double lod;          ///< Tolerated tessellation error in pixels, or 0 to always use FACETS.
+    bool sorting;        ///< Whether to sort primitives by rendering state before drawing them.
+    RenderQueue queue;   ///< Queue used when sorting. Holds the statistics of the last draw().
+    
+    /// Region of the framebuffer to draw into, in pixels.
+    struct Viewport
+    {
+      int x, y, width, height;
+    } viewport;          ///< Viewport to draw into, or zero width to use the current viewport.
   
   public:
     /**
@@ -239,35 +786,188 @@ class Camera
      * 
      * By default, sets field of view such that an object of size X fills the
      * vertical field at distance X.
+     *
+     * Culling is disabled by default, because derived classes that draw
+     * without a Mesh do not have bounds. When enabled, such classes must
+     * override Node::localBounds().
+     *
+     * Automatic level of detail is disabled by default. When enabled,
+     * tessellated primitives without a fixed number of facets choose their
+     * tessellation such that it deviates less than lod pixels from the
+     * true surface.
+     *
+     * Sorting is disabled by default. When enabled, primitives are drawn
+     * after traversing the scene, in the order of a RenderQueue. Other
+     * nodes are still drawn during traversal, except InstanceGroups,
+     * which are drawn after the primitives.
+     *
+     * By default, the camera draws into the current OpenGL viewport, which
+     * is queried on every draw(). Setting viewport avoids the query, and
+     * only clears that part of the window, such that several cameras can
+     * share it.
      */
-    Camera(Scene *_scene, double _fovy = 0.92) : scene(_scene), fovy(_fovy) { }
+    Camera(Scene *_scene, double _fovy = 0.92) : scene(_scene), fovy(_fovy), znear(0.1), zfar(100), culling(false), lod(0), sorting(false), viewport{0, 0, 0, 0} { }
   
     /// Draw Scene from this camera's perspective.
     void draw()
     {
-      int dims[4];
-      glGetIntegerv(GL_VIEWPORT, dims);
-      double aspect = dims[2]/(double)dims[3];
+      Viewport vp = viewport;
+      if (vp.width)
+      {
+        glViewport(vp.x, vp.y, vp.width, vp.height);
+        glScissor(vp.x, vp.y, vp.width, vp.height);
+        glEnable(GL_SCISSOR_TEST);
+      }
+      else
+      {
+        GLint dims[4];
+        glGetIntegerv(GL_VIEWPORT, dims);
+        vp = {dims[0], dims[1], dims[2], dims[3]};
+      }
+      
+      Context &context = Context::current();
+      begin(vp);
+      
+      if (culling)
+      {
+        Profiler::Timer timer(context.profiler, Profiler::phaseUpdate);
+        scene->update();
+        context.frustum = Frustum(projection(vp)*transform);
+      }
+      context.culling = context.bounded = culling;
+      context.queue = sorting?&queue:NULL;
+      
+      {
+        Profiler::Timer timer(context.profiler, Profiler::phaseTraversal);
+        scene->draw();
+      }
+      if (sorting)
+      {
+        Profiler::Timer timer(context.profiler, Profiler::phaseSubmit);
+        queue.submit();
+      }
+      
+      end();
+      if (viewport.width)
+        glDisable(GL_SCISSOR_TEST);
+    }
+    
+    /** \brief Returns world-space ray through a point on the screen.
+     *
+     * The point is given in pixels from the top-left corner of the
+     * viewport, as the cursor position reported by GLFW for a camera
+     * drawing into the whole window. The direction has unit length.
+     */
+    Ray ray(double xpos, double ypos) const
+    {
+      Viewport vp = viewport;
+      if (!vp.width)
+      {
+        GLint dims[4];
+        glGetIntegerv(GL_VIEWPORT, dims);
+        vp = {dims[0], dims[1], dims[2], dims[3]};
+      }
+      
+      // Direction in camera coordinates, looking along -Z.
+      double f = tan(fovy/2);
+      Vector3 d((2*xpos/vp.width - 1)*f*vp.width/vp.height, (1 - 2*ypos/vp.height)*f, -1);
+      
+      // Inverse rotation, as for the camera position in begin().
+      Vector3 origin, direction;
+      for (size_t ii=0; ii != 3; ++ii)
+      {
+        origin[ii] = -(transform[ii*4]*transform.x + transform[ii*4+1]*transform.y + transform[ii*4+2]*transform.z);
+        direction[ii] = transform[ii*4]*d.x + transform[ii*4+1]*d.y + transform[ii*4+2]*d.z;
+      }
+      
+      return Ray(origin, direction/direction.norm());
+    }
+    
+  protected:
+    /// Returns projection matrix for a viewport.
+    Transform projection(const Viewport &vp) const
+    {
+      double aspect = vp.width/(double)vp.height;
       
       double f = 1/tan(fovy/2);
-      double near = 0.1, far = 100;
       
       double matrix[] = {f/aspect, 0., 0., 0.,
                          0., f, 0., 0.,
-                         0., 0., (far+near)/(near-far), -1.,
-                         0., 0., 2*far*near/(near-far), 0.};
+                         0., 0., (zfar+znear)/(znear-zfar), -1.,
+                         0., 0., 2*zfar*znear/(znear-zfar), 0.};
+                         
+      return Transform(matrix);
+    }
+    
+    /** \brief Sets up projection, view and lighting for drawing into a viewport.
+     *
+     * Also sets the level of detail parameters. Used by draw() and MultiView.
+     */
+    void begin(const Viewport &vp) const
+    {
+      Transform matrix = projection(vp);
+      Context &context = Context::current();
       
-      glMatrixMode(GL_PROJECTION);
-      glLoadMatrixd(matrix);
+      context.lod = lod;
+      if (lod > 0)
+      {
+        // Camera position is the inverse rotation applied to the negated translation.
+        for (size_t ii=0; ii != 3; ++ii)
+          context.eye[ii] = -(transform[ii*4]*transform.x + transform[ii*4+1]*transform.y + transform[ii*4+2]*transform.z);
+        context.focal = vp.height*matrix[5]/2;
+      }
       
-      GLfloat pos[] = {0, 0, 1, 0};
-      glLightfv(GL_LIGHT0, GL_POSITION, pos);
+      context.view = transform;
       
-      glMatrixMode(GL_MODELVIEW);
-      glLoadMatrixd(transform.data);
+      if (context.backend == backendDisplayList)
+      {
+        glMatrixMode(GL_PROJECTION);
+        glLoadMatrixd(matrix.data);
+        
+        glMatrixMode(GL_MODELVIEW);
+        glLoadMatrixd(transform.data);
+        
+        // Light along world Z axis. The position is transformed by the modelview matrix.
+        GLfloat pos[] = {0, 0, 1, 0};
+        glLightfv(GL_LIGHT0, GL_POSITION, pos);
+      }
+#ifdef PGL_MODERN
+      else
+      {
+        context.projection = matrix;
+        
+        // Light along world Z axis, as in the display list backend.
+        context.light = Vector3(transform[8], transform[9], transform[10]);
+        context.light = context.light/context.light.norm();
       
-      scene->draw();
+        Shader &shader = Shader::builtin();
+        shader.use();
+        shader.projection(context.projection);
+        shader.light(context.light);
+      }
+#endif
+    }
+    
+    /// Resets state set up by begin() and draw().
+    static void end()
+    {
+#ifdef PGL_MODERN
+      if (Context::current().backend != backendDisplayList)
+      {
+        glBindVertexArray(0);
+        glUseProgram(0);
+      }
+#endif
+
+      Context &context = Context::current();
+      context.culling = context.bounded = false;
+      context.frusta.clear();
+      context.lod = 0;
+      context.queue = NULL;
     }
+    
+    friend class MultiView;
+    friend class FlatScene;
 };
 
 /**
@@ -292,6 +992,19 @@ class Controller
     
     /// Mouse motion handler.
     virtual void motion(double xpos, double ypos) = 0;
+    
+    /** \brief Advances time-based camera motion by dt seconds.
+     *
+     * Called every frame by a RenderLoop. Controllers that move the
+     * camera directly from their handlers need not override it.
+     */
+    virtual void update(double /*dt*/) { }
+    
+    /// Returns whether time-based camera motion has come to rest.
+    virtual bool settled() const
+    {
+      return true;
+    }
 };
 
 /**
@@ -299,12 +1012,28 @@ class Controller
  *
  * Loads data into an OpenGL texture. This is a lightweight class that can be
  * copied at will.
+ *
+ * Interpolated textures are mipmapped. Files can be binary PPM images, or
+ * KTX and DDS files containing mipmaps, which may be compressed in a format
+ * supported by the OpenGL implementation (e.g. BC1, BC7 or ETC2). Uploading
+ * compressed files requires PGL_MODERN. Uncompressed images can be
+ * compressed by the driver by setting compression().
+ *
+ * Textures loaded from the same file are cached, such that loading a file
+ * again shares the existing OpenGL texture for as long as it is in use.
  */
 class Texture
 {
   protected:
     typedef std::shared_ptr<GLuint> GLuintPtr;
 
+    /// Cached texture.
+    struct Entry
+    {
+      std::weak_ptr<GLuint> texture;
+      int width, height;
+    };
+
   public:
     int width = 0,          ///< Texture width. Do not modify.
         height = 0;         ///< Texture height. Do not modify.
@@ -321,48 +1050,65 @@ class Texture
       make(width, height, data, interpolate);
     }
     
-    /// Loads texture from Portable Pixmap (PPM) file.
+    /// Loads texture from PPM, KTX or DDS file, or from the cache.
     Texture(const std::string &file, bool interpolate=true)
     {
-      std::ifstream ifs(file, std::ios::binary);
-      std::string magic;
-      
-      ifs >> magic;
-      if (magic != "P6")
-      {
-        std::cerr << file << " is not a valid binary PPM" << std::endl;
-        return;
-      }
-      
-      int _width = readint(ifs);
-      int _height = readint(ifs);
-      int maxval  = readint(ifs);
-      
-      if (maxval != 255)
-      {
-        std::cerr << file << ": pixel format not supported" << std::endl;
+      if (cached(file, interpolate))
         return;
-      }
       
-      unsigned char *data = new unsigned char[_width*_height*3];
-
-      ifs.read((char*)data, _width*_height*3);
-      if (!ifs.good())
-      {
-        std::cerr << file << " is truncated" << std::endl;
+      Image image;
+      if (image.read(file) != statusOK)
         return;
-      }
       
-      make(_width, _height, data, interpolate);
+      if (interpolate)
+        image.mipmap();
       
-      delete[] data;
+      if (make(image, interpolate) == statusOK)
+        cache()[key(file, interpolate)] = {texture_, width, height};
     }
     
-    ~Texture()
+    /** \brief Loads texture from PPM, KTX or DDS file asynchronously.
+     *
+     * The texture is white until the Loader uploads the image. Mipmaps
+     * are generated by the worker thread. If the file is already cached,
+     * the cached texture is used immediately.
+     *
+     * \note
+     * width and height remain 1, unless the texture was cached.
+     */
+    Texture(Loader &loader, const std::string &file, bool interpolate=true)
     {
-      // Delete OpenGL texture when last reference goes out of scope.
-      if (texture_.use_count() == 1)
-        glDeleteTextures(1, texture_.get());
+      if (cached(file, interpolate))
+        return;
+      
+      unsigned char white[] = {255, 255, 255};
+      make(1, 1, white, interpolate);
+      
+      // Later loads share the placeholder, and are updated with it.
+      std::string k = key(file, interpolate);
+      cache()[k] = {texture_, 1, 1};
+      
+      std::shared_ptr<Image> image(new Image());
+      
+      // Do not keep the texture alive if all copies are destroyed before uploading.
+      std::weak_ptr<GLuint> texture = texture_;
+      
+      loader.enqueue([file, image, interpolate]()
+      {
+        if (image->read(file) == statusOK && interpolate)
+          image->mipmap();
+      }, [texture, image, interpolate, k]()
+      {
+        GLuintPtr t = texture.lock();
+        if (t && !image->levels.empty() && upload(*t, *image, interpolate) == statusOK)
+        {
+          // Do not overwrite a newer texture loaded from the same file.
+          Entry &entry = cache()[k];
+          if (entry.texture.lock() == t)
+            entry = {t, image->width(), image->height()};
+        }
+        return true;
+      });
     }
     
     /// Returns whether texture is valid.
@@ -371,55 +1117,149 @@ class Texture
       return texture_ != 0;
     }
     
+    /// Returns OpenGL texture identifier, or 0 if the texture is not valid.
+    GLuint id() const
+    {
+      return texture_?*texture_:0;
+    }
+    
     /// Use this texture as the current OpenGL 2D texture.
     void bind() const
     {
       glBindTexture(GL_TEXTURE_2D, *texture_);
     }
     
+    /** \brief Internal format used for uncompressed images, or 0 to keep them uncompressed.
+     *
+     * For example, GL_COMPRESSED_RGB lets the driver choose a compressed
+     * format, while GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGB8_ETC2
+     * or GL_COMPRESSED_RGBA_BPTC_UNORM select one. Applies to textures
+     * loaded afterwards, and should be set before loading the first
+     * texture, since cached textures keep their format.
+     */
+    static GLenum &compression()
+    {
+      static GLenum format = 0;
+      return format;
+    }
+    
   protected:
     void make(int _width, int _height, unsigned char *data, bool interpolate)
     {
-      width = _width;
-      height = _height;
-      texture_ = GLuintPtr(new GLuint);
+      Image image(_width, _height, data);
+      if (interpolate)
+        image.mipmap();
+      
+      make(image, interpolate);
+    }
     
-      glGenTextures(1, texture_.get());
-      glBindTexture(GL_TEXTURE_2D, *texture_);
-      glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, interpolate?GL_LINEAR:GL_NEAREST);
+    /// Creates texture from image. Errors are reported on std::cerr.
+    Status make(const Image &image, bool interpolate)
+    {
+      // Delete OpenGL texture when the last reference goes out of scope,
+      // which may be a pending upload holding it if all copies are gone.
+      GLuintPtr texture(new GLuint, release);
+      glGenTextures(1, texture.get());
+      
+      Status status = upload(*texture, image, interpolate);
+      if (status != statusOK)
+        return status;
+      
+      width = image.width();
+      height = image.height();
+      texture_ = texture;
+      
+      return statusOK;
+    }
+    
+    /// Deletes OpenGL texture.
+    static void release(GLuint *texture)
+    {
+      glDeleteTextures(1, texture);
+      delete texture;
+    }
+    
+    /// Uploads all levels of image to texture. Errors are reported on std::cerr.
+    static Status upload(GLuint texture, const Image &image, bool interpolate)
+    {
+#ifndef PGL_MODERN
+      if (image.compressed)
+      {
+        std::cerr << "Compressed textures require PGL_MODERN" << std::endl;
+        return statusInvalid;
+      }
+#endif
+      
+      // Only interpolated textures sample from mipmaps.
+      size_t levels = interpolate?image.levels.size():1;
+    
+      glBindTexture(GL_TEXTURE_2D, texture);
+      if (Context::current().backend == backendDisplayList)
+        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, interpolate?(levels > 1?GL_LINEAR_MIPMAP_LINEAR:GL_LINEAR):GL_NEAREST);
       glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, interpolate?GL_LINEAR:GL_NEAREST);
       glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
       glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, (void*)data);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels-1);
+      
+      GLint alignment;
+      glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      
+      GLenum internal = compression()?compression():image.format;
+      for (size_t ii=0; ii != levels; ++ii)
+      {
+        const Image::Level &level = image.levels[ii];
+#ifdef PGL_MODERN
+        if (image.compressed)
+          glCompressedTexImage2D(GL_TEXTURE_2D, ii, image.compressed, level.width, level.height, 0, level.size, level.data);
+        else
+#endif
+          glTexImage2D(GL_TEXTURE_2D, ii, internal, level.width, level.height, 0, image.format, GL_UNSIGNED_BYTE, (const void*)level.data);
+      }
+      
+      glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+      
+      if (glGetError() != GL_NO_ERROR)
+      {
+        std::cerr << "Texture format not supported" << std::endl;
+        return statusInvalid;
+      }
+      
+      return statusOK;
     }
     
-    void eatcomments(std::ifstream &ifs)
+    /// Uses cached texture for file, if it is still in use.
+    bool cached(const std::string &file, bool interpolate)
     {
-      unsigned char c;
-      do
+      std::map<std::string, Entry>::iterator it = cache().find(key(file, interpolate));
+      if (it == cache().end())
+        return false;
+      
+      texture_ = it->second.texture.lock();
+      if (!texture_)
       {
-        c = ifs.get();
-        if (c == '#')
-        {
-          char buffer[256];
-          ifs.getline(buffer, 256);
-        }
-      } while (isspace(c) || c == '#');
-
-      ifs.putback(c);
+        cache().erase(it);
+        return false;
+      }
+      
+      width = it->second.width;
+      height = it->second.height;
+      
+      return true;
     }
     
-    /// Read integer value from PPM file, ignoring comments and whitespace.
-    int readint(std::ifstream &ifs)
+    /// Returns cache key for file.
+    static std::string key(const std::string &file, bool interpolate)
     {
-      int val;
-      
-      eatcomments(ifs);
-      ifs >> val;
-      eatcomments(ifs);
-      
-      return val;
+      return file + (interpolate?":linear":":nearest");
+    }
+    
+    /// Returns cache of textures loaded from files. Must only be used from the OpenGL thread.
+    static std::map<std::string, Entry> &cache()
+    {
+      static std::map<std::string, Entry> textures;
+      return textures;
     }
 };
 
@@ -441,7 +1281,22 @@ class Checkerboard4x4 : public Texture
 
 }
 
+// The other headers include pgl.h before their include guard, so
+// whichever is included first, these follow all of the above in order.
+#include "mesh.h"
 #include "primitive.h"
+#include "instance.h"
+#include "indirect.h"
+#include "occlusion.h"
+#include "dynamic.h"
+#include "channel.h"
+#include "freeze.h"
+#include "target.h"
+#include "view.h"
+#include "flat.h"
+#include "pick.h"
+#include "profile.h"
 #include "controller.h"
+#include "loop.h"
 
 #endif // PGL_PGL_H_
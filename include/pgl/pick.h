@@ -0,0 +1,524 @@
+/** \file pick.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains ray-cast picking using bounding volume hierarchies.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_PICK_H_
+#define PGL_PICK_H_
+
+#include "mesh.h"
+#include "primitive.h"
+#include "freeze.h"
+
+#include <stdint.h>
+
+namespace pgl {
+
+/**
+ * \brief Bounding volume hierarchy over a set of bounds.
+ *
+ * Built top-down by binned surface area heuristic, and stored depth
+ * first, such that the left child of a branch directly follows it.
+ * Bounds can be changed afterwards and refitted without rebuilding,
+ * although the tree then gradually becomes less efficient.
+ */
+class BVH
+{
+  public:
+    /// Tree node. Leaves have a nonzero count of elements, starting at first in indices.
+    struct Node
+    {
+      Bounds bounds;
+      uint32_t first;  ///< For branches, the index of the right child.
+      uint16_t count;  ///< Number of elements, or 0 for branches.
+      uint16_t axis;   ///< Split axis of branches.
+    };
+
+    std::vector<Node> nodes;       ///< Nodes, the first being the root.
+    std::vector<uint32_t> indices; ///< Element indices, in leaf order.
+
+  protected:
+    std::vector<uint32_t> parents_; ///< Parent of every node.
+    std::vector<uint32_t> leaves_;  ///< Leaf of every element.
+    std::vector<bool> dirty_;       ///< Nodes to refit.
+
+  public:
+    /// Builds tree over bounds, with at most leaf elements per leaf.
+    void build(const std::vector<Bounds> &bounds, size_t leaf=4)
+    {
+      nodes.clear();
+      parents_.clear();
+      indices.resize(bounds.size());
+      leaves_.resize(bounds.size());
+      for (size_t ii=0; ii != indices.size(); ++ii)
+        indices[ii] = ii;
+
+      std::vector<Vector3> centers(bounds.size());
+      for (size_t ii=0; ii != bounds.size(); ++ii)
+        centers[ii] = bounds[ii].center();
+
+      if (!bounds.empty())
+        split(bounds, centers, 0, bounds.size(), 0, std::max(std::min(leaf, (size_t)0xFFFF), (size_t)1));
+      dirty_.assign(nodes.size(), false);
+    }
+
+    /// Refits tree after the bounds of elements changed.
+    void refit(const std::vector<Bounds> &bounds, const std::vector<uint32_t> &changed)
+    {
+      // Mark paths to the root, and update marked nodes bottom-up.
+      for (size_t ii=0; ii != changed.size(); ++ii)
+        for (uint32_t node = leaves_[changed[ii]]; !dirty_[node]; node = parents_[node])
+        {
+          dirty_[node] = true;
+          if (!node)
+            break;
+        }
+
+      for (size_t ii=nodes.size(); ii--;)
+        if (dirty_[ii])
+        {
+          Node &n = nodes[ii];
+          n.bounds = Bounds();
+          if (n.count)
+            for (size_t jj=n.first; jj != n.first+n.count; ++jj)
+              n.bounds.extend(bounds[indices[jj]]);
+          else
+          {
+            n.bounds.extend(nodes[ii+1].bounds);
+            n.bounds.extend(nodes[n.first].bounds);
+          }
+          dirty_[ii] = false;
+        }
+    }
+
+    /** \brief Visits the elements of leaves hit by ray, nearest first.
+     *
+     * Calls visit(element, t) for leaves entered before t, which visit
+     * may reduce to the distance of a hit.
+     */
+    template<class Visit>
+    void intersect(const Ray &ray, double &t, Visit visit) const
+    {
+      if (nodes.empty() || ray.intersect(nodes[0].bounds) >= t)
+        return;
+
+      // Degenerate splits can make the tree arbitrarily deep.
+      std::vector<uint32_t> stack(1, 0);
+      stack.reserve(64);
+
+      while (!stack.empty())
+      {
+        const Node &n = nodes[stack.back()];
+        stack.pop_back();
+        if (n.count)
+        {
+          for (size_t ii=n.first; ii != n.first+n.count; ++ii)
+            visit(indices[ii], t);
+          continue;
+        }
+
+        uint32_t left = &n - nodes.data() + 1, right = n.first;
+        double tl = ray.intersect(nodes[left].bounds), tr = ray.intersect(nodes[right].bounds);
+
+        // Push farther child first, such that the nearer one is visited first.
+        if (tl > tr)
+        {
+          std::swap(tl, tr);
+          std::swap(left, right);
+        }
+        if (tr < t)
+          stack.push_back(right);
+        if (tl < t)
+          stack.push_back(left);
+      }
+    }
+
+  protected:
+    /// Builds subtree over indices first to last (exclusive). Returns its node.
+    uint32_t split(const std::vector<Bounds> &bounds, const std::vector<Vector3> &centers, size_t first, size_t last, uint32_t parent, size_t leaf)
+    {
+      static const size_t bins = 12;
+
+      uint32_t idx = nodes.size();
+      nodes.push_back(Node());
+      parents_.push_back(parent);
+
+      Bounds b, cb;
+      for (size_t ii=first; ii != last; ++ii)
+      {
+        b.extend(bounds[indices[ii]]);
+        cb.extend(centers[indices[ii]]);
+      }
+      nodes[idx].bounds = b;
+
+      Vector3 extent = cb.size();
+      size_t axis = extent.x > extent.y?(extent.x > extent.z?0:2):(extent.y > extent.z?1:2);
+      size_t n = last-first;
+
+      if (n <= leaf || !(extent[axis] > 0))
+      {
+        // Leave large sets of coincident elements in a single leaf, up to the limit of the count.
+        if (n <= 0xFFFF)
+        {
+          nodes[idx].first = first;
+          nodes[idx].count = n;
+          for (size_t ii=first; ii != last; ++ii)
+            leaves_[indices[ii]] = idx;
+          return idx;
+        }
+      }
+
+      size_t mid = first;
+      if (extent[axis] > 0)
+      {
+        // Binned surface area heuristic.
+        size_t counts[bins] = {};
+        Bounds boxes[bins];
+        double scale = bins/extent[axis], low = cb.lower[axis];
+        auto bin = [&](uint32_t element)
+        {
+          return std::min((size_t)((centers[element][axis]-low)*scale), bins-1);
+        };
+
+        for (size_t ii=first; ii != last; ++ii)
+        {
+          size_t jj = bin(indices[ii]);
+          counts[jj]++;
+          boxes[jj].extend(bounds[indices[ii]]);
+        }
+
+        auto area = [](const Bounds &box)
+        {
+          if (box.empty())
+            return 0.;
+          Vector3 s = box.size();
+          return s.x*s.y + s.y*s.z + s.z*s.x;
+        };
+
+        double right[bins];
+        Bounds acc;
+        size_t count = 0;
+        for (size_t ii=bins-1; ii != 0; --ii)
+        {
+          acc.extend(boxes[ii]);
+          count += counts[ii];
+          right[ii] = area(acc)*count;
+        }
+
+        double best = INFINITY;
+        size_t split = 0;
+        acc = Bounds();
+        count = 0;
+        for (size_t ii=0; ii != bins-1; ++ii)
+        {
+          acc.extend(boxes[ii]);
+          count += counts[ii];
+          double cost = area(acc)*count + right[ii+1];
+          if (count && count != n && cost < best)
+          {
+            best = cost;
+            split = ii+1;
+          }
+        }
+
+        if (split)
+          mid = std::partition(indices.begin()+first, indices.begin()+last, [&](uint32_t element){ return bin(element) < split; }) - indices.begin();
+      }
+
+      if (mid == first || mid == last)
+      {
+        // Degenerate distribution; split at the median.
+        mid = first + n/2;
+        std::nth_element(indices.begin()+first, indices.begin()+mid, indices.begin()+last,
+                         [&](uint32_t a, uint32_t b){ return centers[a][axis] < centers[b][axis]; });
+      }
+
+      split(bounds, centers, first, mid, idx, leaf);
+      uint32_t right = split(bounds, centers, mid, last, idx, leaf);
+      nodes[idx].first = right;
+      nodes[idx].count = 0;
+      nodes[idx].axis = axis;
+
+      return idx;
+    }
+};
+
+/// Result of a Picker query.
+struct Hit
+{
+  Node *node;      ///< Hit Primitive, or NULL if nothing was hit.
+  Vector3 point;   ///< World-space point of intersection.
+  double distance; ///< Distance along the ray, in units of its direction.
+};
+
+/**
+ * \brief Finds the primitive under the cursor.
+ *
+ * Keeps a BVH over the world-space bounds of the primitives in the
+ * scene, and one over the triangles of every Mesh. Rays are first
+ * intersected with the former, then with the triangles of the meshes
+ * they hit. For example, in a GLFW click callback,
+ * \code
+ * pgl::Picker picker(camera);
+ * ...
+ * pgl::Hit hit = picker.pick(xpos, ypos);
+ * if (hit.node)
+ *   hit.node->color = {1, 0, 0};
+ * \endcode
+ *
+ * The trees are built by build(), which must be called again after
+ * attaching or detaching nodes. Afterwards, pick() refits the scene
+ * tree to moved primitives, and rebuilds the triangle trees of meshes
+ * that were changed. Meshes shared by several primitives share their
+ * tree.
+ *
+ * \note
+ * Only triangle meshes can be hit, not lines or points. Instances drawn
+ * by an InstanceGroup or IndirectGroup cannot be hit, and neither can
+ * the merged batches of a Frozen node, but the original primitives can.
+ * Composite primitives, such as Arrows, report the part that was hit.
+ */
+class Picker
+{
+  public:
+    Camera *camera; ///< Camera to cast rays from.
+
+  protected:
+    /// Triangles of a Mesh, as a vertex and two edges each.
+    struct Triangles
+    {
+      std::weak_ptr<Mesh> mesh;
+      size_t generation;
+      std::vector<float> data;
+      BVH bvh;
+    };
+    typedef std::shared_ptr<Triangles> TrianglesPtr;
+
+    /// Pickable primitive.
+    struct Item
+    {
+      Primitive *primitive;
+      MeshPtr mesh;
+      size_t version, generation; ///< World transform version and Mesh generation the bounds derive from.
+      Transform inverse;          ///< Inverse of the world transform.
+      TrianglesPtr triangles;
+
+      Item(Primitive *_primitive) : primitive(_primitive), version(0), generation(0), inverse({0, 0, 0}, {0, 0, 0}) { }
+    };
+
+    std::vector<Item> items_;
+    std::vector<Bounds> bounds_;                    ///< World-space bounds of every item.
+    std::map<const Mesh*, TrianglesPtr> triangles_; ///< Triangle trees by Mesh.
+    BVH bvh_;
+
+  public:
+    /// Builds trees for the scene of the camera.
+    Picker(Camera *_camera) : camera(_camera)
+    {
+      build();
+    }
+
+    /// Rebuilds trees over all primitives in the scene.
+    void build()
+    {
+      items_.clear();
+      bounds_.clear();
+
+      Scene *scene = camera->scene;
+      scene->update();
+
+      std::vector<Node*> stack(1, scene);
+      while (!stack.empty())
+      {
+        Node *node = stack.back();
+        stack.pop_back();
+
+        // Merged batches duplicate their original primitives.
+        if (dynamic_cast<Frozen*>(node))
+          continue;
+
+        Primitive *primitive = dynamic_cast<Primitive*>(node);
+        if (primitive && primitive->mesh() && primitive->mesh()->mode == GL_TRIANGLES)
+        {
+          items_.push_back(Item(primitive));
+          bounds_.push_back(Bounds());
+          reset(items_.size()-1);
+        }
+
+        for (size_t ii=0; ii != node->children.size(); ++ii)
+          stack.push_back(node->children[ii]);
+      }
+
+      // Drop trees of meshes that are no longer used.
+      for (std::map<const Mesh*, TrianglesPtr>::iterator it = triangles_.begin(); it != triangles_.end();)
+        if (it->second.use_count() == 1)
+          it = triangles_.erase(it);
+        else
+          ++it;
+
+      bvh_.build(bounds_, 2);
+    }
+
+    /// Refits the scene tree if primitives moved or changed their Mesh since the last call.
+    void refit()
+    {
+      camera->scene->update();
+
+      std::vector<uint32_t> changed;
+      for (size_t ii=0; ii != items_.size(); ++ii)
+      {
+        const Item &item = items_[ii];
+        if (item.version != item.primitive->version() || item.mesh != item.primitive->mesh() ||
+            item.generation != item.mesh->generation())
+        {
+          reset(ii);
+          changed.push_back(ii);
+        }
+      }
+
+      if (!changed.empty())
+        bvh_.refit(bounds_, changed);
+    }
+
+    /** \brief Returns primitive under cursor position.
+     *
+     * Given in pixels from the top-left corner of the viewport, as for
+     * Camera::ray().
+     */
+    Hit pick(double xpos, double ypos)
+    {
+      refit();
+      return intersect(camera->ray(xpos, ypos));
+    }
+
+    /// Returns nearest primitive hit by world-space ray. Does not refit.
+    Hit intersect(const Ray &ray) const
+    {
+      Hit hit = {NULL, Vector3(0, 0, 0), INFINITY};
+
+      bvh_.intersect(ray, hit.distance, [&](uint32_t ii, double &t)
+      {
+        const Item &item = items_[ii];
+        if (intersect(*item.triangles, ray.transformed(item.inverse), t))
+          hit.node = item.primitive;
+      });
+
+      if (hit.node)
+        hit.point = ray.at(hit.distance);
+
+      return hit;
+    }
+
+  protected:
+    /// Updates world-space bounds and triangle tree of an item.
+    void reset(size_t ii)
+    {
+      Item &item = items_[ii];
+      const Transform &world = item.primitive->worldTransform();
+
+      item.mesh = item.primitive->mesh();
+      item.version = item.primitive->version();
+      item.generation = item.mesh->generation();
+      item.inverse = world.inverse();
+      bounds_[ii] = item.mesh->bounds.transformed(world);
+
+      TrianglesPtr &triangles = triangles_[item.mesh.get()];
+      if (!triangles || triangles->mesh.lock() != item.mesh || triangles->generation != item.generation)
+        triangles = make(item.mesh);
+      item.triangles = triangles;
+    }
+
+    /// Builds triangle tree of a Mesh.
+    static TrianglesPtr make(const MeshPtr &mesh)
+    {
+      TrianglesPtr triangles = std::make_shared<Triangles>();
+      triangles->mesh = mesh;
+      triangles->generation = mesh->generation();
+
+      size_t n = mesh->count()/3;
+      std::vector<Bounds> bounds(n);
+      std::vector<float> &data = triangles->data;
+      data.resize(n*9);
+
+      for (size_t ii=0; ii != n; ++ii)
+      {
+        const float *v[3];
+        for (size_t jj=0; jj != 3; ++jj)
+        {
+          size_t kk = ii*3+jj;
+          v[jj] = mesh->vertices[mesh->indices.empty()?kk:mesh->indices[kk]].position;
+          bounds[ii].extend(Vector3(v[jj][0], v[jj][1], v[jj][2]));
+        }
+
+        float *d = &data[ii*9];
+        for (size_t jj=0; jj != 3; ++jj)
+        {
+          d[jj]   = v[0][jj];
+          d[jj+3] = v[1][jj]-v[0][jj];
+          d[jj+6] = v[2][jj]-v[0][jj];
+        }
+      }
+
+      triangles->bvh.build(bounds);
+      return triangles;
+    }
+
+    /// Intersects local-space ray with triangles, reducing t to the nearest hit. \returns whether there was one.
+    static bool intersect(const Triangles &triangles, const Ray &ray, double &t)
+    {
+      bool hit = false;
+      const Vector3 &o = ray.origin, &dir = ray.direction;
+
+      triangles.bvh.intersect(ray, t, [&](uint32_t ii, double &tmax)
+      {
+        // Moller-Trumbore, accepting both sides.
+        const float *d = &triangles.data[ii*9];
+        Vector3 e1(d[3], d[4], d[5]), e2(d[6], d[7], d[8]);
+        Vector3 p = dir.cross(e2);
+        double det = e1.x*p.x + e1.y*p.y + e1.z*p.z;
+        if (fabs(det) < 1e-300)
+          return;
+
+        Vector3 s = o - Vector3(d[0], d[1], d[2]);
+        double u = (s.x*p.x + s.y*p.y + s.z*p.z)/det;
+        if (u < 0 || u > 1)
+          return;
+
+        Vector3 q = s.cross(e1);
+        double v = (dir.x*q.x + dir.y*q.y + dir.z*q.z)/det;
+        if (v < 0 || u+v > 1)
+          return;
+
+        double tt = (e2.x*q.x + e2.y*q.y + e2.z*q.z)/det;
+        if (tt >= 0 && tt < tmax)
+        {
+          tmax = tt;
+          hit = true;
+        }
+      });
+
+      return hit;
+    }
+};
+
+}
+
+#endif // PGL_PICK_H_
@@ -0,0 +1,224 @@
+/** \file pool.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the work-stealing thread pool.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PGL_POOL_H_
+#define PGL_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pgl {
+
+/**
+ * \brief Work-stealing thread pool for data-parallel loops.
+ *
+ * parallel() splits a range into chunks, which are divided evenly over
+ * the threads. Every thread works through its own chunks, and then
+ * steals chunks from the other threads, so uneven work is balanced.
+ * The calling thread takes part, and parallel() returns when all chunks
+ * are done. For example,
+ * \code
+ * pgl::ThreadPool pool;
+ * pool.parallel(n, 1024, [&](size_t first, size_t last, size_t)
+ * {
+ *   for (size_t ii=first; ii != last; ++ii)
+ *     out[ii] = f(in[ii]);
+ * });
+ * \endcode
+ *
+ * \note
+ * parallel() must not be called concurrently, or from within a task.
+ */
+class ThreadPool
+{
+  public:
+    /// Processes elements first to last (exclusive) on the given thread, numbered from 0 to size().
+    typedef std::function<void(size_t first, size_t last, size_t thread)> Task;
+
+  protected:
+    /// Chunks owned by a thread.
+    struct Queue
+    {
+      std::mutex mutex;
+      std::deque<std::pair<size_t, size_t> > chunks;
+    };
+
+    std::vector<std::thread> threads_;
+    std::vector<std::unique_ptr<Queue> > queues_; ///< Chunks per thread. The first belongs to the caller.
+    const Task *task_;                            ///< Task of the current parallel().
+    std::atomic<size_t> remaining_;               ///< Number of chunks not yet done.
+    size_t generation_;                           ///< Incremented by every parallel().
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable work_, done_;
+
+  public:
+    /** \brief Starts worker threads.
+     *
+     * threads specifies the total number of threads including the
+     * caller, or 0 for the number of cores.
+     */
+    ThreadPool(size_t threads=0) : task_(NULL), remaining_(0), generation_(0), stop_(false)
+    {
+      if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+      for (size_t ii=0; ii != threads; ++ii)
+        queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+      for (size_t ii=1; ii != threads; ++ii)
+        threads_.push_back(std::thread(&ThreadPool::worker, this, ii));
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool &operator=(const ThreadPool&) = delete;
+
+    /// Stops worker threads.
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      work_.notify_all();
+
+      for (size_t ii=0; ii != threads_.size(); ++ii)
+        threads_[ii].join();
+    }
+
+    /// Returns number of threads, including the caller.
+    size_t size() const
+    {
+      return queues_.size();
+    }
+
+    /** \brief Runs task on chunks of grain elements of the range [0, n).
+     *
+     * Small ranges are processed by the calling thread only.
+     */
+    void parallel(size_t n, size_t grain, const Task &task)
+    {
+      grain = std::max(grain, (size_t)1);
+      if (!n)
+        return;
+      if (n <= grain || size() == 1)
+      {
+        task(0, n, 0);
+        return;
+      }
+
+      size_t chunks = (n+grain-1)/grain, threads = size();
+      task_ = &task;
+      remaining_ = chunks;
+
+      // Contiguous chunks per thread, for locality.
+      for (size_t ii=0; ii != threads; ++ii)
+      {
+        std::lock_guard<std::mutex> lock(queues_[ii]->mutex);
+        for (size_t jj=ii*chunks/threads; jj != (ii+1)*chunks/threads; ++jj)
+          queues_[ii]->chunks.push_back(std::make_pair(jj*grain, std::min((jj+1)*grain, n)));
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_++;
+      }
+      work_.notify_all();
+
+      run(0);
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this]{ return !remaining_; });
+      task_ = NULL;
+    }
+
+  protected:
+    /// Worker thread.
+    void worker(size_t thread)
+    {
+      size_t generation = 0;
+
+      while (true)
+      {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          work_.wait(lock, [this, generation]{ return stop_ || generation_ != generation; });
+          if (stop_)
+            return;
+          generation = generation_;
+        }
+
+        run(thread);
+      }
+    }
+
+    /// Processes own chunks from the back, then steals from the front of other queues.
+    void run(size_t thread)
+    {
+      while (true)
+      {
+        std::pair<size_t, size_t> chunk;
+        bool found = false;
+
+        for (size_t ii=0; ii != size() && !found; ++ii)
+        {
+          Queue &queue = *queues_[(thread+ii)%size()];
+          std::lock_guard<std::mutex> lock(queue.mutex);
+          if (!queue.chunks.empty())
+          {
+            if (ii)
+            {
+              chunk = queue.chunks.front();
+              queue.chunks.pop_front();
+            }
+            else
+            {
+              chunk = queue.chunks.back();
+              queue.chunks.pop_back();
+            }
+            found = true;
+          }
+        }
+
+        if (!found)
+          return;
+
+        (*task_)(chunk.first, chunk.second, thread);
+
+        if (--remaining_ == 0)
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          done_.notify_all();
+        }
+      }
+    }
+};
+
+}
+
+#endif // PGL_POOL_H_
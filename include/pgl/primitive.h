@@ -19,22 +19,51 @@
  * limitations under the License.
  */
 
+#include "pgl.h"
+
 #ifndef PGL_PRIMITIVE_H_
 #define PGL_PRIMITIVE_H_
 
-#include "pgl.h"
+#include "mesh.h"
+#include "stl.h"
+#include "weld.h"
+#include "decimate.h"
+#include "store.h"
 
-// Must be divisible by 4
+#include <map>
+#include <mutex>
+
+// Default tessellation level. Must be divisible by 4
 #define FACETS 20
 
 namespace pgl {
 
+class Frozen;
+
 /**
  * \brief Basic 3D primitive.
  *
  * An object that actually draws something. Derived objects generally
- * create a display list upon construction that is drawn by this
- * superclass.
+ * create a Mesh upon construction that is drawn by this superclass.
+ * Primitives of the same type and with the same parameters share their
+ * Mesh through a geometry cache.
+ *
+ * Constructors only make the vertices on the CPU, so that scenes can be
+ * built on any thread. The Mesh is uploaded when it is first drawn, so
+ * primitives that are never visible cost no GPU memory. To avoid
+ * uploading many meshes in a single frame, prewarm() can upload them
+ * ahead of time, e.g. a few every frame.
+ *
+ * Tessellated primitives, like Sphere, may be given a fixed number of
+ * facets. Otherwise, they use FACETS, or choose their tessellation
+ * automatically from their size on screen if Camera::lod is set. Each
+ * level is built once and shared like any other geometry.
+ *
+ * The shape parameters of most primitives can be changed after
+ * construction, e.g. through Sphere::radius(). The geometry is then
+ * taken from the cache if another primitive has the same parameters,
+ * and made otherwise. A FlatScene must be synced afterwards, and a
+ * frozen primitive refrozen.
  *
  * \note
  * Objects will generally by aligned along the Z axis and centered
@@ -42,42 +71,305 @@ namespace pgl {
  */
 class Primitive : public Object
 {
+  friend class Frozen;
+
   public:
     Vector3 color; ///< Primitive color.
+    bool frozen;   ///< Whether the Mesh is drawn as part of a Frozen batch instead. Do not modify.
     
   protected:
-    GLuint list_;  ///< OpenGL display list identifier.
+    /// Geometry cache key: primitive type and parameters.
+    typedef std::pair<std::string, std::vector<double> > MeshKey;
+    typedef std::map<MeshKey, std::weak_ptr<Mesh> > MeshCache;
+
+    MeshPtr mesh_;      ///< Shared geometry.
+    size_t facets_;     ///< Fixed tessellation level, or 0 for automatic.
+    size_t level_;      ///< Tessellation level of the current Mesh, or 0 if not tessellated.
+    double curvature_;  ///< Radius of curvature of the tessellated surface.
+    std::map<size_t, MeshPtr> levels_; ///< Meshes of previously used tessellation levels.
+    size_t generation_; ///< Mesh generation the bounds derive from.
+    MeshKey key_;       ///< Cache key of the Mesh being made, between share() and publish().
+    Frozen *freezer_;   ///< Frozen node whose batches hold the Mesh, or NULL.
+    size_t member_;     ///< Index among the members of freezer_.
     
   public:
     /** \brief Default constructor.
      *
      * The default color is white.
      */
-    Primitive() : color(1, 1, 1)
+    Primitive() : color(1, 1, 1), frozen(false), facets_(0), level_(0), curvature_(0), generation_(0), freezer_(NULL), member_(0) { }
+    
+    /// Specifies geometry directly. It is not shared through the geometry cache.
+    Primitive(const MeshPtr &mesh) : color(1, 1, 1), frozen(false), mesh_(mesh), facets_(0), level_(0), curvature_(0), generation_(0), freezer_(NULL), member_(0) { }
+    
+    /// Leaves the Frozen node the primitive is merged into, if any. Defined in freeze.h.
+    virtual ~Primitive();
+    
+    /// Passes the color on to the parts of composite primitives, as draw() does.
+    virtual void propagate() { }
+    
+    /// Returns shared geometry. May be empty for composite primitives.
+    const MeshPtr &mesh() const
     {
-      list_ = glGenLists(1);
+      return mesh_;
     }
 
-    virtual ~Primitive()
-    {
-      glDeleteLists(list_, 1);
-    }
-  
     /// Draw primitive and its children.
     virtual void draw()
     {
-      glColor3d(color.x, color.y, color.z);
+      Context &context = Context::current();
+      
+      refresh();
+      if (!visible())
+        return;
+        
+      // Frozen primitives are drawn as part of a merged batch.
+      if (frozen && children.empty())
+        return;
+        
+      if (level_ && !facets_ && context.lod > 0 && !frozen)
+        select(detail());
+        
+      Mesh *mesh = frozen?NULL:mesh_.get();
+      bool queued = context.queue && mesh;
+      if (queued)
+        context.queue->add(mesh, world_, color, context.bounded?&bounds_:NULL);
+      
+      if (context.backend == backendDisplayList)
+      {
+        if (!queued)
+          glColor3d(color.x, color.y, color.z);
 
-      glPushMatrix();
-      glMultMatrixd(transform.data);
+        glPushMatrix();
+        glMultMatrixd(transform.data);
       
-      glCallList(list_);
-      for (size_t ii=0; ii != children.size(); ++ii)
-        children[ii]->draw();
-      glPopMatrix();
+        if (mesh && !queued)
+          mesh->draw();
+        for (size_t ii=0; ii != children.size(); ++ii)
+          children[ii]->draw();
+        glPopMatrix();
+      }
+#ifdef PGL_MODERN
+      else
+      {
+        if (mesh && !queued)
+        {
+          Shader &shader = Shader::builtin();
+          shader.modelview(context.view*world_);
+          shader.color(color);
+          mesh->draw();
+        }
+        for (size_t ii=0; ii != children.size(); ++ii)
+          children[ii]->draw();
+      }
+#endif
+    }
+    
+    /// Also true for derived classes. Those that override draw() must return false.
+    virtual bool flattenable() const
+    {
+      return true;
     }
     
   protected:
+    virtual Bounds localBounds() const
+    {
+      return mesh_?mesh_->bounds:Bounds();
+    }
+    
+    /// Also detects shared geometry that was uploaded again, e.g. by a Loader.
+    virtual bool modified()
+    {
+      if (mesh_ && mesh_->generation() != generation_)
+      {
+        generation_ = mesh_->generation();
+        bounds_dirty_ = true;
+      }
+      
+      return bounds_dirty_;
+    }
+    
+    /** \brief Sets mesh_ to tessellation with the given number of facets.
+     *
+     * Implemented by tessellated primitives, which must also set level_
+     * and curvature_.
+     */
+    virtual void tessellate(size_t) { }
+    
+    /** \brief Returns projected size of a length in local coordinates.
+     *
+     * In pixels, at the distance of the nearest point of the Mesh's
+     * bounding sphere, or INFINITY if the camera is inside it. Only
+     * valid while drawing with Context::lod set.
+     */
+    double pixels(double length) const
+    {
+      const Context &context = Context::current();
+      
+      double scale = 0;
+      for (size_t ii=0; ii != 3; ++ii)
+        scale = std::max(scale, Vector3(world_[ii*4], world_[ii*4+1], world_[ii*4+2]).norm());
+      
+      const Bounds &b = mesh_->bounds;
+      double distance = (b.transformed(world_).center()-context.eye).norm() - b.radius()*scale;
+      if (distance <= 0)
+        return INFINITY;
+        
+      return length*scale*context.focal/distance;
+    }
+    
+    /// Rebuilds the Mesh after its parameters changed, at the current tessellation level.
+    void reshape()
+    {
+      levels_.clear();
+      tessellate(level_?level_:FACETS);
+      bounds_dirty_ = true;
+    }
+    
+    /** \brief Returns tessellation level for the current size on screen.
+     *
+     * The chord error of a circle with projected radius r pixels,
+     * tessellated using n facets, is r*(1-cos(pi/n)), or approximately
+     * r*pi^2/(2*n^2). Levels are powers of two between 8 and 128.
+     */
+    virtual size_t detail() const
+    {
+      double facets = M_PI*sqrt(pixels(curvature_)/(2*Context::current().lod));
+      
+      size_t level = 8;
+      while (level < facets && level < 128)
+        level *= 2;
+      
+      return level;
+    }
+    
+    /// Switches to tessellation level, reusing previously built levels.
+    void select(size_t level)
+    {
+      if (level == level_)
+        return;
+        
+      levels_[level_] = mesh_;
+      std::map<size_t, MeshPtr>::iterator it = levels_.find(level);
+      if (it != levels_.end())
+      {
+        mesh_ = it->second;
+        level_ = level;
+      }
+      else
+        tessellate(level);
+      
+      bounds_dirty_ = true;
+    }
+    
+    /** \brief Returns the global geometry cache.
+     *
+     * \note
+     * The cache is never destroyed, such that Primitives may safely
+     * outlive static destruction.
+     */
+    static MeshCache &cache()
+    {
+      static MeshCache *cache = new MeshCache();
+      return *cache;
+    }
+    
+    /** \brief Returns the mutex guarding the geometry cache.
+     *
+     * Recursive, because releasing a Mesh while holding it may remove
+     * another entry.
+     */
+    static std::recursive_mutex &mutex()
+    {
+      static std::recursive_mutex *mutex = new std::recursive_mutex();
+      return *mutex;
+    }
+
+    /** \brief Look up shared geometry.
+     *
+     * Sets the Primitive's Mesh to the cached geometry of the given
+     * type and parameters. If there is none, an empty Mesh is created,
+     * which must be registered in the cache with publish() once it has
+     * been made.
+     *
+     * \returns true if the geometry was found, in which case the Mesh
+     * does not need to be made again.
+     */
+    bool share(const std::string &type, const std::vector<double> &params)
+    {
+      std::lock_guard<std::recursive_mutex> lock(mutex());
+      MeshKey key(type, params);
+      MeshCache &c = cache();
+      
+      MeshCache::iterator it = c.find(key);
+      if (it != c.end())
+      {
+        mesh_ = it->second.lock();
+        if (mesh_)
+          return true;
+      }
+      
+      // Remove cache entry when the last reference goes out of scope.
+      mesh_ = MeshPtr(new Mesh(), [key](Mesh *mesh)
+      {
+        std::lock_guard<std::recursive_mutex> lock(mutex());
+        MeshCache &c = cache();
+        MeshCache::iterator it = c.find(key);
+        if (it != c.end() && it->second.expired())
+          c.erase(it);
+        delete mesh;
+      });
+      key_ = key;
+      
+      return false;
+    }
+    
+    /** \brief Registers the Mesh made after share() in the geometry cache.
+     *
+     * Meshes are only shared once complete, so that other threads never
+     * see them half made.
+     *
+     * \returns false if another thread registered the same geometry in the
+     * meantime, in which case the Mesh is replaced by it.
+     */
+    bool publish()
+    {
+      std::lock_guard<std::recursive_mutex> lock(mutex());
+      MeshKey key;
+      std::swap(key, key_);
+      
+      MeshPtr &current = mesh_;
+      MeshCache &c = cache();
+      
+      MeshCache::iterator it = c.find(key);
+      if (it != c.end())
+      {
+        MeshPtr other = it->second.lock();
+        if (other)
+        {
+          current = other;
+          return false;
+        }
+      }
+      
+      c[key] = current;
+      return true;
+    }
+    
+    /// Removes shared geometry from the cache, such that it is made again when requested.
+    static void forget(const Mesh *mesh)
+    {
+      std::lock_guard<std::recursive_mutex> lock(mutex());
+      MeshCache &c = cache();
+      
+      for (MeshCache::iterator it = c.begin(); it != c.end(); ++it)
+        if (it->second.lock().get() == mesh)
+        {
+          c.erase(it);
+          return;
+        }
+    }
+  
     /** \brief Align primitive along axis.
      *
      * Align a centered z-axis aligned primitive along end-start,
@@ -102,15 +394,19 @@ class Primitive : public Object
     /// Sets norm for subsequent vertices.
     virtual void normal(const Vector3 &v)
     {
-      Vector3 n = v/v.normsq();
+      mesh_->normal(v/v.normsq());
+    }
     
-      glNormal3d(n.x, n.y, n.z);
+    /// Sets texture coordinate for subsequent vertices.
+    virtual void texcoord(double u, double v)
+    {
+      mesh_->texcoord(u, v);
     }
     
-    /// Enters vertex into display list.
+    /// Enters vertex into Mesh.
     virtual void vertex(const Vector3 &v)
     {
-      glVertex3d(v.x, v.y, v.z);
+      mesh_->vertex(v);
     }
     
     /** \brief Draws a four-sided polygon using two triangles.
@@ -151,30 +447,47 @@ class Box : public Primitive
       make({thickness, thickness, align(start, end)});
     }
     
+    /// Returns box size.
+    const Vector3 &size() const
+    {
+      return size_;
+    }
+    
+    /// Changes box size.
+    void resize(const Vector3 &size)
+    {
+      make(size);
+      bounds_dirty_ = true;
+    }
+    
   protected:
+    Vector3 size_;
+  
     void make(const Vector3 &size)
     {
+      size_ = size;
+      if (share("Box", {size.x, size.y, size.z}))
+        return;
+        
       Vector3 s2 = size/2;
       
       Vector3 vppp( s2.x,  s2.y,  s2.z), vnpp(-s2.x,  s2.y,  s2.z), vnnp(-s2.x, -s2.y,  s2.z), vpnp( s2.x, -s2.y,  s2.z),
               vppn( s2.x,  s2.y, -s2.z), vnpn(-s2.x,  s2.y, -s2.z), vnnn(-s2.x, -s2.y, -s2.z), vpnn( s2.x, -s2.y, -s2.z);
     
-      glNewList(list_, GL_COMPILE);
-      glBegin(GL_TRIANGLES);
-        glNormal3d(0, 0, 1);
-        quad(vnnp, vpnp, vppp, vnpp); // Z+
-        glNormal3d(0, 0, -1);
-        quad(vnnn, vnpn, vppn, vpnn); // Z-
-        glNormal3d(1, 0, 0);
-        quad(vpnn, vppn, vppp, vpnp); // X+
-        glNormal3d(-1, 0, 0);
-        quad(vnnn, vnnp, vnpp, vnpn); // X-
-        glNormal3d(0, 1, 0);
-        quad(vnpn, vnpp, vppp, vppn); // Y+
-        glNormal3d(0, -1, 0);
-        quad(vnnn, vpnn, vpnp, vnnp); // Y-
-      glEnd();
-      glEndList();
+      normal({0, 0, 1});
+      quad(vnnp, vpnp, vppp, vnpp); // Z+
+      normal({0, 0, -1});
+      quad(vnnn, vnpn, vppn, vpnn); // Z-
+      normal({1, 0, 0});
+      quad(vpnn, vppn, vppp, vpnp); // X+
+      normal({-1, 0, 0});
+      quad(vnnn, vnnp, vnpp, vnpn); // X-
+      normal({0, 1, 0});
+      quad(vnpn, vnpp, vppp, vppn); // Y+
+      normal({0, -1, 0});
+      quad(vnnn, vpnn, vpnp, vnnp); // Y-
+      
+      publish();
     }
 };
 
@@ -189,32 +502,49 @@ class WireBox : public Primitive
       transform = Translation(offset);
     }
     
+    /// Returns box size.
+    const Vector3 &size() const
+    {
+      return size_;
+    }
+    
+    /// Changes box size.
+    void resize(const Vector3 &size)
+    {
+      make(size);
+      bounds_dirty_ = true;
+    }
+    
   protected:
+    Vector3 size_;
+  
     void make(const Vector3 &size)
     {
+      size_ = size;
+      if (share("WireBox", {size.x, size.y, size.z}))
+        return;
+        
       Vector3 s2 = size/2;
       
       Vector3 vppp( s2.x,  s2.y,  s2.z), vnpp(-s2.x,  s2.y,  s2.z), vnnp(-s2.x, -s2.y,  s2.z), vpnp( s2.x, -s2.y,  s2.z),
               vppn( s2.x,  s2.y, -s2.z), vnpn(-s2.x,  s2.y, -s2.z), vnnn(-s2.x, -s2.y, -s2.z), vpnn( s2.x, -s2.y, -s2.z);
     
-      glNewList(list_, GL_COMPILE);
-      glDisable(GL_LIGHTING);
-      glBegin(GL_LINES);
-        vertex(vnnp); vertex(vpnp);
-        vertex(vnnn); vertex(vpnn);
-        vertex(vnnp); vertex(vnpp);
-        vertex(vnnn); vertex(vnpn);
-        vertex(vppp); vertex(vnpp);
-        vertex(vppn); vertex(vnpn);
-        vertex(vppp); vertex(vpnp);
-        vertex(vppn); vertex(vpnn);
-        vertex(vnnn); vertex(vnnp);
-        vertex(vpnn); vertex(vpnp);
-        vertex(vnpn); vertex(vnpp);
-        vertex(vppn); vertex(vppp);
-      glEnd();
-      glEnable(GL_LIGHTING);
-      glEndList();
+      mesh_->mode = GL_LINES;
+      mesh_->lighting = false;
+      vertex(vnnp); vertex(vpnp);
+      vertex(vnnn); vertex(vpnn);
+      vertex(vnnp); vertex(vnpp);
+      vertex(vnnn); vertex(vnpn);
+      vertex(vppp); vertex(vnpp);
+      vertex(vppn); vertex(vnpn);
+      vertex(vppp); vertex(vpnp);
+      vertex(vppn); vertex(vpnn);
+      vertex(vnnn); vertex(vnnp);
+      vertex(vpnn); vertex(vpnp);
+      vertex(vnpn); vertex(vnpp);
+      vertex(vppn); vertex(vppp);
+      
+      publish();
     }
 };
 
@@ -222,36 +552,57 @@ class WireBox : public Primitive
 class Sphere : public Primitive
 {
   public:
-    /// Specifies sphere radius and optional offset.
-    Sphere(double radius, const Vector3 &offset = {0, 0, 0})
+    /// Specifies sphere radius, optional offset, and optional fixed number of facets.
+    Sphere(double radius, const Vector3 &offset = {0, 0, 0}, size_t facets = 0) : radius_(radius)
     {
-      make(radius);
+      facets_ = facets;
+      tessellate(facets_?facets_:FACETS);
       transform = Translation(offset);
     }
+    
+    /// Returns sphere radius.
+    double radius() const
+    {
+      return radius_;
+    }
+    
+    /// Changes sphere radius.
+    void radius(double radius)
+    {
+      radius_ = radius;
+      reshape();
+    }
 
   protected:
-    void make(double radius)
+    double radius_;
+
+    void tessellate(size_t facets)
     {
-      glNewList(list_, GL_COMPILE);
-      glBegin(GL_TRIANGLES);
-        for (size_t jj=0; jj != FACETS/2; ++jj)
+      double radius = radius_;
+      level_ = facets;
+      curvature_ = radius;
+      
+      if (share("Sphere", {radius, (double)facets}))
+        return;
+        
+      for (size_t jj=0; jj != facets/2; ++jj)
+      {
+        double phi1 = jj*2.*M_PI/facets, phi2 = (jj+1)*2.*M_PI/facets;
+        double r1 = radius*sin(phi1), r2 = radius*sin(phi2);
+        double z1 = -radius*cos(phi1), z2 = -radius*cos(phi2);
+        
+        for (size_t ii=0; ii != facets; ++ii)
         {
-          double phi1 = jj*2.*M_PI/FACETS, phi2 = (jj+1)*2.*M_PI/FACETS;
-          double r1 = radius*sin(phi1), r2 = radius*sin(phi2);
-          double z1 = -radius*cos(phi1), z2 = -radius*cos(phi2);
-          
-          for (size_t ii=0; ii != FACETS; ++ii)
-          {
-            double theta1 = ii*2.*M_PI/FACETS, theta2 = (ii+1)*2.*M_PI/FACETS;
-                        
-            quad({r1*cos(theta1), r1*sin(theta1), z1},
-                 {r1*cos(theta2), r1*sin(theta2), z1},
-                 {r2*cos(theta2), r2*sin(theta2), z2},
-                 {r2*cos(theta1), r2*sin(theta1), z2});
-          }
+          double theta1 = ii*2.*M_PI/facets, theta2 = (ii+1)*2.*M_PI/facets;
+                      
+          quad({r1*cos(theta1), r1*sin(theta1), z1},
+               {r1*cos(theta2), r1*sin(theta2), z1},
+               {r2*cos(theta2), r2*sin(theta2), z2},
+               {r2*cos(theta1), r2*sin(theta1), z2});
         }
-      glEnd();
-      glEndList();
+      }
+      
+      publish();
     }
 
     void vertex(const Vector3 &v)
@@ -268,65 +619,110 @@ class Sphere : public Primitive
 class Cylinder : public Primitive
 {
   public:
-    /** \brief Specifies length, radius, and end radius.
+    /** \brief Specifies length, radius, end radius, and fixed number of facets.
+     *
+     * When not specified, the end radius is equal to the radius.
+     */
+    Cylinder(double length, double radius, double endradius=-1, size_t facets=0)
+    {
+      make(length, radius, endradius, facets);
+    }
+    
+    /** \brief Specifies start and end coordinates, as well as radius, end radius, and fixed number of facets.
      *
      * When not specified, the end radius is equal to the radius.
      */
-    Cylinder(double length, double radius, double endradius=-1)
+    Cylinder(const Vector3 &start, const Vector3 &end, double radius, double endradius=-1, size_t facets=0)
+    {
+      make(align(start, end), radius, endradius, facets);
+    }
+    
+    /// Returns cylinder length.
+    double length() const
     {
-      make(length, radius, endradius);
+      return length_;
     }
     
-    /** \brief Specifies start and end coordinates, as well as radius and end radius.
+    /// Returns start radius.
+    double radius() const
+    {
+      return radius_;
+    }
+    
+    /// Returns end radius.
+    double endradius() const
+    {
+      return endradius_;
+    }
+    
+    /** \brief Changes length, radius and end radius.
      *
      * When not specified, the end radius is equal to the radius.
      */
-    Cylinder(const Vector3 &start, const Vector3 &end, double radius, double endradius=-1)
+    void resize(double length, double radius, double endradius=-1)
     {
-      make(align(start, end), radius, endradius);
+      length_ = length;
+      radius_ = radius;
+      endradius_ = endradius < 0?radius:endradius;
+      reshape();
     }
     
   protected:
-    void make(double length, double radius, double endradius)
+    double length_, radius_, endradius_;
+  
+    void make(double length, double radius, double endradius, size_t facets)
     {
       if (endradius < 0)
         endradius = radius;
+        
+      length_ = length;
+      radius_ = radius;
+      endradius_ = endradius;
+      facets_ = facets;
+      tessellate(facets_?facets_:FACETS);
+    }
+    
+    void tessellate(size_t facets)
+    {
+      double length = length_, radius = radius_, endradius = endradius_;
+      level_ = facets;
+      curvature_ = std::max(radius, endradius);
+        
+      if (share("Cylinder", {length, radius, endradius, (double)facets}))
+        return;
     
-      glNewList(list_, GL_COMPILE);
-      
       // Body
-      glBegin(GL_TRIANGLES);
-        for (size_t ii=0; ii != FACETS; ++ii)
-        {
-          double theta1 = ii*2*M_PI/FACETS, theta2 = (ii+1.)*2*M_PI/FACETS;
-          
-          quad({   radius*cos(theta1),    radius*sin(theta1), -length/2},
-               {   radius*cos(theta2),    radius*sin(theta2), -length/2},
-               {endradius*cos(theta2), endradius*sin(theta2),  length/2},
-               {endradius*cos(theta1), endradius*sin(theta1),  length/2});
-        }
-      glEnd();
+      for (size_t ii=0; ii != facets; ++ii)
+      {
+        double theta1 = ii*2*M_PI/facets, theta2 = (ii+1.)*2*M_PI/facets;
+        
+        quad({   radius*cos(theta1),    radius*sin(theta1), -length/2},
+             {   radius*cos(theta2),    radius*sin(theta2), -length/2},
+             {endradius*cos(theta2), endradius*sin(theta2),  length/2},
+             {endradius*cos(theta1), endradius*sin(theta1),  length/2});
+      }
       
       // Top
-      glBegin(GL_TRIANGLE_FAN);
-        normal({0, 0, 1});
-        for (size_t ii=0; ii != FACETS; ++ii)
-        {
-          double theta = ii*2*M_PI/FACETS;
-          vertex({endradius*cos(theta), endradius*sin(theta), length/2});
-        }
-      glEnd();
+      normal({0, 0, 1});
+      for (size_t ii=1; ii != facets-1; ++ii)
+      {
+        double theta1 = ii*2*M_PI/facets, theta2 = (ii+1)*2*M_PI/facets;
+        triangle({endradius, 0, length/2},
+                 {endradius*cos(theta1), endradius*sin(theta1), length/2},
+                 {endradius*cos(theta2), endradius*sin(theta2), length/2});
+      }
       
       // Bottom
-      glBegin(GL_TRIANGLE_FAN);
-        normal({0, 0, -1});
-        for (size_t ii=0; ii != FACETS; ++ii)
-        {
-          double theta = ii*2.*M_PI/-FACETS;
-          vertex({radius*cos(theta), radius*sin(theta), -length/2});
-        }
-      glEnd();
-      glEndList();
+      normal({0, 0, -1});
+      for (size_t ii=1; ii != facets-1; ++ii)
+      {
+        double theta1 = ii*2.*M_PI/-(double)facets, theta2 = (ii+1)*2.*M_PI/-(double)facets;
+        triangle({radius, 0, -length/2},
+                 {radius*cos(theta1), radius*sin(theta1), -length/2},
+                 {radius*cos(theta2), radius*sin(theta2), -length/2});
+      }
+      
+      publish();
     }
     
     void vertex(const Vector3 &v)
@@ -340,11 +736,17 @@ class Cylinder : public Primitive
 class Cone : public Cylinder
 {
   public:
-    /// Specifies length and radius.
-    Cone(double length, double radius) : Cylinder(length, radius, 0) { }
+    /// Specifies length, radius, and optional fixed number of facets.
+    Cone(double length, double radius, size_t facets=0) : Cylinder(length, radius, 0, facets) { }
     
-    /// Specifies start and end coordinates, as well as radius.
-    Cone(const Vector3 &start, const Vector3 &end, double radius) : Cylinder(start, end, radius, 0) { }
+    /// Specifies start and end coordinates, as well as radius and optional fixed number of facets.
+    Cone(const Vector3 &start, const Vector3 &end, double radius, size_t facets=0) : Cylinder(start, end, radius, 0, facets) { }
+    
+    /// Changes length and radius.
+    void resize(double length, double radius)
+    {
+      Cylinder::resize(length, radius, 0);
+    }
 };
 
 /** \brief Arrow Primitive.
@@ -377,11 +779,20 @@ class Arrow : public Primitive
     }
     
     void draw()
+    {
+      propagate();
+      Object::draw();
+    }
+    
+    void propagate()
     {
       body_->color = color;
       head_->color = color;
-      
-      Object::draw();
+    }
+    
+    virtual bool flattenable() const
+    {
+      return false;
     }
     
   protected:
@@ -404,50 +815,84 @@ class Arrow : public Primitive
 class Capsule : public Primitive
 {
   public:
-    /// Specifies length and radius.
-    Capsule(double length, double radius)
+    /// Specifies length, radius, and optional fixed number of facets.
+    Capsule(double length, double radius, size_t facets=0)
     {
-      make(length, radius);
+      make(length, radius, facets);
     }
     
-    /// Specifies start and end coordinates, as well as radius.
-    Capsule(const Vector3 &start, const Vector3 &end, double radius)
+    /// Specifies start and end coordinates, as well as radius and optional fixed number of facets.
+    Capsule(const Vector3 &start, const Vector3 &end, double radius, size_t facets=0)
     {
-      make(align(start, end), radius);
+      make(align(start, end), radius, facets);
+    }
+    
+    /// Returns length, excluding endcaps.
+    double length() const
+    {
+      return length_;
+    }
+    
+    /// Returns radius.
+    double radius() const
+    {
+      return radius_;
+    }
+    
+    /// Changes length and radius.
+    void resize(double length, double radius)
+    {
+      length_ = length;
+      radius_ = radius;
+      reshape();
     }
     
   protected:
-    void make(double length, double radius)
+    double length_, radius_;
+  
+    void make(double length, double radius, size_t facets)
     {
-      glNewList(list_, GL_COMPILE);
-      glBegin(GL_TRIANGLES);
+      length_ = length;
+      radius_ = radius;
+      facets_ = facets;
+      tessellate(facets_?facets_:FACETS);
+    }
+    
+    void tessellate(size_t facets)
+    {
+      double length = length_, radius = radius_;
+      level_ = facets;
+      curvature_ = radius;
       
+      if (share("Capsule", {length, radius, (double)facets}))
+        return;
+        
       // Start at bottom cap
       int jadj1=0, jadj2=1;
       double zadj1 = -length/2, zadj2 = -length/2;
       
-      for (size_t jj=0; jj != FACETS/2+1; ++jj)
+      for (size_t jj=0; jj != facets/2+1; ++jj)
       {
-        if (jj == FACETS/4)
+        if (jj == facets/4)
         {
           // Move to body
           jadj2--;
           zadj2 += length;
         }
-        else if (jj == FACETS/4 + 1)
+        else if (jj == facets/4 + 1)
         {
           // Move to top cap
           jadj1--;
           zadj1 += length;
         }
         
-        double phi1 = (jj+jadj1)*2.*M_PI/FACETS, phi2 = (jj+jadj2)*2.*M_PI/FACETS;
+        double phi1 = (jj+jadj1)*2.*M_PI/facets, phi2 = (jj+jadj2)*2.*M_PI/facets;
         double r1 = radius*sin(phi1), r2 = radius*sin(phi2);
         double z1 = -radius*cos(phi1)+zadj1, z2 = -radius*cos(phi2)+zadj2;
         
-        for (size_t ii=0; ii != FACETS; ++ii)
+        for (size_t ii=0; ii != facets; ++ii)
         {
-          double theta1 = ii*2.*M_PI/FACETS, theta2 = (ii+1)*2.*M_PI/FACETS;
+          double theta1 = ii*2.*M_PI/facets, theta2 = (ii+1)*2.*M_PI/facets;
 
           quad({r1*cos(theta1), r1*sin(theta1), z1}, zadj1,
                {r1*cos(theta2), r1*sin(theta2), z1}, zadj1,
@@ -455,8 +900,8 @@ class Capsule : public Primitive
                {r2*cos(theta1), r2*sin(theta1), z2}, zadj2);
         }
       }
-      glEnd();
-      glEndList();
+      
+      publish();
     }
 
     void quad(const Vector3 &v1, double z1, const Vector3 &v2, double z2, const Vector3 &v3, double z3, const Vector3 &v4, double z4)
@@ -509,44 +954,46 @@ class Plane : public Primitive
   protected:
     void make(const Vector3 &vx, const Vector3 &vy, int repeat)
     {
+      if (share("Plane", {vx.x, vx.y, vx.z, vy.x, vy.y, vy.z, (double)repeat, (double)texture_.id()}))
+        return;
+        
       Vector3 n = vx.cross(vy);
       Vector3 v1 = -vx-vy, v2 = vx-vy, v3=vx+vy, v4=-vx+vy;
       
-      glNewList(list_, GL_COMPILE);
-      if (texture_)
-      {
-        glEnable(GL_TEXTURE_2D);
-        texture_.bind();
-        glBegin(GL_QUADS);
-          normal(n);
-          glTexCoord2d(0, 0);
-          vertex(v1*repeat);
-          glTexCoord2d(repeat, 0);
-          vertex(v2*repeat);
-          glTexCoord2d(repeat, repeat);
-          vertex(v3*repeat);
-          glTexCoord2d(0, repeat);
-          vertex(v4*repeat);
-        glEnd();
-        glDisable(GL_TEXTURE_2D);
-      }
-      else        
-      {
-        glBegin(GL_QUADS);
-          normal(n);
-          vertex(v1*repeat);
-          vertex(v2*repeat);
-          vertex(v3*repeat);
-          vertex(v4*repeat);
-        glEnd();
-      }
-      glEndList();
+      mesh_->texture = texture_;
+      normal(n);
+      
+      // Two triangles, as in quad(), with texture coordinates
+      texcoord(0, 0);
+      vertex(v1*repeat);
+      texcoord(repeat, 0);
+      vertex(v2*repeat);
+      texcoord(repeat, repeat);
+      vertex(v3*repeat);
+      vertex(v3*repeat);
+      texcoord(0, repeat);
+      vertex(v4*repeat);
+      texcoord(0, 0);
+      vertex(v1*repeat);
+      
+      publish();
     }
 };
 
 /** \brief STL model.
  *
- * Reads model from a binary STL file.
+ * Reads model from a binary or ASCII STL file, using STLLoader.
+ * Whether loading succeeded can be checked through status().
+ * Optionally, the triangles are welded into an indexed mesh with
+ * smooth normals, using a Welder. Simplified levels of detail can be
+ * created by a Decimator; when Camera::lod is set, the coarsest level
+ * whose deviation on screen is within tolerance is drawn. For example,
+ * \code
+ * scene->attach(new pgl::Model("part.stl", 0.001, pgl::Welder(), pgl::Decimator(4, 0.25)));
+ * \endcode
+ *
+ * Loaded and simplified models are stored in the MeshStore, if enabled,
+ * such that subsequent runs do not need to process them again.
  *
  * \note
  * STL files have arbitrary scale and no color information. The
@@ -557,11 +1004,7 @@ class Plane : public Primitive
 class Model : public Primitive
 {
   protected:
-    struct Triangle
-    {
-      float n[3], v1[3], v2[3], v3[3];
-      uint16_t attribute;
-    };
+    std::shared_ptr<Status> status_; ///< Result of loading the model. Shared with a Loader.
 
   public:
     /// Specifies model file name and optional scale.
@@ -577,59 +1020,304 @@ class Model : public Primitive
       transform = Translation(offset);
     }
     
+    /// Specifies model file name, scale, welding parameters, and optional simplification parameters.
+    Model(const std::string &file, double scale, const Welder &welder, const Decimator &decimator = Decimator(0))
+    {
+      make(file, scale, &welder, &decimator);
+    }
+    
+    /// Specifies model file name, offset, scale, welding parameters, and optional simplification parameters.
+    Model(const std::string &file, const Vector3 &offset, double scale, const Welder &welder, const Decimator &decimator = Decimator(0))
+    {
+      make(file, scale, &welder, &decimator);
+      transform = Translation(offset);
+    }
+    
+    /** \brief Loads model file asynchronously, with offset and optional scale.
+     *
+     * The Model draws nothing until the Loader has uploaded it.
+     */
+    Model(Loader &loader, const std::string &file, const Vector3 &offset, double scale=1)
+    {
+      make(file, scale, NULL, NULL, &loader);
+      transform = Translation(offset);
+    }
+    
+    /// Loads model file asynchronously, with offset, scale, welding parameters, and optional simplification parameters.
+    Model(Loader &loader, const std::string &file, const Vector3 &offset, double scale, const Welder &welder, const Decimator &decimator = Decimator(0))
+    {
+      make(file, scale, &welder, &decimator, &loader);
+      transform = Translation(offset);
+    }
+    
+    /** \brief Returns result of loading the model.
+     *
+     * Models sharing the geometry of a previously loaded file
+     * report statusOK, even if it is still being loaded asynchronously.
+     */
+    Status status() const
+    {
+      return *status_;
+    }
+    
   protected:
-    void make(const std::string &file, double scale)
+    void make(const std::string &file, double scale, const Welder *welder=NULL, const Decimator *decimator=NULL, Loader *loader=NULL)
     {
-      std::ifstream ifs(file, std::ios::binary);
+      std::vector<double> params = {scale};
+      if (welder)
+      {
+        std::vector<double> key = welder->key();
+        params.insert(params.end(), key.begin(), key.end());
+      }
+      size_t levels = decimator?decimator->levels:0;
+      if (levels)
+      {
+        std::vector<double> key = decimator->key();
+        params.insert(params.end(), key.begin(), key.end());
+      }
       
-      // Read header
-      uint8_t header[80];
-      uint8_t numchar[4];
+      // Level 1 is the loaded model, and each next level is simplified
+      // from the previous one. All are shared through the geometry cache.
+      std::vector<MeshPtr> meshes;
+      std::vector<MeshKey> keys;
+      std::vector<Mesh*> missing;
+      bool complete = true;
+      for (size_t ii=0; ii <= levels; ++ii)
+      {
+        std::vector<double> key = params;
+        if (ii)
+          key.push_back(ii+1);
+        
+        bool found = share("Model:" + file, key);
+        meshes.push_back(mesh_);
+        keys.push_back(key_);
+        missing.push_back(found?NULL:mesh_.get());
+        complete = complete && found;
+      }
       
-      ifs.read((char*)header, 80);
-      ifs.read((char*)numchar, 4);
+      status_ = std::make_shared<Status>(statusOK);
+      if (!complete && loader)
+      {
+        // Published at once, such that other Models share the pending load.
+        publish(keys, meshes, missing);
+        defer(*loader, file, scale, params, welder, decimator, meshes, missing);
+      }
+      else if (!complete)
+      {
+        *status_ = process(file, scale, params, welder, decimator, meshes, missing);
+        if (*status_ != statusOK && *status_ != statusTruncated)
+        {
+          // Do not share failed loads, such that they are retried.
+          mesh_ = MeshPtr(new Mesh());
+          return;
+        }
+        publish(keys, meshes, missing);
+      }
       
-      if (!ifs.good())
+      if (levels)
       {
-        std::cerr << file << " is not a valid binary STL" << std::endl;
-        return;
+        level_ = 1;
+        for (size_t ii=0; ii <= levels; ++ii)
+          levels_[ii+1] = meshes[ii];
       }
+      mesh_ = meshes[0];
+    }
+    
+    /// Publishes the missing levels, replacing any that were published by another thread in the meantime.
+    void publish(const std::vector<MeshKey> &keys, std::vector<MeshPtr> &meshes, std::vector<Mesh*> &missing)
+    {
+      for (size_t ii=0; ii != meshes.size(); ++ii)
+        if (missing[ii])
+        {
+          key_ = keys[ii];
+          mesh_ = meshes[ii];
+          if (!Primitive::publish())
+          {
+            meshes[ii] = mesh_;
+            missing[ii] = NULL;
+          }
+        }
+    }
+    
+    /** \brief Makes missing levels of detail.
+     *
+     * Reads them from the MeshStore if possible. Otherwise, loads and
+     * simplifies the model, and writes all levels to the MeshStore.
+     * Does not upload, and may be called from any thread.
+     */
+    static Status process(const std::string &file, double scale, const std::vector<double> &params, const Welder *welder, const Decimator *decimator,
+                          const std::vector<MeshPtr> &meshes, const std::vector<Mesh*> &missing)
+    {
+      uint64_t hash = 0;
+      if (!MeshStore::directory().empty())
+        hash = MeshStore::hash(file, params);
+      
+      if (hash && MeshStore::read(hash, missing) == statusOK)
+        return statusOK;
         
-      uint32_t numint = ((uint32_t)numchar[0]<<0) + ((uint32_t)numchar[1]<<8) + ((uint32_t)numchar[2]<<16) + ((uint32_t)numchar[3]<<24);
+      Status status = statusOK;
+      if (missing[0])
+      {
+        status = STLLoader::load(file, scale, *missing[0]);
+        if (status != statusOK && status != statusTruncated)
+          return status;
+          
+        if (welder)
+          welder->apply(*missing[0]);
+      }
       
-      glNewList(list_, GL_COMPILE);
-      glBegin(GL_TRIANGLES);
+      for (size_t ii=1; ii != missing.size(); ++ii)
+        if (missing[ii])
+        {
+          const Mesh &source = *meshes[ii-1];
+          double error = decimator->apply(source, source.count()/3*decimator->ratio, *missing[ii]);
+          missing[ii]->error = source.error + error;
+          (welder?*welder:Welder()).apply(*missing[ii]);
+        }
         
-      // Read triangles
-      for (size_t ii=0; ii != numint; ++ii)
+      // Do not store truncated files, which may still be being written.
+      if (hash && status == statusOK)
+      {
+        std::vector<const Mesh*> store;
+        for (size_t ii=0; ii != meshes.size(); ++ii)
+          store.push_back(meshes[ii].get());
+        MeshStore::write(hash, store);
+      }
+      
+      return status;
+    }
+    
+    /** \brief Makes missing levels of detail using a Loader.
+     *
+     * All levels are processed into private meshes on a worker thread,
+     * such that shared geometry is only touched on the context thread.
+     * They are then uploaded in chunks, coarsest level first, and swapped
+     * into the missing meshes when complete.
+     */
+    void defer(Loader &loader, const std::string &file, double scale, const std::vector<double> &params, const Welder *welder, const Decimator *decimator,
+               const std::vector<MeshPtr> &meshes, const std::vector<Mesh*> &missing)
+    {
+      struct Job
       {
-        Triangle t;
-        ifs.read((char*)&t, 50);
+        std::vector<MeshPtr> meshes, targets;
+        Status status;
+      };
+      std::shared_ptr<Job> job(new Job());
+      
+      for (size_t ii=0; ii != meshes.size(); ++ii)
+      {
+        job->meshes.push_back(MeshPtr(new Mesh()));
+        job->targets.push_back(missing[ii]?meshes[ii]:MeshPtr());
+      }
+      
+      std::shared_ptr<Welder> w(welder?new Welder(*welder):NULL);
+      std::shared_ptr<Decimator> d(decimator?new Decimator(*decimator):NULL);
+      std::shared_ptr<Status> status = status_;
+      *status = statusPending;
+      size_t chunk = loader.chunk;
+      
+      loader.enqueue([job, file, scale, params, w, d]()
+      {
+        std::vector<Mesh*> all;
+        for (size_t ii=0; ii != job->meshes.size(); ++ii)
+          all.push_back(job->meshes[ii].get());
+        job->status = process(file, scale, params, w.get(), d.get(), job->meshes, all);
+      }, [job, status, chunk]()
+      {
+        if (job->status != statusOK && job->status != statusTruncated)
+        {
+          // Do not share failed loads, such that they are retried.
+          for (size_t ii=0; ii != job->targets.size(); ++ii)
+            if (job->targets[ii])
+              forget(job->targets[ii].get());
+          *status = job->status;
+          return true;
+        }
         
-        if (!ifs.good())
+        // Skip levels that were found in the geometry cache.
+        while (!job->targets.empty() && !job->targets.back())
         {
-          std::cerr << file << " is truncated at triangle " << ii << " of " << numint << std::endl;
-          break;
+          job->targets.pop_back();
+          job->meshes.pop_back();
         }
-          
-        Vector3 n(t.n);
-        Vector3 v1(t.v1), v2(t.v2), v3(t.v3);
         
-        // Calculate normal, if not given
-        if (n.norm() == 0)
-          n = (v2-v1).cross(v3-v1);
+        if (!job->targets.empty() && job->meshes.back()->upload(chunk))
+        {
+          job->targets.back()->swap(*job->meshes.back());
+          job->targets.pop_back();
+          job->meshes.pop_back();
+        }
         
-        normal(n);
-        vertex(v1*scale);
-        vertex(v2*scale);
-        vertex(v3*scale);
-      }
+        if (!job->targets.empty())
+          return false;
+          
+        *status = job->status;
+        return true;
+      });
+    }
+    
+    /** \brief Returns coarsest level whose deviation on screen is within Context::lod.
+     *
+     * Levels that have not been loaded yet are skipped. If no level is
+     * within tolerance, returns the finest level that has been loaded.
+     */
+    virtual size_t detail() const
+    {
+      double lod = Context::current().lod;
+      size_t level = 1;
       
-      glEnd();
-      glEndList();
+      for (std::map<size_t, MeshPtr>::const_reverse_iterator it = levels_.rbegin(); it != levels_.rend(); ++it)
+        if (it->second->count())
+        {
+          level = it->first;
+          if (pixels(it->second->error) <= lod)
+            return level;
+        }
+          
+      return level;
     }
 };
 
+/** \brief Uploads the geometry of the primitives below node before they are drawn.
+ *
+ * Otherwise, every Mesh is uploaded when it is first drawn. If bytes is
+ * given, stops after uploading at least that many bytes, such that
+ * prewarming can be spread over several frames. For example,
+ * \code
+ * while (!pgl::prewarm(scene, 1 << 20))
+ *   splash->draw();
+ * \endcode
+ *
+ * \returns true when all geometry is uploaded.
+ */
+inline bool prewarm(Node *node, size_t bytes=0)
+{
+  size_t uploaded = 0;
+  std::vector<Node*> stack(1, node);
+
+  while (!stack.empty())
+  {
+    Node *n = stack.back();
+    stack.pop_back();
+
+    Primitive *primitive = dynamic_cast<Primitive*>(n);
+    Mesh *mesh = primitive?primitive->mesh().get():NULL;
+    if (mesh && mesh->count() && !mesh->uploaded())
+    {
+      if (bytes && uploaded >= bytes)
+        return false;
+
+      mesh->upload();
+      uploaded += mesh->vertices.size()*sizeof(Vertex) + mesh->indices.size()*sizeof(uint32_t);
+    }
+
+    for (size_t ii=0; ii != n->children.size(); ++ii)
+      stack.push_back(n->children[ii]);
+  }
+
+  return true;
+}
+
 }
 
 #endif // PGL_PRIMITIVE_H_
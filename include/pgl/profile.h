@@ -0,0 +1,333 @@
+/** \file profile.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains per-subtree profiling and the profile overlay.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_PROFILE_H_
+#define PGL_PROFILE_H_
+
+#include "mesh.h"
+
+namespace pgl {
+
+/**
+ * \brief Node that records the cost of its subtree.
+ *
+ * When Context::profiler is set, the CPU time, draw calls, primitives and
+ * visited nodes of drawing the children are added to
+ * Profiler::sections under the node's name. For example,
+ * \code
+ * auto robot = scene->attach(new pgl::ProfileNode("robot"));
+ * robot->attach(new pgl::Model("robot.stl"));
+ * \endcode
+ *
+ * \note
+ * When sorting, primitives are drawn after the traversal, so only the
+ * traversal is accounted to the subtree.
+ */
+class ProfileNode : public Node
+{
+  public:
+    std::string name; ///< Section name in Profiler::sections.
+
+  public:
+    ProfileNode(const std::string &_name) : name(_name) { }
+
+    /// Draw children, recording their cost.
+    virtual void draw()
+    {
+      Profiler *profiler = Context::current().profiler;
+      if (!profiler)
+      {
+        Node::draw();
+        return;
+      }
+
+      Profiler::Stats before = profiler->stats;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      Node::draw();
+
+      const Profiler::Stats &after = profiler->stats;
+      Profiler::Stats &section = profiler->sections[name];
+      section.frame = after.frame;
+      section.cpu += Profiler::seconds(start);
+      section.draws += after.draws - before.draws;
+      section.triangles += after.triangles - before.triangles;
+      section.lines += after.lines - before.lines;
+      section.nodes += after.nodes - before.nodes;
+    }
+};
+
+/**
+ * \brief On-screen graph of frame times.
+ *
+ * Draws the history of a Profiler as stacked bars, one per frame: the
+ * Camera::draw() phases update (blue), traversal (green) and submit
+ * (red), followed by the remaining CPU time (gray). GPU time is drawn as
+ * a yellow tick, and the frame budget as a white line. For example,
+ * \code
+ * pgl::ProfileOverlay overlay(&profiler);
+ *
+ * camera->draw();
+ * overlay.draw();
+ * \endcode
+ *
+ * The bars are rewritten every frame into ranges of a single vertex
+ * buffer, sized for Profiler::frames, so drawing the overlay does not
+ * create OpenGL objects. The display list backend draws them from client
+ * memory.
+ */
+class ProfileOverlay
+{
+  public:
+    Profiler *profiler; ///< Profiler whose history to draw.
+    double x, y;        ///< Lower left corner, in normalized device coordinates.
+    double width;       ///< Width, in normalized device coordinates.
+    double height;      ///< Height, in normalized device coordinates.
+    double range;       ///< Time in seconds corresponding to the full height.
+    double budget;      ///< Frame time budget in seconds, or 0 to hide it.
+
+  protected:
+    static const size_t series_ = Profiler::phases+3; ///< Bars per phase and for the remaining time, GPU ticks, and budget line.
+
+    std::vector<Vertex> vertices_; ///< Vertices of all series, each in its own range.
+    size_t capacity_;              ///< Number of frames the ranges hold.
+    size_t counts_[series_];       ///< Number of vertices in each range.
+    GLuint vao_, vbo_;             ///< OpenGL vertex array and buffer identifiers, for backendVBO.
+
+  public:
+    /// Specifies profiler, and places the overlay in the lower left corner.
+    ProfileOverlay(Profiler *_profiler) : profiler(_profiler), x(-1), y(-1), width(1), height(0.5), range(1/30.), budget(1/60.), capacity_(0), vao_(0), vbo_(0)
+    {
+      reserve(profiler->frames);
+    }
+
+    ~ProfileOverlay()
+    {
+#ifdef PGL_MODERN
+      if (vao_)
+      {
+        glDeleteBuffers(1, &vbo_);
+        glDeleteVertexArrays(1, &vao_);
+      }
+#endif
+    }
+
+    /// Draws the overlay on top of the current viewport.
+    void draw()
+    {
+      build();
+
+      static const double colors[][3] = {{0.3, 0.3, 1}, {0.3, 1, 0.3}, {1, 0.3, 0.3}, {0.6, 0.6, 0.6}, {1, 1, 0}, {1, 1, 1}};
+      Context &context = Context::current();
+
+      GLboolean depth = glIsEnabled(GL_DEPTH_TEST);
+      glDisable(GL_DEPTH_TEST);
+
+      if (context.backend == backendDisplayList)
+      {
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glLoadIdentity();
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+        glLoadIdentity();
+
+        // Drawn from client memory, so no OpenGL objects are needed.
+        glDisable(GL_LIGHTING);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(Vertex), vertices_[0].position);
+        for (size_t ii=0; ii != series_; ++ii)
+        {
+          glColor3dv(colors[ii]);
+          submit(ii);
+        }
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glEnable(GL_LIGHTING);
+
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        glPopMatrix();
+      }
+#ifdef PGL_MODERN
+      else
+      {
+        upload();
+
+        Shader &shader = Shader::builtin();
+        shader.use();
+        shader.projection(Transform({0, 0, 0}, {0, 0, 0}));
+        shader.modelview(Transform({0, 0, 0}, {0, 0, 0}));
+        shader.lighting(false);
+        shader.textured(false);
+
+        glBindVertexArray(vao_);
+        for (size_t ii=0; ii != series_; ++ii)
+        {
+          shader.color(Vector3(colors[ii][0], colors[ii][1], colors[ii][2]));
+          submit(ii);
+        }
+        glBindVertexArray(0);
+        glUseProgram(0);
+      }
+#endif
+
+      if (depth)
+        glEnable(GL_DEPTH_TEST);
+    }
+
+  protected:
+    /// Returns index of the first vertex of a series.
+    size_t offset(size_t series) const
+    {
+      // Bars take 6 vertices per frame, ticks 2, and the budget line 2 in total.
+      if (series <= Profiler::phases+1)
+        return series*capacity_*6;
+      return (Profiler::phases+1)*capacity_*6 + capacity_*2;
+    }
+
+    /// Sizes the ranges for the given number of frames. Reallocates the vertex buffer when it grows.
+    void reserve(size_t frames)
+    {
+      capacity_ = frames;
+      vertices_.resize(offset(series_-1) + 2);
+      for (size_t ii=0; ii != series_; ++ii)
+        counts_[ii] = 0;
+
+#ifdef PGL_MODERN
+      if (vao_)
+      {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+        glBufferData(GL_ARRAY_BUFFER, vertices_.size()*sizeof(Vertex), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+      }
+#endif
+    }
+
+    /// Rebuilds the vertices from the profiler history.
+    void build()
+    {
+      if (profiler->frames > capacity_)
+        reserve(profiler->frames);
+
+      for (size_t ii=0; ii != series_; ++ii)
+        counts_[ii] = 0;
+
+      const std::deque<Profiler::Stats> &history = profiler->history();
+      double w = width/profiler->frames, scale = height/range;
+
+      for (size_t ii=0; ii != history.size(); ++ii)
+      {
+        const Profiler::Stats &s = history[ii];
+        double left = x + width - (history.size()-ii)*w, bottom = y, other = s.cpu;
+
+        for (size_t jj=0; jj != Profiler::phases; ++jj)
+        {
+          bar(jj, left, w, bottom, s.phase[jj]*scale);
+          bottom += s.phase[jj]*scale;
+          other -= s.phase[jj];
+        }
+        bar(Profiler::phases, left, w, bottom, std::max(other, 0.)*scale);
+
+        if (s.gpu >= 0)
+        {
+          double top = y + std::min(s.gpu*scale, height);
+          vertex(Profiler::phases+1, left, top);
+          vertex(Profiler::phases+1, left+w, top);
+        }
+      }
+
+      if (budget > 0 && budget <= range)
+      {
+        vertex(Profiler::phases+2, x, y+budget*scale);
+        vertex(Profiler::phases+2, x+width, y+budget*scale);
+      }
+    }
+
+    /// Adds a bar of height h, clipped to the overlay.
+    void bar(size_t series, double left, double w, double bottom, double h)
+    {
+      double top = std::min(bottom+h, y+height);
+      if (top <= bottom)
+        return;
+
+      vertex(series, left, bottom);
+      vertex(series, left+w, bottom);
+      vertex(series, left+w, top);
+      vertex(series, left, bottom);
+      vertex(series, left+w, top);
+      vertex(series, left, top);
+    }
+
+    /// Adds a vertex to a series.
+    void vertex(size_t series, double vx, double vy)
+    {
+      Vertex &v = vertices_[offset(series) + counts_[series]++];
+      v.position[0] = vx;
+      v.position[1] = vy;
+      v.position[2] = 0;
+    }
+
+    /// Draws the vertices of a series from the bound vertex array or client memory.
+    void submit(size_t series) const
+    {
+      if (!counts_[series])
+        return;
+
+      GLenum mode = series > Profiler::phases?GL_LINES:GL_TRIANGLES;
+      Profiler *p = Context::current().profiler;
+      if (p)
+        p->draw(mode, counts_[series]);
+
+      glDrawArrays(mode, offset(series), counts_[series]);
+    }
+
+#ifdef PGL_MODERN
+    /// Writes the used ranges into the vertex buffer, which is allocated on first use.
+    void upload()
+    {
+      if (!vao_)
+      {
+        glGenVertexArrays(1, &vao_);
+        glBindVertexArray(vao_);
+        glGenBuffers(1, &vbo_);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+        glBufferData(GL_ARRAY_BUFFER, vertices_.size()*sizeof(Vertex), NULL, GL_DYNAMIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
+        glBindVertexArray(0);
+      }
+      else
+        glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+
+      for (size_t ii=0; ii != series_; ++ii)
+        if (counts_[ii])
+          glBufferSubData(GL_ARRAY_BUFFER, offset(ii)*sizeof(Vertex), counts_[ii]*sizeof(Vertex), &vertices_[offset(ii)]);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+#endif
+};
+
+}
+
+#endif // PGL_PROFILE_H_
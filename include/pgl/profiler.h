@@ -0,0 +1,277 @@
+/** \file profiler.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the frame profiler.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PGL_PROFILER_H_
+#define PGL_PROFILER_H_
+
+#include "backend.h"
+
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+
+namespace pgl {
+
+/**
+ * \brief Frame profiler.
+ *
+ * Records the CPU time spent in each phase of Camera::draw(), the GPU
+ * time of each frame, and the number of draw calls, primitives and state
+ * changes. Profiling is enabled by setting Context::profiler, and frames
+ * are delimited by begin() and end(). For example,
+ * \code
+ * pgl::Profiler profiler;
+ * pgl::Context::current().profiler = &profiler;
+ *
+ * while (running)
+ * {
+ *   profiler.begin();
+ *   camera->draw();
+ *   profiler.end();
+ *
+ *   std::cout << profiler.last().cpu << std::endl;
+ * }
+ * \endcode
+ *
+ * GPU time is measured with GL_TIME_ELAPSED queries, which are read back
+ * without blocking once available, usually a few frames later. It
+ * requires PGL_MODERN. The cost of subtrees can be recorded by attaching
+ * them to a ProfileNode, and the history can be drawn using a
+ * ProfileOverlay.
+ *
+ * \note
+ * The profiler must be created and used from the thread of the OpenGL
+ * context.
+ */
+class Profiler
+{
+  public:
+    /// Phases of Camera::draw().
+    enum Phase
+    {
+      phaseUpdate,    ///< Updating bounds for culling.
+      phaseTraversal, ///< Traversing the scene graph, including drawing when not sorting.
+      phaseSubmit,    ///< Sorting and drawing the RenderQueue.
+      phases
+    };
+
+    /// Statistics of a frame or subtree.
+    struct Stats
+    {
+      size_t frame;         ///< Frame number.
+      double cpu;           ///< CPU time in seconds. For frames, between begin() and end().
+      double phase[phases]; ///< CPU time in seconds per Phase.
+      double gpu;           ///< GPU time in seconds, or negative if not (yet) available.
+      size_t draws;         ///< Number of draw calls.
+      size_t triangles;     ///< Number of triangles drawn.
+      size_t lines;         ///< Number of lines drawn.
+      size_t changes;       ///< Number of state changes made by a RenderQueue.
+      size_t nodes;         ///< Number of nodes visited.
+    };
+
+    /// Measures the time until stop() or destruction. Does nothing without a profiler.
+    class Timer
+    {
+      protected:
+        Profiler *profiler_;
+        Phase phase_;
+        std::chrono::steady_clock::time_point start_;
+
+      public:
+        Timer(Profiler *profiler, Phase phase) : profiler_(profiler), phase_(phase)
+        {
+          if (profiler_)
+            start_ = std::chrono::steady_clock::now();
+        }
+
+        ~Timer()
+        {
+          stop();
+        }
+
+        /// Adds elapsed time to the phase of the current frame.
+        void stop()
+        {
+          if (profiler_)
+            profiler_->stats.phase[phase_] += seconds(start_);
+          profiler_ = NULL;
+        }
+    };
+
+    size_t frames;                         ///< Number of frames to keep in the history.
+    Stats stats;                           ///< Frame being recorded. Do not modify.
+    std::map<std::string, Stats> sections; ///< Statistics per ProfileNode, of the last frame.
+
+  protected:
+    std::deque<Stats> history_;            ///< Completed frames, oldest first.
+    std::chrono::steady_clock::time_point start_; ///< Start of the current frame.
+#ifdef PGL_MODERN
+    GLuint queries_[4];                    ///< Ring of timer queries.
+    size_t query_frames_[4];               ///< Frame measured by each query.
+    size_t first_, queued_;                ///< Oldest pending query, and number of pending queries.
+    bool timing_;                          ///< Whether the current frame is being timed on the GPU.
+#endif
+
+  public:
+    /// Specifies the number of frames to keep in the history.
+    Profiler(size_t _frames=120) : frames(_frames)
+    {
+      stats.frame = 0;
+      clear(stats);
+#ifdef PGL_MODERN
+      glGenQueries(4, queries_);
+      first_ = queued_ = 0;
+      timing_ = false;
+#endif
+    }
+
+    Profiler(const Profiler&) = delete;
+    Profiler &operator=(const Profiler&) = delete;
+
+    ~Profiler()
+    {
+#ifdef PGL_MODERN
+      glDeleteQueries(4, queries_);
+#endif
+    }
+
+    /// Starts a frame.
+    void begin()
+    {
+      clear(stats);
+      for (std::map<std::string, Stats>::iterator it=sections.begin(); it != sections.end(); ++it)
+        clear(it->second);
+
+#ifdef PGL_MODERN
+      // Skip GPU timing if all queries are still pending.
+      timing_ = queued_ != 4;
+      if (timing_)
+      {
+        size_t idx = (first_+queued_)%4;
+        query_frames_[idx] = stats.frame;
+        glBeginQuery(GL_TIME_ELAPSED, queries_[idx]);
+      }
+#endif
+
+      start_ = std::chrono::steady_clock::now();
+    }
+
+    /// Ends a frame, and adds it to the history.
+    void end()
+    {
+      stats.cpu = seconds(start_);
+
+#ifdef PGL_MODERN
+      if (timing_)
+      {
+        glEndQuery(GL_TIME_ELAPSED);
+        queued_++;
+      }
+#endif
+
+      history_.push_back(stats);
+      while (history_.size() > frames)
+        history_.pop_front();
+      stats.frame++;
+
+      poll();
+    }
+
+    /// Returns completed frames, oldest first.
+    const std::deque<Stats> &history() const
+    {
+      return history_;
+    }
+
+    /// Returns last completed frame. Its GPU time is usually not yet available.
+    const Stats &last() const
+    {
+      return history_.empty()?stats:history_.back();
+    }
+
+    /// Returns GPU time of the most recent frame for which it is available, or a negative number.
+    double gpu() const
+    {
+      for (std::deque<Stats>::const_reverse_iterator it=history_.rbegin(); it != history_.rend(); ++it)
+        if (it->gpu >= 0)
+          return it->gpu;
+
+      return -1;
+    }
+
+    /// Counts a draw call of count vertices in the given mode.
+    void draw(GLenum mode, size_t count, size_t instances=1)
+    {
+      stats.draws++;
+      if (mode == GL_TRIANGLES)
+        stats.triangles += count/3*instances;
+      else if (mode == GL_LINES)
+        stats.lines += count/2*instances;
+      else if (mode == GL_LINE_STRIP && count)
+        stats.lines += (count-1)*instances;
+    }
+
+    /// Returns seconds elapsed since start.
+    static double seconds(const std::chrono::steady_clock::time_point &start)
+    {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    }
+
+    /// Resets all statistics except the frame number.
+    static void clear(Stats &s)
+    {
+      size_t frame = s.frame;
+      memset(&s, 0, sizeof(s));
+      s.frame = frame;
+      s.gpu = -1;
+    }
+
+  protected:
+    /// Reads back available timer queries, without blocking.
+    void poll()
+    {
+#ifdef PGL_MODERN
+      while (queued_)
+      {
+        GLint available = 0;
+        glGetQueryObjectiv(queries_[first_], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+          break;
+
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(queries_[first_], GL_QUERY_RESULT, &ns);
+
+        for (size_t ii=0; ii != history_.size(); ++ii)
+          if (history_[ii].frame == query_frames_[first_])
+            history_[ii].gpu = ns*1e-9;
+
+        first_ = (first_+1)%4;
+        queued_--;
+      }
+#endif
+    }
+};
+
+}
+
+#endif // PGL_PROFILER_H_
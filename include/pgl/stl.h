@@ -0,0 +1,264 @@
+/** \file stl.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the STereoLithography (STL) model loader.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_STL_H_
+#define PGL_STL_H_
+
+#include "mesh.h"
+#include "file.h"
+
+#include <thread>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+namespace pgl {
+
+/**
+ * \brief STL model loader.
+ *
+ * Reads binary as well as ASCII STL files directly into the vertex
+ * buffer of a Mesh. Binary files are memory-mapped and, when large,
+ * parsed by multiple threads.
+ *
+ * As with Primitive::normal(), normals are divided by their squared
+ * norm. Missing normals are calculated from the vertex winding order.
+ */
+class STLLoader
+{
+  public:
+    /** \brief Loads STL file into mesh, replacing its vertices.
+     *
+     * Vertex positions are multiplied by scale. threads specifies the
+     * maximum number of threads to use, or 0 for the number of cores.
+     *
+     * \returns statusOK on success. When statusTruncated, the complete
+     * facets before the end of an ASCII file have been loaded. Binary
+     * files that are shorter than their triangle count are statusInvalid,
+     * as they cannot be told apart from files that are not STL at all.
+     */
+    static Status load(const std::string &file, double scale, Mesh &mesh, size_t threads=0)
+    {
+      mesh.vertices.clear();
+      mesh.indices.clear();
+      mesh.bounds = Bounds();
+
+      MappedFile f(file);
+      if (!f)
+        return statusNotFound;
+
+      const unsigned char *data = f.data();
+      size_t size = f.size();
+
+      // Binary files may also start with "solid", so check the size first.
+      size_t count = 0;
+      if (size >= 84)
+      {
+        count = ((uint32_t)data[80]<<0) + ((uint32_t)data[81]<<8) + ((uint32_t)data[82]<<16) + ((uint32_t)data[83]<<24);
+        if (84 + 50*(uint64_t)count == size)
+          return binary(data, count, scale, mesh, threads);
+      }
+
+      if (size >= 5 && !memcmp(data, "solid", 5))
+      {
+        Status status = ascii(data, size, scale, mesh);
+        if (status != statusInvalid || size < 84)
+          return status;
+      }
+
+      if (size < 84 || 84 + 50*(uint64_t)count > size)
+      {
+        mesh.vertices.clear();
+        mesh.bounds = Bounds();
+        return statusInvalid;
+      }
+
+      // Trailing data after the last triangle.
+      return binary(data, count, scale, mesh, threads);
+    }
+
+  protected:
+    /// Number of triangles above which binary files are parsed in parallel.
+    static const size_t parallel_ = 65536;
+
+    /// Converts triangle, given as 3 normal and 9 position coordinates.
+    static void triangle(const float *t, double scale, Vertex *out, Bounds &bounds)
+    {
+      Vector3 n(t[0], t[1], t[2]);
+      Vector3 v[3] = {{t[3], t[4], t[5]}, {t[6], t[7], t[8]}, {t[9], t[10], t[11]}};
+
+      // Calculate normal, if not given
+      if (n.norm() == 0)
+        n = (v[1]-v[0]).cross(v[2]-v[0]);
+      n = n/n.normsq();
+
+      for (size_t ii=0; ii != 3; ++ii)
+      {
+        Vector3 p = v[ii]*scale;
+        Vertex &vtx = out[ii];
+
+        for (size_t jj=0; jj != 3; ++jj)
+        {
+          vtx.position[jj] = p[jj];
+          vtx.normal[jj] = n[jj];
+        }
+        vtx.texcoord[0] = vtx.texcoord[1] = 0;
+        bounds.extend(p);
+      }
+    }
+
+    /// Parses packed 50-byte binary records.
+    static Status binary(const unsigned char *data, size_t count, double scale, Mesh &mesh, size_t threads)
+    {
+      mesh.vertices.resize(3*count);
+
+      if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+      if (count < parallel_)
+        threads = 1;
+
+      std::vector<Bounds> bounds(threads);
+      auto parse = [&](size_t thread)
+      {
+        for (size_t ii=count*thread/threads; ii != count*(thread+1)/threads; ++ii)
+        {
+          // Records are not aligned, and end in a 16-bit attribute.
+          float t[12];
+          memcpy(t, data + 84 + 50*ii, sizeof(t));
+          triangle(t, scale, &mesh.vertices[3*ii], bounds[thread]);
+        }
+      };
+
+      std::vector<std::thread> workers;
+      for (size_t ii=1; ii < threads; ++ii)
+        workers.push_back(std::thread(parse, ii));
+      parse(0);
+
+      for (size_t ii=0; ii != workers.size(); ++ii)
+        workers[ii].join();
+
+      for (size_t ii=0; ii != threads; ++ii)
+        mesh.bounds.extend(bounds[ii]);
+
+      return statusOK;
+    }
+
+    /// Tokenizer for ASCII files.
+    class Tokenizer
+    {
+      protected:
+        const char *ptr_, *end_;
+
+      public:
+        Tokenizer(const char *begin, const char *end) : ptr_(begin), end_(end) { }
+
+        /// Skips rest of the current line.
+        void skipline()
+        {
+          while (ptr_ != end_ && *ptr_ != '\n')
+            ptr_++;
+        }
+
+        /// Returns next whitespace-separated token, or an empty one at the end of the file.
+        std::pair<const char*, size_t> next()
+        {
+          while (ptr_ != end_ && isspace((unsigned char)*ptr_))
+            ptr_++;
+
+          const char *begin = ptr_;
+          while (ptr_ != end_ && !isspace((unsigned char)*ptr_))
+            ptr_++;
+
+          return std::make_pair(begin, (size_t)(ptr_-begin));
+        }
+
+        /// Returns whether next token equals keyword.
+        bool expect(const char *keyword)
+        {
+          std::pair<const char*, size_t> token = next();
+          return token.second == strlen(keyword) && !memcmp(token.first, keyword, token.second);
+        }
+
+        /// Reads next token as number. \returns false on failure.
+        bool number(float *value)
+        {
+          std::pair<const char*, size_t> token = next();
+          char buffer[64];
+
+          // The file is not null-terminated.
+          if (!token.second || token.second >= sizeof(buffer))
+            return false;
+          memcpy(buffer, token.first, token.second);
+          buffer[token.second] = 0;
+
+          char *end;
+          *value = strtof(buffer, &end);
+          return *end == 0;
+        }
+
+        /// Returns whether the end of the file has been reached.
+        bool eof()
+        {
+          while (ptr_ != end_ && isspace((unsigned char)*ptr_))
+            ptr_++;
+          return ptr_ == end_;
+        }
+    };
+
+    /// Parses ASCII file.
+    static Status ascii(const unsigned char *data, size_t size, double scale, Mesh &mesh)
+    {
+      Tokenizer tok((const char*)data, (const char*)data + size);
+      tok.skipline();
+
+      for (size_t facets=0;; ++facets)
+      {
+        if (tok.eof())
+          return facets?statusOK:statusInvalid;
+
+        std::pair<const char*, size_t> token = tok.next();
+        if (token.second == 8 && !memcmp(token.first, "endsolid", 8))
+          return statusOK;
+        if (token.second != 5 || memcmp(token.first, "facet", 5))
+          return facets?statusTruncated:statusInvalid;
+
+        float t[12];
+        bool valid = tok.expect("normal") && tok.number(&t[0]) && tok.number(&t[1]) && tok.number(&t[2]) &&
+                     tok.expect("outer") && tok.expect("loop");
+        for (size_t ii=0; ii != 3 && valid; ++ii)
+          valid = tok.expect("vertex") && tok.number(&t[3+ii*3]) && tok.number(&t[4+ii*3]) && tok.number(&t[5+ii*3]);
+        valid = valid && tok.expect("endloop") && tok.expect("endfacet");
+
+        if (!valid)
+          return facets?statusTruncated:statusInvalid;
+
+        mesh.vertices.resize(mesh.vertices.size()+3);
+        triangle(t, scale, &mesh.vertices[mesh.vertices.size()-3], mesh.bounds);
+      }
+    }
+};
+
+}
+
+#endif // PGL_STL_H_
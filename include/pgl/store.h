@@ -0,0 +1,304 @@
+/** \file store.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the on-disk cache of preprocessed meshes.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_STORE_H_
+#define PGL_STORE_H_
+
+#include "mesh.h"
+#include "file.h"
+
+#include <atomic>
+#include <sstream>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <process.h>
+#endif
+
+namespace pgl {
+
+/**
+ * \brief On-disk cache of preprocessed meshes.
+ *
+ * Stores the vertices, indices and bounds of a set of meshes, such as
+ * the levels of detail of a Model, in a single file. The file is named
+ * after a hash of the source file contents and the load options, so
+ * changing either invalidates it.
+ *
+ * The cache is disabled until a directory is set, e.g.
+ * \code
+ * pgl::MeshStore::directory() = "/tmp";
+ * \endcode
+ *
+ * \note
+ * Cache files are not portable between architectures with different
+ * byte order.
+ */
+class MeshStore
+{
+  public:
+    /// Returns cache directory. Empty if the cache is disabled.
+    static std::string &directory()
+    {
+      static std::string *directory = new std::string();
+      return *directory;
+    }
+
+    /** \brief Returns hash of file contents and load options.
+     *
+     * \returns 0 if the file cannot be read.
+     */
+    static uint64_t hash(const std::string &file, const std::vector<double> &params)
+    {
+      MappedFile f(file);
+      if (!f)
+        return 0;
+
+      uint64_t h = hash(f.data(), f.size(), offset_ ^ version_);
+      h = hash((const unsigned char*)params.data(), params.size()*sizeof(double), h);
+
+      return h?h:1;
+    }
+
+    /// Returns path of the cache file for the given hash.
+    static std::string path(uint64_t hash)
+    {
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx.pglm", (unsigned long long)hash);
+      return directory() + "/" + name;
+    }
+
+    /** \brief Reads meshes from the cache.
+     *
+     * The number of meshes must match the number stored. NULL entries
+     * are skipped.
+     *
+     * \returns statusOK on success, or statusNotFound if there is no
+     * valid cache file for the given hash. Files are invalid if they are
+     * truncated, or contain an unsupported mode or out-of-range indices.
+     */
+    static Status read(uint64_t hash, const std::vector<Mesh*> &meshes)
+    {
+      MappedFile f(path(hash));
+      if (!f)
+        return statusNotFound;
+
+      const unsigned char *ptr = f.data(), *end = f.data() + f.size();
+
+      Header header;
+      if (!extract(ptr, end, &header, sizeof(header)) || memcmp(header.magic, "PGLMESH", 8) ||
+          header.version != version_ || header.hash != hash || header.levels != meshes.size())
+        return statusNotFound;
+
+      // Validate all levels before modifying any mesh.
+      std::vector<std::pair<Level, const unsigned char*> > levels(meshes.size());
+      for (size_t ii=0; ii != meshes.size(); ++ii)
+      {
+        Level &level = levels[ii].first;
+        if (!extract(ptr, end, &level, sizeof(level)) || level.vertices > f.size() || level.indices > f.size() ||
+            (size_t)(end-ptr) < level.vertices*sizeof(Vertex) + level.indices*sizeof(uint32_t) ||
+            !valid(level, (const uint32_t*)(ptr + level.vertices*sizeof(Vertex))))
+          return statusNotFound;
+
+        levels[ii].second = ptr;
+        ptr += level.vertices*sizeof(Vertex) + level.indices*sizeof(uint32_t);
+      }
+
+      for (size_t ii=0; ii != meshes.size(); ++ii)
+      {
+        Mesh *mesh = meshes[ii];
+        if (mesh)
+        {
+          const Level &level = levels[ii].first;
+          const Vertex *vertices = (const Vertex*)levels[ii].second;
+          const uint32_t *indices = (const uint32_t*)(levels[ii].second + level.vertices*sizeof(Vertex));
+
+          mesh->mode = level.mode;
+          mesh->lighting = level.lighting;
+          mesh->vertices.assign(vertices, vertices + level.vertices);
+          mesh->indices.assign(indices, indices + level.indices);
+          mesh->bounds = Bounds({level.lower[0], level.lower[1], level.lower[2]},
+                                {level.upper[0], level.upper[1], level.upper[2]});
+          mesh->error = level.error;
+        }
+      }
+
+      return statusOK;
+    }
+
+    /** \brief Writes meshes to the cache.
+     *
+     * The file is written under a temporary name and then renamed, such
+     * that concurrent readers never see partial files. The name is unique
+     * to the process and call, so concurrent writers do not share it.
+     * Errors are reported on std::cerr.
+     */
+    static bool write(uint64_t hash, const std::vector<const Mesh*> &meshes)
+    {
+      static std::atomic<unsigned long> counter(0);
+
+      std::ostringstream oss;
+#ifdef _WIN32
+      oss << path(hash) << "." << _getpid() << "." << counter++ << ".tmp";
+#else
+      oss << path(hash) << "." << getpid() << "." << counter++ << ".tmp";
+#endif
+      std::string file = path(hash), temporary = oss.str();
+
+      FILE *f = fopen(temporary.c_str(), "wb");
+      if (!f)
+      {
+        std::cerr << "Cannot write mesh cache file " << temporary << std::endl;
+        return false;
+      }
+
+      Header header;
+      memcpy(header.magic, "PGLMESH", 8);
+      header.version = version_;
+      header.levels = meshes.size();
+      header.hash = hash;
+      bool success = fwrite(&header, sizeof(header), 1, f) == 1;
+
+      for (size_t ii=0; ii != meshes.size() && success; ++ii)
+      {
+        const Mesh &mesh = *meshes[ii];
+
+        Level level;
+        memset(&level, 0, sizeof(level));
+        for (size_t jj=0; jj != 3; ++jj)
+        {
+          level.lower[jj] = mesh.bounds.lower[jj];
+          level.upper[jj] = mesh.bounds.upper[jj];
+        }
+        level.error = mesh.error;
+        level.vertices = mesh.vertices.size();
+        level.indices = mesh.indices.size();
+        level.mode = mesh.mode;
+        level.lighting = mesh.lighting;
+
+        success = fwrite(&level, sizeof(level), 1, f) == 1 &&
+                  fwrite(mesh.vertices.data(), sizeof(Vertex), mesh.vertices.size(), f) == mesh.vertices.size() &&
+                  fwrite(mesh.indices.data(), sizeof(uint32_t), mesh.indices.size(), f) == mesh.indices.size();
+      }
+
+      success = !fclose(f) && success;
+      if (success)
+      {
+#ifdef _WIN32
+        // Windows does not replace existing files.
+        remove(file.c_str());
+#endif
+        success = !rename(temporary.c_str(), file.c_str());
+      }
+
+      if (!success)
+      {
+        std::cerr << "Cannot write mesh cache file " << file << std::endl;
+        remove(temporary.c_str());
+      }
+
+      return success;
+    }
+
+  protected:
+    static const uint32_t version_ = 1;                   ///< File format version.
+    static const uint64_t offset_ = 0xcbf29ce484222325ULL; ///< FNV-1a offset basis.
+    static const uint64_t prime_ = 0x100000001b3ULL;       ///< FNV-1a prime.
+
+    struct Header
+    {
+      char magic[8];
+      uint32_t version, levels;
+      uint64_t hash;
+    };
+
+    struct Level
+    {
+      double lower[3], upper[3], error;
+      uint64_t vertices, indices;
+      uint32_t mode, lighting;
+    };
+
+    /** \brief FNV-1a hash, processing 8 bytes at a time.
+     *
+     * Bytewise multiplication chains are too slow for large models.
+     */
+    static uint64_t hash(const unsigned char *data, size_t size, uint64_t h)
+    {
+      size_t ii=0;
+      for (; ii+8 <= size; ii += 8)
+      {
+        uint64_t word;
+        memcpy(&word, data + ii, 8);
+        h = (h ^ word)*prime_;
+      }
+      for (; ii != size; ++ii)
+        h = (h ^ data[ii])*prime_;
+
+      return h;
+    }
+
+    /** \brief Returns whether a level can be drawn as stored.
+     *
+     * Guards against corrupted or stale files: the mode must be one Mesh
+     * supports, the element count must match it, and all indices must
+     * refer to stored vertices.
+     */
+    static bool valid(const Level &level, const uint32_t *indices)
+    {
+      size_t stride;
+      if (level.mode == GL_TRIANGLES)
+        stride = 3;
+      else if (level.mode == GL_LINES)
+        stride = 2;
+      else
+        return false;
+
+      if ((level.indices?level.indices:level.vertices) % stride)
+        return false;
+
+      for (size_t ii=0; ii != level.indices; ++ii)
+        if (indices[ii] >= level.vertices)
+          return false;
+
+      return true;
+    }
+
+    /// Copies size bytes from ptr, advancing it. \returns false if fewer remain.
+    static bool extract(const unsigned char *&ptr, const unsigned char *end, void *out, size_t size)
+    {
+      if ((size_t)(end-ptr) < size)
+        return false;
+
+      memcpy(out, ptr, size);
+      ptr += size;
+      return true;
+    }
+};
+
+}
+
+#endif // PGL_STORE_H_
@@ -0,0 +1,285 @@
+/** \file target.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains the offscreen render target.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_TARGET_H_
+#define PGL_TARGET_H_
+
+#include <string.h>
+#include <deque>
+
+namespace pgl {
+
+#ifdef PGL_MODERN
+
+/**
+ * \brief Offscreen render target.
+ *
+ * Framebuffer object into which a Camera can draw without a window,
+ * optionally multisampled. Pixels can be read back synchronously, or
+ * asynchronously through a ring of pixel buffer objects, such that the
+ * transfer of one frame overlaps with drawing the next. For example,
+ * \code
+ * pgl::RenderTarget target(1920, 1080, 4);
+ * std::vector<unsigned char> pixels(target.size());
+ *
+ * while (running)
+ * {
+ *   target.begin();
+ *   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+ *   camera->draw();
+ *   target.end();
+ *
+ *   target.request();
+ *   if (target.retrieve(pixels.data()))
+ *     encode(pixels); // Frame from a previous iteration.
+ * }
+ * \endcode
+ *
+ * Pixels are RGBA, with rows ordered from bottom to top as in
+ * glReadPixels. Requires PGL_MODERN, but works with both backends.
+ *
+ * \note
+ * The target must be created and used from the thread of the OpenGL
+ * context. Rendering state such as GL_DEPTH_TEST is part of the context,
+ * not the target, and must be set up as for a window.
+ */
+class RenderTarget
+{
+  public:
+    int width,   ///< Width in pixels. Do not modify.
+        height,  ///< Height in pixels. Do not modify.
+        samples; ///< Number of samples per pixel, or 0 without multisampling. Do not modify.
+
+  protected:
+    GLuint fbo_[2];      ///< Framebuffer drawn into, and single-sampled framebuffer read from.
+    GLuint rbo_[3];      ///< Color and depth renderbuffers of fbo_[0], and color renderbuffer of fbo_[1].
+    std::vector<GLuint> pbo_;                         ///< Ring of pixel buffer objects.
+    std::deque<std::pair<size_t, GLsync> > requests_; ///< Pending readbacks, oldest first.
+    size_t next_;        ///< Next pixel buffer object to use.
+    GLint previous_[6];  ///< Draw and read framebuffers and viewport before begin().
+
+  public:
+    /** \brief Allocates a target of the given size.
+     *
+     * samples specifies the number of samples per pixel for multisample
+     * antialiasing, or 0 to disable it. depth specifies whether to
+     * allocate a depth buffer. buffers specifies the number of frames
+     * whose readback can be pending at the same time. Errors are reported
+     * on std::cerr.
+     */
+    RenderTarget(int _width, int _height, int _samples=0, bool depth=true, size_t buffers=3) :
+      width(_width), height(_height), samples(_samples), fbo_{0, 0}, rbo_{0, 0, 0}, pbo_(buffers), next_(0)
+    {
+      GLint draw, read;
+      glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw);
+      glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read);
+
+      glGenFramebuffers(samples?2:1, fbo_);
+      glGenRenderbuffers(samples?3:2, rbo_);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, fbo_[0]);
+      glBindRenderbuffer(GL_RENDERBUFFER, rbo_[0]);
+      glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo_[0]);
+      if (depth)
+      {
+        glBindRenderbuffer(GL_RENDERBUFFER, rbo_[1]);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbo_[1]);
+      }
+      check();
+
+      if (samples)
+      {
+        // Multisampled buffers cannot be read, so resolve into a second framebuffer.
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo_[1]);
+        glBindRenderbuffer(GL_RENDERBUFFER, rbo_[2]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo_[2]);
+        check();
+      }
+      else
+        fbo_[1] = fbo_[0];
+
+      glBindRenderbuffer(GL_RENDERBUFFER, 0);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw);
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, read);
+
+      glGenBuffers(pbo_.size(), pbo_.data());
+      for (size_t ii=0; ii != pbo_.size(); ++ii)
+      {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[ii]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, size(), NULL, GL_STREAM_READ);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    RenderTarget(const RenderTarget&) = delete;
+    RenderTarget &operator=(const RenderTarget&) = delete;
+
+    ~RenderTarget()
+    {
+      for (size_t ii=0; ii != requests_.size(); ++ii)
+        glDeleteSync(requests_[ii].second);
+
+      glDeleteBuffers(pbo_.size(), pbo_.data());
+      glDeleteRenderbuffers(samples?3:2, rbo_);
+      glDeleteFramebuffers(samples?2:1, fbo_);
+    }
+
+    /// Returns size of a frame in bytes.
+    size_t size() const
+    {
+      return (size_t)width*height*4;
+    }
+
+    /// Redirects drawing to this target, and sets the viewport to cover it.
+    void begin()
+    {
+      glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, previous_);
+      glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, previous_+1);
+      glGetIntegerv(GL_VIEWPORT, previous_+2);
+
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_[0]);
+      glViewport(0, 0, width, height);
+    }
+
+    /// Resolves multisampling, and restores the framebuffers and viewport of before begin().
+    void end()
+    {
+      resolve();
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previous_[0]);
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, previous_[1]);
+      glViewport(previous_[2], previous_[3], previous_[4], previous_[5]);
+    }
+
+    /// Returns identifier of the framebuffer to draw into. Drawing must be followed by resolve().
+    GLuint framebuffer() const
+    {
+      return fbo_[0];
+    }
+
+    /** \brief Resolves multisampling, such that the frame can be read.
+     *
+     * Called by end(). Changes the read and draw framebuffer bindings.
+     */
+    void resolve()
+    {
+      if (samples)
+      {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_[0]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_[1]);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+      }
+    }
+
+    /// Reads pixels of the last frame into data, which must hold size() bytes. Stalls until drawing is finished.
+    void read(unsigned char *data)
+    {
+      readPixels(data);
+    }
+
+    /** \brief Starts asynchronous readback of the last frame.
+     *
+     * \returns false if all buffers are pending, in which case retrieve()
+     * must be called first.
+     */
+    bool request()
+    {
+      if (requests_.size() == pbo_.size())
+        return false;
+
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[next_]);
+      readPixels(NULL);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+      requests_.push_back(std::make_pair(next_, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)));
+      next_ = (next_+1)%pbo_.size();
+
+      return true;
+    }
+
+    /** \brief Copies the oldest requested frame into data, which must hold size() bytes.
+     *
+     * Unless wait is set, only does so if its transfer has finished.
+     *
+     * \returns false if no frame was copied.
+     */
+    bool retrieve(unsigned char *data, bool wait=false)
+    {
+      if (requests_.empty())
+        return false;
+
+      GLsync sync = requests_.front().second;
+      GLenum status = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, wait?GL_TIMEOUT_IGNORED:0);
+      if (status == GL_TIMEOUT_EXPIRED)
+        return false;
+
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[requests_.front().first]);
+      void *ptr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size(), GL_MAP_READ_BIT);
+      if (ptr)
+      {
+        memcpy(data, ptr, size());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+      glDeleteSync(sync);
+      requests_.pop_front();
+
+      return ptr != NULL;
+    }
+
+    /// Returns number of frames whose readback is pending.
+    size_t pending() const
+    {
+      return requests_.size();
+    }
+
+  protected:
+    /// Reads resolved pixels into data, or the bound pixel buffer object if data is NULL.
+    void readPixels(unsigned char *data)
+    {
+      GLint framebuffer;
+      glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &framebuffer);
+
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_[1]);
+      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    }
+
+    /// Reports incomplete framebuffers on std::cerr.
+    static void check()
+    {
+      GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      if (status != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Incomplete framebuffer: status 0x" << std::hex << status << std::dec << std::endl;
+    }
+};
+
+#endif // PGL_MODERN
+
+}
+
+#endif // PGL_TARGET_H_
@@ -0,0 +1,204 @@
+/** \file view.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains drawing of several views in one traversal.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_VIEW_H_
+#define PGL_VIEW_H_
+
+#include "mesh.h"
+#include "target.h"
+
+namespace pgl {
+
+class RenderTarget;
+
+/**
+ * \brief Several views of a Scene, drawn with a single traversal.
+ *
+ * Instead of calling Camera::draw() for each view, which traverses the
+ * scene graph every time, the graph is traversed once into a shared
+ * RenderQueue. Nodes are culled only if they are outside every view's
+ * frustum, and world transforms are refreshed once. The queue is sorted
+ * once, and then drawn into each view, skipping primitives outside that
+ * view. For example,
+ * \code
+ * pgl::MultiView views(scene);
+ * views.add(top)->viewport = {0, 0, 640, 480};
+ * views.add(side)->viewport = {640, 0, 640, 480};
+ * views.add(eye, &target);
+ *
+ * views.draw();
+ * \endcode
+ *
+ * Each view is drawn into its Camera::viewport, which must be set for
+ * views without a RenderTarget, and which defaults to the whole target
+ * otherwise. The viewport is not queried from OpenGL; only the
+ * framebuffer bindings are, to restore them after drawing into targets. Only
+ * the viewport is cleared, to the Scene's background color.
+ *
+ * \note
+ * Scene::draw() is not called, so derived scenes should not override it.
+ * The traversal only culls if Camera::culling is enabled for all
+ * cameras. Otherwise, the cameras that enable it only cull the queue.
+ * Levels of detail are chosen for the first camera. Only
+ * nodes that add themselves to the queue or defer themselves, such as
+ * primitives and InstanceGroups, are drawn correctly.
+ */
+class MultiView
+{
+  public:
+    /// Camera, and target to draw into, or NULL for the current framebuffer.
+    struct View
+    {
+      Camera *camera;
+      RenderTarget *target;
+    };
+
+    Scene *scene;             ///< Scene to draw.
+    std::vector<View> views;  ///< Views to draw, in order.
+    RenderQueue queue;        ///< Shared queue. Holds the statistics of the last draw().
+
+  public:
+    /// Specifies the Scene to draw.
+    MultiView(Scene *_scene) : scene(_scene) { }
+
+    /** \brief Adds view. Requires PGL_MODERN if target is given.
+     *
+     * \returns camera, to allow setting its viewport.
+     *
+     * \note
+     * Does not transfer ownership.
+     */
+    Camera *add(Camera *camera, RenderTarget *target=NULL)
+    {
+      views.push_back({camera, target});
+      return camera;
+    }
+
+    /// Draws all views.
+    void draw()
+    {
+      if (views.empty())
+        return;
+
+      Context &context = Context::current();
+
+      std::vector<Frustum> frusta(views.size());
+      std::vector<Camera::Viewport> viewports(views.size());
+      bool culling = true, any = false;
+
+      for (size_t ii=0; ii != views.size(); ++ii)
+      {
+        const View &view = views[ii];
+        Camera::Viewport &vp = viewports[ii];
+
+        vp = view.camera->viewport;
+#ifdef PGL_MODERN
+        if (view.target && !vp.width)
+          vp = {0, 0, view.target->width, view.target->height};
+#endif
+
+        frusta[ii] = Frustum(view.camera->projection(vp)*view.camera->transform);
+        culling = culling && view.camera->culling;
+        any = any || view.camera->culling;
+      }
+
+      // Traverse once, for the union of all views. Views that cull need
+      // up-to-date bounds in the queue, even if others do not cull.
+      Profiler::Timer update(context.profiler, Profiler::phaseUpdate);
+      if (any)
+        scene->update();
+      if (culling)
+      {
+        context.frustum = frusta[0];
+        context.frusta.assign(frusta.begin()+1, frusta.end());
+      }
+      update.stop();
+
+      Profiler::Timer traversal(context.profiler, Profiler::phaseTraversal);
+      context.culling = culling;
+      context.bounded = any;
+      views[0].camera->begin(viewports[0]);
+      context.queue = &queue;
+      scene->Node::draw();
+      context.queue = NULL;
+      context.frusta.clear();
+      traversal.stop();
+
+      Profiler::Timer submit(context.profiler, Profiler::phaseSubmit);
+      queue.sort();
+
+#ifdef PGL_MODERN
+      // Resolving binds the target as read framebuffer, so restore both.
+      GLint framebuffers[2] = {0, 0};
+      for (size_t ii=0; ii != views.size(); ++ii)
+        if (views[ii].target)
+        {
+          glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, framebuffers);
+          glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, framebuffers+1);
+          break;
+        }
+#endif
+
+      glEnable(GL_SCISSOR_TEST);
+      glClearColor(scene->color.x, scene->color.y, scene->color.z, 1);
+
+      for (size_t ii=0; ii != views.size(); ++ii)
+      {
+        const View &view = views[ii];
+        const Camera::Viewport &vp = viewports[ii];
+
+#ifdef PGL_MODERN
+        if (view.target)
+          glBindFramebuffer(GL_DRAW_FRAMEBUFFER, view.target->framebuffer());
+#endif
+
+        glViewport(vp.x, vp.y, vp.width, vp.height);
+        glScissor(vp.x, vp.y, vp.width, vp.height);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Deferred nodes are culled against this view only.
+        view.camera->begin(vp);
+        context.culling = view.camera->culling;
+        context.frustum = frusta[ii];
+        queue.draw(view.camera->culling?&frusta[ii]:NULL);
+
+#ifdef PGL_MODERN
+        if (view.target)
+        {
+          view.target->resolve();
+          glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[0]);
+          glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[1]);
+        }
+#endif
+      }
+
+      glDisable(GL_SCISSOR_TEST);
+
+      queue.clear();
+      Camera::end();
+    }
+};
+
+}
+
+#endif // PGL_VIEW_H_
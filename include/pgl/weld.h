@@ -0,0 +1,446 @@
+/** \file weld.h
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * This file contains conversion of triangle soups into indexed meshes.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pgl.h"
+
+#ifndef PGL_WELD_H_
+#define PGL_WELD_H_
+
+#include "mesh.h"
+
+#include <string.h>
+#include <stdint.h>
+
+namespace pgl {
+
+/**
+ * \brief Vertex welding.
+ *
+ * Turns a non-indexed triangle Mesh, such as loaded from an STL file,
+ * into an indexed one. Vertices closer than epsilon are merged, and
+ * normals are smoothed across edges whose faces make an angle smaller
+ * than the crease angle. Edges with larger angles stay sharp.
+ *
+ * Optionally, triangles are reordered to make better use of the GPU's
+ * post-transform vertex cache, following Tom Forsyth's "Linear-Speed
+ * Vertex Cache Optimisation".
+ *
+ * For example,
+ * \code
+ * scene->attach(new pgl::Model("part.stl", 0.001, pgl::Welder(1e-6, 0.6)));
+ * \endcode
+ */
+class Welder
+{
+  public:
+    double epsilon; ///< Distance below which vertices are merged.
+    double crease;  ///< Angle between faces above which edges stay sharp, in radians.
+    bool reorder;   ///< Whether to optimize triangle order for the vertex cache.
+
+  public:
+    Welder(double _epsilon=1e-6, double _crease=0.6, bool _reorder=true) : epsilon(_epsilon), crease(_crease), reorder(_reorder) { }
+
+    /// Returns parameters, for use as geometry cache key.
+    std::vector<double> key() const
+    {
+      return {epsilon, crease, (double)reorder};
+    }
+
+    /** \brief Welds mesh in place.
+     *
+     * Only applies to non-indexed GL_TRIANGLES meshes. Texture
+     * coordinates are kept; vertices with different texture coordinates
+     * are not merged.
+     */
+    void apply(Mesh &mesh) const
+    {
+      if (mesh.mode != GL_TRIANGLES || !mesh.indices.empty() || mesh.vertices.empty())
+        return;
+
+      const std::vector<Vertex> &in = mesh.vertices;
+      size_t corners = in.size() - in.size()%3, faces = corners/3;
+
+      // Merge positions
+      std::vector<uint32_t> position;
+      size_t positions = weld(in, corners, position);
+
+      // Area-weighted and unit face normals
+      std::vector<Vector3> fn(faces), un(faces);
+      for (size_t ii=0; ii != faces; ++ii)
+      {
+        Vector3 v1 = point(in[3*ii]), v2 = point(in[3*ii+1]), v3 = point(in[3*ii+2]);
+        fn[ii] = (v2-v1).cross(v3-v1);
+        double norm = fn[ii].norm();
+        un[ii] = norm>0?fn[ii]/norm:Vector3(0, 0, 0);
+      }
+
+      // Corners around each position
+      std::vector<uint32_t> offset(positions+1, 0), around(corners);
+      for (size_t ii=0; ii != corners; ++ii)
+        offset[position[ii]+1]++;
+      for (size_t ii=0; ii != positions; ++ii)
+        offset[ii+1] += offset[ii];
+      std::vector<uint32_t> fill(offset.begin(), offset.end()-1);
+      for (size_t ii=0; ii != corners; ++ii)
+        around[fill[position[ii]]++] = ii;
+
+      // Smooth normals, and merge identical vertices around each position
+      double limit = cos(crease);
+      std::vector<Vertex> out;
+      std::vector<uint32_t> indices(corners);
+
+      for (size_t p=0; p != positions; ++p)
+      {
+        size_t start = out.size();
+        const float *pos = in[around[offset[p]]].position;
+
+        for (size_t ii=offset[p]; ii != offset[p+1]; ++ii)
+        {
+          size_t corner = around[ii];
+          const Vector3 &n = un[corner/3];
+
+          Vector3 sum(0, 0, 0);
+          for (size_t jj=offset[p]; jj != offset[p+1]; ++jj)
+          {
+            size_t face = around[jj]/3;
+            if (un[face].x*n.x + un[face].y*n.y + un[face].z*n.z >= limit)
+              sum = sum + fn[face];
+          }
+
+          // Keep original normal for degenerate faces.
+          Vertex v = in[corner];
+          memcpy(v.position, pos, sizeof(v.position));
+          double norm = sum.norm();
+          if (norm > 0)
+            for (size_t kk=0; kk != 3; ++kk)
+              v.normal[kk] = sum[kk]/norm;
+
+          size_t jj=start;
+          for (; jj != out.size(); ++jj)
+            if (!memcmp(out[jj].normal, v.normal, sizeof(v.normal)) &&
+                !memcmp(out[jj].texcoord, v.texcoord, sizeof(v.texcoord)))
+              break;
+          if (jj == out.size())
+            out.push_back(v);
+          indices[corner] = jj;
+        }
+      }
+
+      if (reorder)
+        optimize(indices, out.size());
+
+      // Store vertices in order of first use, for locality.
+      std::vector<uint32_t> remap(out.size(), (uint32_t)-1);
+      mesh.vertices.clear();
+      mesh.vertices.reserve(out.size());
+      for (size_t ii=0; ii != indices.size(); ++ii)
+      {
+        uint32_t &r = remap[indices[ii]];
+        if (r == (uint32_t)-1)
+        {
+          r = mesh.vertices.size();
+          mesh.vertices.push_back(out[indices[ii]]);
+        }
+        indices[ii] = r;
+      }
+
+      mesh.indices.swap(indices);
+      mesh.bounds = Bounds();
+      for (size_t ii=0; ii != mesh.vertices.size(); ++ii)
+        mesh.bounds.extend(point(mesh.vertices[ii]));
+    }
+
+  protected:
+    static Vector3 point(const Vertex &v)
+    {
+      return Vector3(v.position[0], v.position[1], v.position[2]);
+    }
+
+    /** \brief Merges positions closer than epsilon using a hash grid.
+     *
+     * Each position is compared against the representatives in its own
+     * grid cell, and in the neighboring cells whose boundary is closer
+     * than epsilon. If epsilon is not positive, only identical positions
+     * are merged.
+     *
+     * \returns number of unique positions, with the index of each
+     * corner's position in index.
+     */
+    size_t weld(const std::vector<Vertex> &in, size_t corners, std::vector<uint32_t> &index) const
+    {
+      // Cells larger than epsilon make searching neighbors rare.
+      double cell = 8*epsilon;
+      double epsq = epsilon>0?epsilon*epsilon:0;
+
+      Grid head;                   // grid cell -> first representative
+      std::vector<uint32_t> next;  // representative -> next in same cell
+      std::vector<Vector3> first;  // representative -> position
+      index.resize(corners);
+
+      for (size_t ii=0; ii != corners; ++ii)
+      {
+        Vector3 p = point(in[ii]);
+        int64_t c[3];
+        int lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+        for (size_t kk=0; kk != 3; ++kk)
+        {
+          if (epsilon > 0)
+          {
+            double f = floor(p[kk]/cell);
+            c[kk] = (int64_t)f;
+            lo[kk] = -(p[kk] - f*cell < epsilon);
+            hi[kk] = (f*cell + cell - p[kk] < epsilon);
+          }
+          else
+          {
+            // For exact matching, the cell is given by the coordinate bits.
+            int32_t bits;
+            memcpy(&bits, &in[ii].position[kk], sizeof(bits));
+            c[kk] = bits;
+          }
+        }
+
+        uint32_t found = (uint32_t)-1;
+        for (int dx=lo[0]; dx <= hi[0] && found == (uint32_t)-1; ++dx)
+          for (int dy=lo[1]; dy <= hi[1] && found == (uint32_t)-1; ++dy)
+            for (int dz=lo[2]; dz <= hi[2] && found == (uint32_t)-1; ++dz)
+            {
+              for (uint32_t rep=head.find(hash(c[0]+dx, c[1]+dy, c[2]+dz)); rep != (uint32_t)-1; rep=next[rep])
+                if ((first[rep]-p).normsq() <= epsq)
+                {
+                  found = rep;
+                  break;
+                }
+            }
+
+        if (found == (uint32_t)-1)
+        {
+          found = first.size();
+          next.push_back(head.set(hash(c[0], c[1], c[2]), found));
+          first.push_back(p);
+        }
+
+        index[ii] = found;
+      }
+
+      return first.size();
+    }
+
+    /// Hashes grid cell coordinates. Collisions only cost extra comparisons.
+    static uint64_t hash(int64_t x, int64_t y, int64_t z)
+    {
+      return (uint64_t)x*73856093ull ^ (uint64_t)y*19349663ull ^ (uint64_t)z*83492791ull;
+    }
+
+    /// Open-addressing hash table from grid cell hash to representative.
+    class Grid
+    {
+      protected:
+        std::vector<uint64_t> keys_;
+        std::vector<uint32_t> values_;
+        size_t size_;
+
+      public:
+        Grid() : keys_(1024), values_(1024, (uint32_t)-1), size_(0) { }
+
+        /// Returns value of key, or -1 if not present.
+        uint32_t find(uint64_t key) const
+        {
+          size_t mask = keys_.size()-1;
+          for (size_t ii=mix(key)&mask;; ii=(ii+1)&mask)
+            if (values_[ii] == (uint32_t)-1 || keys_[ii] == key)
+              return values_[ii];
+        }
+
+        /// Sets value of key. \returns previous value, or -1 if not present.
+        uint32_t set(uint64_t key, uint32_t value)
+        {
+          if (2*(size_+1) > keys_.size())
+            grow();
+
+          size_t mask = keys_.size()-1, ii=mix(key)&mask;
+          while (values_[ii] != (uint32_t)-1 && keys_[ii] != key)
+            ii = (ii+1)&mask;
+
+          uint32_t previous = values_[ii];
+          if (previous == (uint32_t)-1)
+            size_++;
+          keys_[ii] = key;
+          values_[ii] = value;
+
+          return previous;
+        }
+
+      protected:
+        static size_t mix(uint64_t key)
+        {
+          key ^= key >> 33;
+          key *= 0xff51afd7ed558ccdull;
+          return key ^ (key >> 33);
+        }
+
+        void grow()
+        {
+          std::vector<uint64_t> keys(2*keys_.size());
+          std::vector<uint32_t> values(2*values_.size(), (uint32_t)-1);
+          keys.swap(keys_);
+          values.swap(values_);
+          size_ = 0;
+
+          for (size_t ii=0; ii != keys.size(); ++ii)
+            if (values[ii] != (uint32_t)-1)
+              set(keys[ii], values[ii]);
+        }
+    };
+
+    /// Forsyth vertex score, given position in cache (or -1) and remaining valence.
+    static double score(int position, size_t valence)
+    {
+      // Tables avoid pow() in the inner loop.
+      struct Tables
+      {
+        enum {size = 32, valences = 32};
+        double cache[size+1], valence[valences];
+
+        Tables()
+        {
+          cache[0] = 0;
+          for (int ii=0; ii != size; ++ii)
+            cache[ii+1] = ii < 3?0.75:pow(1 - (ii-3)/(double)(size-3), 1.5);
+          valence[0] = -1;
+          for (int ii=1; ii != valences; ++ii)
+            valence[ii] = 2*pow((double)ii, -0.5);
+        }
+      };
+
+      // Initialized once, even when welding on several Loader threads.
+      static const Tables tables;
+
+      if (!valence)
+        return -1;
+
+      return tables.cache[position+1] + (valence < (size_t)Tables::valences?tables.valence[valence]:2*pow((double)valence, -0.5));
+    }
+
+    /// Reorders triangles for post-transform vertex cache efficiency.
+    static void optimize(std::vector<uint32_t> &indices, size_t vertices)
+    {
+      const int size = 32;
+      size_t faces = indices.size()/3;
+
+      // Triangles using each vertex
+      std::vector<uint32_t> offset(vertices+1, 0), valence(vertices, 0), tris(indices.size());
+      for (size_t ii=0; ii != indices.size(); ++ii)
+        offset[indices[ii]+1]++;
+      for (size_t ii=0; ii != vertices; ++ii)
+        offset[ii+1] += offset[ii];
+      for (size_t ii=0; ii != indices.size(); ++ii)
+        tris[offset[indices[ii]] + valence[indices[ii]]++] = ii/3;
+
+      std::vector<int> position(vertices, -1);
+      std::vector<double> vscore(vertices), tscore(faces, 0);
+      std::vector<bool> added(faces, false);
+
+      for (size_t ii=0; ii != vertices; ++ii)
+        vscore[ii] = score(-1, valence[ii]);
+      for (size_t ii=0; ii != indices.size(); ++ii)
+        tscore[ii/3] += vscore[indices[ii]];
+
+      std::vector<uint32_t> out, cache, updated;
+      out.reserve(indices.size());
+      size_t cursor = 0;
+      int64_t best = -1;
+
+      while (out.size() != indices.size())
+      {
+        if (best < 0)
+        {
+          // No candidate adjacent to the cache; take the next unused triangle.
+          while (added[cursor])
+            cursor++;
+          best = cursor;
+        }
+
+        const uint32_t *t = &indices[3*best];
+        added[best] = true;
+
+        // Remove triangle from its vertices' lists
+        for (size_t ii=0; ii != 3; ++ii)
+        {
+          uint32_t v = t[ii];
+          out.push_back(v);
+
+          uint32_t *list = &tris[offset[v]];
+          for (size_t jj=0; jj != valence[v]; ++jj)
+            if (list[jj] == best)
+            {
+              list[jj] = list[--valence[v]];
+              break;
+            }
+        }
+
+        // Move triangle's vertices to the front of the cache
+        updated.assign(t, t+3);
+        for (size_t ii=0; ii != cache.size(); ++ii)
+          if (cache[ii] != t[0] && cache[ii] != t[1] && cache[ii] != t[2])
+            updated.push_back(cache[ii]);
+        cache.swap(updated);
+
+        for (size_t ii=0; ii != cache.size(); ++ii)
+          position[cache[ii]] = ii < (size_t)size?ii:-1;
+
+        // Rescore affected vertices and their triangles
+        for (size_t ii=0; ii != cache.size(); ++ii)
+        {
+          uint32_t v = cache[ii];
+          double delta = score(position[v], valence[v]) - vscore[v];
+          vscore[v] += delta;
+          for (size_t jj=0; jj != valence[v]; ++jj)
+            tscore[tris[offset[v]+jj]] += delta;
+        }
+
+        if (cache.size() > (size_t)size)
+          cache.resize(size);
+
+        best = -1;
+        double bestscore = 0;
+        for (size_t ii=0; ii != cache.size(); ++ii)
+        {
+          uint32_t v = cache[ii];
+          for (size_t jj=0; jj != valence[v]; ++jj)
+          {
+            uint32_t tri = tris[offset[v]+jj];
+            if (tscore[tri] > bestscore)
+            {
+              bestscore = tscore[tri];
+              best = tri;
+            }
+          }
+        }
+      }
+
+      indices.swap(out);
+    }
+};
+
+}
+
+#endif // PGL_WELD_H_
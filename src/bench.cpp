@@ -0,0 +1,362 @@
+/** \file bench.cpp
+ *
+ * PGL, a primitive OpenGL 3D primitive library.
+ *
+ * Benchmarks for math, loading, tessellation and drawing.
+ *
+ * (c) 2020, Wouter Caarls.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Usage: pgl_bench [--time SECONDS] [--large] [FILTER]
+ *
+ * Runs every benchmark whose name contains FILTER for at least SECONDS
+ * (default 0.2), and writes one CSV line per result to standard output.
+ * Scenes are drawn into an offscreen RenderTarget of a hidden window,
+ * using both backends. --large adds the largest model sizes.
+ */
+
+// Both backends are compared at run time.
+#define PGL_MODERN
+
+#include <pgl/pgl.h>
+
+// OpenGL was included by pgl.h, with the prototypes PGL_MODERN needs.
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+
+double time__ = 0.2;
+std::string filter__;
+volatile double sink__;
+
+/// Returns whether the benchmark is selected by the filter.
+bool selected(const std::string &name)
+{
+  return name.find(filter__) != std::string::npos;
+}
+
+/// Runs fn until time__ has passed, and reports seconds per run and items per second.
+void measure(const std::string &name, const std::string &backend, size_t size, const std::function<void()> &fn)
+{
+  if (!selected(name))
+    return;
+
+  size_t runs = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  double elapsed = 0;
+
+  do
+  {
+    fn();
+    runs++;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  } while (elapsed < time__);
+
+  double seconds = elapsed/runs;
+  printf("%s,%s,%zu,%zu,%.9g,%.6g\n", name.c_str(), backend.c_str(), size, runs, seconds, size/seconds);
+  fflush(stdout);
+}
+
+/// Writes a binary STL file of a wavy grid with the given number of triangles.
+void synthesize(const std::string &file, size_t triangles)
+{
+  FILE *f = fopen(file.c_str(), "wb");
+  if (!f)
+  {
+    std::cerr << "Cannot write " << file << std::endl;
+    exit(1);
+  }
+
+  char header[80] = "pgl_bench";
+  uint32_t count = triangles;
+  fwrite(header, 1, 80, f);
+  fwrite(&count, 4, 1, f);
+
+  size_t side = std::max((size_t)sqrt(triangles/2.), (size_t)1);
+  auto point = [side](size_t ii, size_t jj, float *p)
+  {
+    p[0] = ii/(double)side;
+    p[1] = jj/(double)side;
+    p[2] = 0.05*sin(p[0]*20)*cos(p[1]*20);
+  };
+
+  for (size_t ii=0; ii != triangles; ++ii)
+  {
+    size_t cell = (ii/2)%(side*side), x = cell%side, y = cell/side;
+    float facet[12] = {0, 0, 1};
+    if (ii%2)
+    {
+      point(x, y, facet+3);
+      point(x+1, y, facet+6);
+      point(x+1, y+1, facet+9);
+    }
+    else
+    {
+      point(x, y, facet+3);
+      point(x+1, y+1, facet+6);
+      point(x, y+1, facet+9);
+    }
+    uint16_t attributes = 0;
+    fwrite(facet, 4, 12, f);
+    fwrite(&attributes, 2, 1, f);
+  }
+
+  fclose(f);
+}
+
+/// Returns a scene of n primitives, either attached to the root or in chains of 64 nested objects.
+pgl::Scene *build(size_t n, bool deep)
+{
+  auto scene = new pgl::Scene();
+  size_t side = std::max((size_t)sqrt(n), (size_t)1);
+  pgl::Node *parent = scene;
+
+  for (size_t ii=0; ii != n; ++ii)
+  {
+    pgl::Vector3 position(2.*(ii%side)/side-1, 2.*(ii/side)/side-1, 0);
+    pgl::Primitive *primitive;
+
+    if (deep)
+    {
+      if (ii%64 == 0)
+        parent = scene;
+      pgl::Object *object = parent->attach(new pgl::Object());
+      object->transform = pgl::Translation(ii%64?pgl::Vector3(0, 0, 0.001):position);
+      position = {0, 0, 0};
+      parent = object;
+    }
+
+    if (ii%2)
+      primitive = new pgl::Box({1./side, 1./side, 1./side}, position);
+    else
+      primitive = new pgl::Sphere(0.5/side, position, 8);
+    primitive->color = {(ii%3)/2., (ii%5)/4., 1};
+
+    parent->attach(primitive);
+  }
+
+  return scene;
+}
+
+void math()
+{
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+
+  const size_t n = 1024;
+  std::vector<pgl::Transform> transforms;
+  std::vector<pgl::Vector3> vectors;
+  for (size_t ii=0; ii != n; ++ii)
+  {
+    transforms.push_back(pgl::Rotation({uniform(rng), uniform(rng), uniform(rng)})*pgl::Translation({uniform(rng), uniform(rng), uniform(rng)}));
+    vectors.push_back({uniform(rng), uniform(rng), uniform(rng)});
+  }
+
+  measure("transform_mul", "-", n, [&]()
+  {
+    pgl::Transform t = transforms[0];
+    for (size_t ii=0; ii != n; ++ii)
+      t = transforms[ii]*t;
+    sink__ = t[0];
+  });
+
+  measure("transform_vector", "-", n, [&]()
+  {
+    pgl::Vector3 v(0, 0, 0);
+    for (size_t ii=0; ii != n; ++ii)
+      v = v + transforms[ii]*vectors[ii];
+    sink__ = v.x;
+  });
+
+  measure("transform4f_mul", "-", n, [&]()
+  {
+    pgl::Transform4f t(transforms[0]);
+    for (size_t ii=0; ii != n; ++ii)
+      t = pgl::Transform4f(transforms[ii])*t;
+    sink__ = t.data[0];
+  });
+
+  measure("vector3_ops", "-", n, [&]()
+  {
+    double sum = 0;
+    for (size_t ii=1; ii != n; ++ii)
+    {
+      const pgl::Vector3 &a = vectors[ii-1], &b = vectors[ii];
+      sum += a.cross(b).norm() + (a+b*0.5).normsq();
+    }
+    sink__ = sum;
+  });
+}
+
+void tessellation()
+{
+  // Vary the radius to avoid the geometry cache.
+  size_t facets[] = {8, 32, 128};
+  for (size_t ii=0; ii != 3; ++ii)
+  {
+    size_t run = 0;
+    measure("tessellate_sphere", "-", facets[ii], [&]()
+    {
+      pgl::Sphere sphere(1+1e-9*run++, {0, 0, 0}, facets[ii]);
+      sink__ = sphere.mesh()->vertices.size();
+    });
+    measure("tessellate_cylinder", "-", facets[ii], [&]()
+    {
+      pgl::Cylinder cylinder(1, 1+1e-9*run++, -1, facets[ii]);
+      sink__ = cylinder.mesh()->vertices.size();
+    });
+  }
+}
+
+void loading(bool large)
+{
+  const std::string file = "pgl_bench.stl";
+  size_t sizes[] = {10000, 100000, 1000000, 10000000};
+
+  for (size_t ii=0; ii != (large?4:3); ++ii)
+  {
+    if (!selected("model_load") && !selected("model_weld"))
+      break;
+
+    synthesize(file, sizes[ii]);
+
+    // Loaded meshes are shared until the Model is deleted, so every run loads again.
+    measure("model_load", "-", sizes[ii], [&]()
+    {
+      pgl::Model model(file);
+      sink__ = model.mesh()->count();
+    });
+    measure("model_weld", "-", sizes[ii], [&]()
+    {
+      pgl::Model model(file, 1, pgl::Welder());
+      sink__ = model.mesh()->count();
+    });
+  }
+
+  remove(file.c_str());
+}
+
+void drawing()
+{
+  const char *backends[] = {"displaylist", "vbo"};
+  size_t sizes[] = {10000, 100000, 1000000};
+  pgl::RenderTarget target(512, 512);
+
+  for (size_t ii=0; ii != 3; ++ii)
+    for (size_t deep=0; deep != 2; ++deep)
+    {
+      std::string layout = deep?"deep":"flat";
+      if (!selected("scene_build_" + layout) && !selected("frame_" + layout) &&
+          !selected("frame_sorted_" + layout) && !selected("frame_culled_" + layout))
+        continue;
+
+      measure("scene_build_" + layout, "-", sizes[ii], [&]()
+      {
+        delete build(sizes[ii], deep);
+      });
+
+      pgl::Scene *scene = build(sizes[ii], deep);
+      pgl::Camera camera(scene);
+      pgl::OrbitController controller(&camera);
+
+      for (size_t jj=0; jj != 2; ++jj)
+      {
+        pgl::Context::current().backend = jj?pgl::backendVBO:pgl::backendDisplayList;
+
+        auto frame = [&](const std::string &name, bool culling, bool sorting, double distance)
+        {
+          controller.view(0.5, 0.4, distance);
+          camera.culling = culling;
+          camera.sorting = sorting;
+
+          // Upload meshes before measuring.
+          target.begin();
+          camera.draw();
+          target.end();
+
+          measure(name + "_" + layout, backends[jj], sizes[ii], [&]()
+          {
+            target.begin();
+            camera.draw();
+            target.end();
+            glFinish();
+          });
+        };
+
+        frame("frame", false, false, 3);
+        frame("frame_sorted", false, true, 3);
+        frame("frame_culled", true, false, 0.5);
+      }
+
+      pgl::Context::current().backend = pgl::backendDisplayList;
+      delete scene;
+    }
+}
+
+int main(int argc, char **argv)
+{
+  bool large = false;
+  for (int ii=1; ii < argc; ++ii)
+  {
+    if (!strcmp(argv[ii], "--time") && ii+1 < argc)
+      time__ = atof(argv[++ii]);
+    else if (!strcmp(argv[ii], "--large"))
+      large = true;
+    else
+      filter__ = argv[ii];
+  }
+
+  // Initialize GLFW with a hidden window
+  if (glfwInit() != GL_TRUE)
+  {
+    std::cerr << "Failed to initialize GLFW" << std::endl;
+    return 1;
+  }
+
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "PGL benchmark", NULL, NULL);
+  if (window == nullptr)
+  {
+    std::cerr << "Failed to create window" << std::endl;
+    return 1;
+  }
+
+  glfwMakeContextCurrent(window);
+
+  // Setup OpenGL as in the example
+  glEnable(GL_LIGHTING);
+  glEnable(GL_LIGHT0);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_COLOR_MATERIAL);
+  glEnable(GL_CULL_FACE);
+  glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
+  glCullFace(GL_BACK);
+
+  printf("benchmark,backend,size,runs,seconds,items_per_second\n");
+
+  math();
+  tessellation();
+  loading(large);
+  drawing();
+
+  glfwTerminate();
+
+  return 0;
+}
@@ -18,30 +18,29 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <GLFW/glfw3.h>
-
 #include <pgl/pgl.h>
 
+// OpenGL was included by pgl.h, with the prototypes PGL_MODERN needs.
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+#include <cmath>
 #include <iostream>
-#include <thread>
 
-bool stop__ = false;
 pgl::Camera *camera__;
 pgl::Object *object__;
 pgl::OrbitController *controller__;
+pgl::RenderLoop *loop__;
 
-void refresh(GLFWwindow* window)
+void refresh(GLFWwindow* /*window*/)
 {
-  camera__->draw();
-  
-  object__->transform = pgl::Rotation({0, 0, 0.01}) * object__->transform;
-  
-  glfwSwapBuffers(window);
+  loop__->invalidate();
 }
 
 void reshape(GLFWwindow* /*window*/, int width, int height)
 {
   glViewport(0, 0, width, height);
+  loop__->invalidate();
 }
 
 void click(GLFWwindow* window, int button, int action, int mods)
@@ -63,7 +62,7 @@ void motion(GLFWwindow* /*window*/, double xpos, double ypos)
 
 void close(GLFWwindow* /*window*/)
 {
-  stop__ = true;
+  loop__->stop();
 }
 
 int main(void)
@@ -83,6 +82,10 @@ int main(void)
   }
   
   glfwMakeContextCurrent(window);
+  glfwSwapInterval(1);
+  
+  // Load large assets in the background
+  pgl::Loader loader;
   
   // Initialize our scene
   auto scene = new pgl::Scene();
@@ -99,11 +102,11 @@ int main(void)
   object__->attach(new pgl::Capsule({0, -0.3, 0}, {0, 0.3, 0}, 0.02))->color = {0, 1, 0};
   
   // Add STL model
-  scene->attach(new pgl::Model("teapot.stl", {0, 0, -1}, 0.1))->color = {1, 1, 0};
+  scene->attach(new pgl::Model(loader, "teapot.stl", {0, 0, -1}, 0.1))->color = {1, 1, 0};
 
   // Add some planes
   scene->attach(new pgl::Plane({-100, 0, 0}, {0, 100, 0}, {0, 0, 10}))->color = {0.5, 0.5, 1};
-  scene->attach(new pgl::Plane({1, 0, 0}, {0, 1, 0}, {0, 0, -1}, pgl::Texture("ceramic-tiles.ppm"), 9));
+  scene->attach(new pgl::Plane({1, 0, 0}, {0, 1, 0}, {0, 0, -1}, pgl::Texture(loader, "ceramic-tiles.ppm"), 9));
   scene->attach(new pgl::Plane({1, 0, 0}, {0, 0, 1}, {0, 1, 0}, pgl::Checkerboard4x4()))->color = {0, 1, 1};
   
   // Initialize camera
@@ -112,6 +115,29 @@ int main(void)
   // Initialize orbit controller
   controller__ = new pgl::OrbitController(camera__);
   controller__->view(0.5, 0.4, 4);
+  controller__->damping = 0.08;
+  
+  // Only redraw when something changed
+  loop__ = new pgl::RenderLoop(controller__, &loader);
+  loop__->frame = [window](double dt)
+  {
+    camera__->draw();
+    glfwSwapBuffers(window);
+    
+    // Animate at a fixed speed, regardless of the frame rate
+    object__->transform = pgl::Rotation({0, 0, 0.6*dt}) * object__->transform;
+    loop__->invalidate();
+  };
+  loop__->wait = [](double timeout)
+  {
+    if (timeout == 0)
+      glfwPollEvents();
+    else if (std::isinf(timeout))
+      glfwWaitEvents();
+    else
+      glfwWaitEventsTimeout(timeout);
+  };
+  loop__->wake = glfwPostEmptyEvent;
 
   // Register callbacks for orbit controller
   glfwSetWindowRefreshCallback(window, refresh);
@@ -130,18 +156,15 @@ int main(void)
   glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
   glCullFace(GL_BACK);
 
-  // Main loop  
-  stop__ = false;
-  while (!stop__)
-  {
-    glfwPollEvents();
-    refresh(window);
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-  }
+  // Main loop
+  loop__->run();
+  
+  std::cout << loop__->stats().frames << " frames, " << loop__->stats().mean*1000 << " ms on average" << std::endl;
   
   // Clean up
   glfwTerminate();
   
+  delete loop__;
   delete controller__;
   delete camera__;
   delete scene;